@@ -0,0 +1,5011 @@
+// Rate limiters, the service built on them, the decision server and its client. main.cpp (demo
+// and decision daemon) and benchmarks.cpp build on it; see the Makefile.
+#pragma once
+#include<bits/stdc++.h>
+#include<mutex>
+#include<chrono>
+#include<thread>
+#include<unistd.h>
+#include<fcntl.h>
+#include<signal.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/wait.h>
+#include<sys/resource.h>
+#include<sys/epoll.h>
+#include<sys/eventfd.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<netinet/in.h>
+#include<netinet/tcp.h>
+#include<arpa/inet.h>
+#ifdef __GLIBC__
+#include<malloc.h>
+#endif
+using namespace std;
+
+enum class UserTier {
+    Free,
+    Premium,
+    Enterprise
+};
+
+enum class RateLimiterType {
+    TokenBucket,
+    FixedWindow,
+    SlidingWindow,
+    SlidingWindowCounter,
+    LockFreeTokenBucket,
+    GCRA,
+    SharedMemoryTokenBucket,
+    CountMinSketch
+};
+constexpr int kUserTierCount = (int)UserTier::Enterprise + 1;
+constexpr int kRateLimiterTypeCount = (int)RateLimiterType::CountMinSketch + 1;
+
+const char* rateLimiterTypeName(RateLimiterType type) {
+    static const char* names[kRateLimiterTypeCount] = {
+        "TokenBucket", "FixedWindow", "SlidingWindow", "SlidingWindowCounter", "LockFreeTokenBucket", "GCRA", "SharedMemoryTokenBucket", "CountMinSketch"
+    };
+    return names[(int)type];
+}
+
+class RateLimiterConfiguration {
+public:
+    int maxRequests;
+    int timeWindowSeconds;
+    int shardCount; // Number of independently locked shards the per-user state is spread over
+    RateLimiterConfiguration(int maxReq, int timeWindow, int shards = 16) : maxRequests(maxReq), timeWindowSeconds(timeWindow), shardCount(shards) {}
+};
+
+class User {
+public:
+    string userId;
+    UserTier tier;
+    User(string id, UserTier tier) : userId(id), tier(tier) {}
+};
+
+// Time source shared by all limiters: nanoseconds on a monotonic timeline
+class Clock {
+public:
+    virtual long long nowNanos() = 0;
+    virtual ~Clock() {}
+    static shared_ptr<Clock> monotonic();
+};
+
+// Precise clock: reads the steady clock on every call
+class MonotonicClock final : public Clock {
+public:
+    long long nowNanos() override {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+inline shared_ptr<Clock> Clock::monotonic() {
+    static shared_ptr<Clock> clock = make_shared<MonotonicClock>();
+    return clock;
+}
+
+// Coarse clock for the hot path: a background ticker stores the steady clock every `resolution`,
+// and reading it is a single relaxed atomic load. Times lag real time by up to one resolution.
+class CoarseClock final : public Clock {
+    atomic<long long> cachedNanos;
+    atomic<bool> stopping{false};
+    thread ticker;
+public:
+    CoarseClock(chrono::microseconds resolution = chrono::microseconds(1000)) : cachedNanos(MonotonicClock().nowNanos()) {
+        ticker = thread([this, resolution]() {
+            MonotonicClock precise;
+            while(!stopping.load(memory_order_relaxed)){
+                this_thread::sleep_for(resolution);
+                cachedNanos.store(precise.nowNanos(), memory_order_relaxed);
+            }
+        });
+    }
+    ~CoarseClock() {
+        stopping = true;
+        ticker.join();
+    }
+    long long nowNanos() override { return cachedNanos.load(memory_order_relaxed); }
+};
+
+// Clock that only moves when told to, for tests and trace replay
+class ManualClock final : public Clock {
+    atomic<long long> currentNanos;
+public:
+    ManualClock(long long startNanos = 0) : currentNanos(startNanos) {}
+    long long nowNanos() override { return currentNanos.load(memory_order_relaxed); }
+    void set(long long nanos) { currentNanos.store(nanos, memory_order_relaxed); }
+    void advance(chrono::nanoseconds duration) { currentNanos.fetch_add(duration.count(), memory_order_relaxed); }
+};
+
+// The clock a limiter reads when given none: the shared monotonic clock, or a ClockType of its own
+template<typename ClockType>
+shared_ptr<ClockType> defaultClock() {
+    if constexpr(is_same_v<ClockType, Clock> || is_same_v<ClockType, MonotonicClock>) return static_pointer_cast<ClockType>(Clock::monotonic());
+    else return make_shared<ClockType>();
+}
+
+// Hash used for user ids everywhere (shard choice, table slot, key handles); never 0
+inline uint64_t hashUserId(string_view userId) {
+    uint64_t h = hash<string_view>{}(userId);
+    return h ? h : 1;
+}
+
+// A user id resolved once, e.g. per connection, and reused for all of its requests. It carries
+// the id's hash and remembers where the user's state sits in its limiter, so a repeat decision
+// needs no key copy, no hashing and no lookup while that table's layout is unchanged.
+// A handle must not be used by two threads at the same time.
+struct KeyHandle {
+    string userId;
+    uint64_t keyHash;
+    const void* table = nullptr; // Table the cached slot belongs to
+    size_t slot = 0;
+    uint64_t generation = 0; // Table layout the cached slot was found in
+    KeyHandle(string_view userId) : userId(userId), keyHash(hashUserId(userId)) {}
+};
+
+// Code that takes either kind of key gets its hash and id through these
+inline uint64_t hashOf(string_view userId) { return hashUserId(userId); }
+inline uint64_t hashOf(const KeyHandle& handle) { return handle.keyHash; }
+inline string_view userIdOf(string_view userId) { return userId; }
+inline string_view userIdOf(const KeyHandle& handle) { return handle.userId; }
+
+// Open-addressing hash table with linear probing. Each slot keeps the key's hash, the key and
+// its state inline, so a lookup walks one contiguous array instead of chasing tree nodes, and
+// the caller hashes the key once and passes that hash to every operation.
+template<typename State>
+class FlatHashMap {
+    struct Slot {
+        uint64_t hash = 0; // 0 marks an empty slot
+        State state{};
+        string key;
+    };
+    vector<Slot> slots;
+    size_t count = 0;
+    size_t mask = 0;
+    // Bumped whenever existing entries move (grow, erase). Every table starts in its own range,
+    // so a KeyHandle never mistakes a new table at a freed table's address for the old one.
+    static inline atomic<uint64_t> nextGenerationRange{1};
+    uint64_t layoutGeneration = nextGenerationRange.fetch_add(1ull << 32, memory_order_relaxed);
+
+    void grow() {
+        vector<Slot> old = std::move(slots);
+        slots = vector<Slot>(old.empty() ? 16 : old.size() * 2);
+        mask = slots.size() - 1;
+        layoutGeneration++;
+        for(Slot& slot : old){
+            if(slot.hash == 0) continue;
+            size_t i = slot.hash & mask;
+            while(slots[i].hash != 0) i = (i + 1) & mask;
+            slots[i] = std::move(slot);
+        }
+    }
+    // Index of the key's slot, or of the empty slot where it would be inserted
+    size_t probe(uint64_t keyHash, string_view key) const {
+        size_t i = keyHash & mask;
+        while(slots[i].hash != 0 && !(slots[i].hash == keyHash && slots[i].key == key)) i = (i + 1) & mask;
+        return i;
+    }
+public:
+    static constexpr size_t npos = SIZE_MAX;
+    uint64_t generation() const { return layoutGeneration; }
+    State& at(size_t slot) { return slots[slot].state; }
+    size_t findSlot(uint64_t keyHash, string_view key) const {
+        if(slots.empty()) return npos;
+        size_t i = probe(keyHash, key);
+        return slots[i].hash != 0 ? i : npos;
+    }
+    // Returns {slot, inserted}; a new key starts with a value-initialized state
+    pair<size_t, bool> findOrInsertSlot(uint64_t keyHash, string_view key) {
+        size_t found = findSlot(keyHash, key);
+        if(found != npos) return {found, false};
+        if((count + 1) * 4 > slots.size() * 3) grow(); // Keep the load factor at or below 3/4
+        size_t i = probe(keyHash, key);
+        slots[i].hash = keyHash;
+        slots[i].key = key;
+        count++;
+        return {i, true};
+    }
+    State* find(uint64_t keyHash, string_view key) {
+        size_t slot = findSlot(keyHash, key);
+        return slot != npos ? &slots[slot].state : nullptr;
+    }
+    pair<State*, bool> findOrInsert(uint64_t keyHash, string_view key) {
+        auto [slot, inserted] = findOrInsertSlot(keyHash, key);
+        return {&slots[slot].state, inserted};
+    }
+    // Backward-shift deletion: later entries of the probe run move up to fill the hole
+    bool erase(uint64_t keyHash, string_view key) {
+        if(slots.empty()) return false;
+        size_t hole = probe(keyHash, key);
+        if(slots[hole].hash == 0) return false;
+        layoutGeneration++;
+        for(size_t i = (hole + 1) & mask; slots[i].hash != 0; i = (i + 1) & mask){
+            size_t home = slots[i].hash & mask;
+            if(((i - home) & mask) >= ((i - hole) & mask)){ // The hole lies on i's probe path
+                slots[hole] = std::move(slots[i]);
+                hole = i;
+            }
+        }
+        slots[hole].hash = 0;
+        slots[hole].state = State();
+        slots[hole].key.clear();
+        count--;
+        return true;
+    }
+    size_t size() const { return count; }
+    // The slot array plus keys too long to live inside their string
+    size_t memoryBytes() const {
+        static const size_t inlineCapacity = string().capacity();
+        size_t total = slots.capacity() * sizeof(Slot);
+        for(const Slot& slot : slots){
+            if(slot.key.capacity() > inlineCapacity) total += slot.key.capacity() + 1;
+        }
+        return total;
+    }
+    // Visits every entry as fn(keyHash, key, state)
+    template<typename Fn>
+    void forEach(Fn fn) {
+        for(Slot& slot : slots){
+            if(slot.hash != 0) fn(slot.hash, string_view(slot.key), slot.state);
+        }
+    }
+};
+
+// Hierarchical timer wheel: 4 levels of 64 slots, where level k slots span 64^k ticks. A timer goes
+// into the coarsest level that can hold it and is cascaded into finer levels as time approaches,
+// so scheduling and expiring are O(1) amortized. Timers may fire late (never early) by up to
+// one slot of the level they were parked in. Timer is any payload with a `deadline` tick.
+struct KeyTimer {
+    uint64_t keyHash;
+    string key;
+    long long deadline; // Tick at which the timer fires
+};
+
+template<typename Timer = KeyTimer>
+class TimerWheel {
+    static constexpr int kLevels = 4;
+    static constexpr int kSlotBits = 6;
+    static constexpr long long kSlotMask = (1 << kSlotBits) - 1;
+    vector<Timer> slots[kLevels][1 << kSlotBits];
+    vector<Timer> due; // Fired timers not yet handed out
+    long long currentTick;
+public:
+    TimerWheel(long long startTick = 0) : currentTick(startTick) {}
+    long long tick() const { return currentTick; }
+    bool hasDue() const { return !due.empty(); }
+    void schedule(Timer timer) {
+        long long delta = timer.deadline - currentTick;
+        if(delta <= 0){
+            due.push_back(std::move(timer));
+            return;
+        }
+        int level = 0;
+        while(level < kLevels - 1 && delta >> (kSlotBits * (level + 1))) level++;
+        slots[level][(timer.deadline >> (kSlotBits * level)) & kSlotMask].push_back(std::move(timer));
+    }
+    // Moves the wheel towards `tick`, at most maxSteps ticks per call so a long idle gap
+    // is caught up over several calls instead of in one latency spike
+    void advance(long long tick, int maxSteps) {
+        for(int step = 0; step < maxSteps && currentTick < tick; step++){
+            currentTick++;
+            // Cascade every coarser level whose slot boundary we just crossed
+            for(int level = 1; level < kLevels && (currentTick & ((1LL << (kSlotBits * level)) - 1)) == 0; level++){
+                vector<Timer> timers;
+                timers.swap(slots[level][(currentTick >> (kSlotBits * level)) & kSlotMask]);
+                for(Timer& timer : timers) schedule(std::move(timer));
+            }
+            vector<Timer>& expired = slots[0][currentTick & kSlotMask];
+            for(Timer& timer : expired) due.push_back(std::move(timer));
+            expired.clear();
+        }
+    }
+    // Parked timers, including keys too long to live inside their string
+    size_t memoryBytes() const {
+        static const size_t inlineCapacity = string().capacity();
+        size_t total = 0;
+        auto add = [&](const vector<Timer>& timers) {
+            total += timers.capacity() * sizeof(Timer);
+            if constexpr (requires(const Timer& timer) { timer.key.capacity(); }) {
+                for(const Timer& timer : timers) if(timer.key.capacity() > inlineCapacity) total += timer.key.capacity() + 1;
+            }
+        };
+        for(auto& level : slots) for(auto& slot : level) add(slot);
+        add(due);
+        return total;
+    }
+    bool popDue(Timer& timer) {
+        if(due.empty()) return false;
+        timer = std::move(due.back());
+        due.pop_back();
+        return true;
+    }
+};
+
+// Built-in instrumentation: sampled decision latencies per limiter type and lock contention
+// counters. Define RATE_LIMITER_NO_STATS to compile it out; the timers and counters below then
+// become empty and locks are taken directly, so nothing is left on the decision path.
+
+// Lock contention of one lock, or of a limiter's locks added up
+struct LockStats {
+    uint64_t acquires = 0;
+    uint64_t contended = 0; // Acquires that found the lock held and had to wait
+    uint64_t waitNanos = 0; // Time spent waiting in those
+    LockStats& operator+=(const LockStats& other) {
+        acquires += other.acquires;
+        contended += other.contended;
+        waitNanos += other.waitNanos;
+        return *this;
+    }
+};
+
+// Takes a lock, first without waiting, and counts the acquire. Only an acquire that found the lock
+// held reads the clock, to time its wait. Exclusive counts are written by the lock holder alone, so
+// a relaxed load/store pair does; shared holders run concurrently and use fetch_add.
+class LockCounters {
+#ifndef RATE_LIMITER_NO_STATS
+    atomic<uint64_t> acquires{0};
+    atomic<uint64_t> contended{0};
+    atomic<uint64_t> waitNanos{0};
+
+    static long long now() { return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count(); }
+    static void add(atomic<uint64_t>& counter, uint64_t amount) {
+        counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed); // Single writer
+    }
+public:
+    template<typename Mutex>
+    void lock(Mutex& mtx) {
+        if(mtx.try_lock()){
+            add(acquires, 1);
+            return;
+        }
+        long long start = now();
+        mtx.lock();
+        add(acquires, 1);
+        add(contended, 1);
+        add(waitNanos, now() - start);
+    }
+    template<typename Mutex>
+    void lockShared(Mutex& mtx) {
+        if(mtx.try_lock_shared()){
+            acquires.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        long long start = now();
+        mtx.lock_shared();
+        acquires.fetch_add(1, memory_order_relaxed);
+        contended.fetch_add(1, memory_order_relaxed);
+        waitNanos.fetch_add(now() - start, memory_order_relaxed);
+    }
+    LockStats stats() const {
+        return {acquires.load(memory_order_relaxed), contended.load(memory_order_relaxed), waitNanos.load(memory_order_relaxed)};
+    }
+#else
+public:
+    template<typename Mutex>
+    void lock(Mutex& mtx) { mtx.lock(); }
+    template<typename Mutex>
+    void lockShared(Mutex& mtx) { mtx.lock_shared(); }
+    LockStats stats() const { return {}; }
+#endif
+};
+
+// Scoped lock_guard / shared_lock that count into a LockCounters
+template<typename Mutex>
+class CountedLock {
+    Mutex& mtx;
+public:
+    CountedLock(Mutex& mtx, LockCounters& counters) : mtx(mtx) { counters.lock(mtx); }
+    ~CountedLock() { mtx.unlock(); }
+    CountedLock(const CountedLock&) = delete;
+    CountedLock& operator=(const CountedLock&) = delete;
+};
+template<typename Mutex>
+class CountedSharedLock {
+    Mutex& mtx;
+public:
+    CountedSharedLock(Mutex& mtx, LockCounters& counters) : mtx(mtx) { counters.lockShared(mtx); }
+    ~CountedSharedLock() { mtx.unlock_shared(); }
+    CountedSharedLock(const CountedSharedLock&) = delete;
+    CountedSharedLock& operator=(const CountedSharedLock&) = delete;
+};
+
+// Log-linear latency histogram in the HDR style: each power of two of nanoseconds is split into
+// kSubBuckets equal buckets, so a value is kept to within 1/kSubBuckets (about 3%) of itself,
+// from 1 ns up to 2^kMaxBits ns (18 minutes), in a fixed 9 KB.
+class LatencyHistogram {
+public:
+    static constexpr int kSubBucketBits = 5;
+    static constexpr int kSubBuckets = 1 << kSubBucketBits;
+    static constexpr int kMaxBits = 40;
+    static constexpr int kBucketCount = (kMaxBits - kSubBucketBits + 1) * kSubBuckets;
+
+    static int bucketOf(uint64_t nanos) {
+        nanos = min<uint64_t>(nanos, (1ull << kMaxBits) - 1);
+        if(nanos < kSubBuckets) return nanos;
+        int shift = 63 - __builtin_clzll(nanos) - kSubBucketBits;
+        return (shift + 1) * kSubBuckets + (int)(nanos >> shift) - kSubBuckets;
+    }
+    // Largest value that lands in the bucket
+    static uint64_t highestValueOf(int bucket) {
+        if(bucket < kSubBuckets) return bucket;
+        int shift = bucket / kSubBuckets - 1;
+        return (((uint64_t)(bucket % kSubBuckets + kSubBuckets + 1)) << shift) - 1;
+    }
+    void record(uint64_t nanos, uint64_t times = 1) {
+        counts[bucketOf(nanos)] += times;
+        total += times;
+        maxNanos = max(maxNanos, nanos);
+    }
+    void addBucket(int bucket, uint64_t times) {
+        counts[bucket] += times;
+        total += times;
+    }
+    void raiseMax(uint64_t nanos) { maxNanos = max(maxNanos, nanos); }
+    void merge(const LatencyHistogram& other) {
+        for(int i = 0; i < kBucketCount; i++) counts[i] += other.counts[i];
+        total += other.total;
+        maxNanos = max(maxNanos, other.maxNanos);
+    }
+    uint64_t count() const { return total; }
+    uint64_t maximum() const { return maxNanos; }
+    // Value at or below which `percent` of the samples fall (never above the largest sample)
+    uint64_t percentile(double percent) const {
+        if(total == 0) return 0;
+        uint64_t rank = max<uint64_t>(1, (uint64_t)ceil(percent / 100 * total));
+        uint64_t seen = 0;
+        for(int i = 0; i < kBucketCount; i++){
+            seen += counts[i];
+            if(seen >= rank) return min(highestValueOf(i), maxNanos);
+        }
+        return maxNanos;
+    }
+private:
+    array<uint64_t, kBucketCount> counts{};
+    uint64_t total = 0;
+    uint64_t maxNanos = 0;
+};
+
+// Sampled single-decision latencies per limiter type, process-wide. Each thread records into its
+// own histograms, so the decision path writes no cache line another thread does; a snapshot adds
+// up every live thread's plus what exited threads left behind.
+class DecisionLatencies {
+public:
+    static constexpr uint32_t kSampleEvery = 64; // Per thread: one decision in 64 is timed
+private:
+    struct ThreadHistograms {
+        array<array<atomic<uint64_t>, LatencyHistogram::kBucketCount>, kRateLimiterTypeCount> counts{};
+        array<atomic<uint64_t>, kRateLimiterTypeCount> maxNanos{};
+        ThreadHistograms() {
+            lock_guard<mutex> lock(registryMutex);
+            live.insert(this);
+        }
+        ~ThreadHistograms() {
+            lock_guard<mutex> lock(registryMutex);
+            addTo(retired);
+            live.erase(this);
+        }
+        void addTo(array<LatencyHistogram, kRateLimiterTypeCount>& histograms) const {
+            for(int type = 0; type < kRateLimiterTypeCount; type++){
+                for(int bucket = 0; bucket < LatencyHistogram::kBucketCount; bucket++){
+                    uint64_t times = counts[type][bucket].load(memory_order_relaxed);
+                    if(times > 0) histograms[type].addBucket(bucket, times);
+                }
+                histograms[type].raiseMax(maxNanos[type].load(memory_order_relaxed));
+            }
+        }
+    };
+    static inline mutex registryMutex;
+    static inline set<ThreadHistograms*> live;
+    static inline array<LatencyHistogram, kRateLimiterTypeCount> retired;
+public:
+    static void record(RateLimiterType type, uint64_t nanos) {
+        static thread_local ThreadHistograms histograms; // Registered on the thread's first sample
+        atomic<uint64_t>& bucket = histograms.counts[(int)type][LatencyHistogram::bucketOf(nanos)];
+        bucket.store(bucket.load(memory_order_relaxed) + 1, memory_order_relaxed); // Single writer
+        if(nanos > histograms.maxNanos[(int)type].load(memory_order_relaxed)) histograms.maxNanos[(int)type].store(nanos, memory_order_relaxed);
+    }
+    static array<LatencyHistogram, kRateLimiterTypeCount> snapshot() {
+        array<LatencyHistogram, kRateLimiterTypeCount> histograms;
+        lock_guard<mutex> lock(registryMutex);
+        histograms = retired;
+        for(ThreadHistograms* thread : live) thread->addTo(histograms);
+        return histograms;
+    }
+};
+
+// Times the enclosing decision into DecisionLatencies if it is this thread's sampled one
+class DecisionTimer {
+#ifndef RATE_LIMITER_NO_STATS
+    RateLimiterType type;
+    long long start = 0;
+    static long long now() { return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count(); }
+public:
+    DecisionTimer(RateLimiterType type) : type(type) {
+        static thread_local uint32_t untilNextSample = 0;
+        if(untilNextSample-- > 0) return;
+        untilNextSample = DecisionLatencies::kSampleEvery - 1;
+        start = now();
+    }
+    ~DecisionTimer() {
+        if(start != 0) DecisionLatencies::record(type, now() - start);
+    }
+#else
+public:
+    DecisionTimer(RateLimiterType) {}
+#endif
+    DecisionTimer(const DecisionTimer&) = delete;
+    DecisionTimer& operator=(const DecisionTimer&) = delete;
+};
+
+// Lock-striped per-user state: keys are hashed onto N shards, each with its own mutex,
+// so requests for different users only contend when they land on the same shard.
+// An optional per-shard Arena (guarded by the same lock) is handed to callbacks that accept it.
+// With an idle timeout, a user not seen for that long is forgotten: every user has one timer in
+// its shard's TimerWheel, and when it fires the user is either evicted or re-armed from its last
+// access. The wheel is advanced by the requests that lock the shard, a few timers at a time.
+template<typename State, typename Mutex = mutex, typename Arena = monostate>
+class ShardedStore {
+    static constexpr int kMaxTicksPerCall = 64;
+    static constexpr int kMaxEvictionsPerCall = 4;
+    struct Entry {
+        State state{};
+        atomic<long long> lastAccess{0}; // Tick (second) of the user's latest request
+        Entry() {}
+        // Entries only move while the shard is exclusively locked
+        Entry(Entry&& other) : state(std::move(other.state)), lastAccess(other.lastAccess.load(memory_order_relaxed)) {}
+        Entry& operator=(Entry&& other) {
+            state = std::move(other.state);
+            lastAccess.store(other.lastAccess.load(memory_order_relaxed), memory_order_relaxed);
+            return *this;
+        }
+    };
+    struct alignas(64) Shard { // Padded to a cache line so neighbouring shard locks don't false-share
+        Mutex mtx;
+        LockCounters lockCounters;
+        FlatHashMap<Entry> states;
+        Arena arena;
+        TimerWheel<> idleTimers;
+        atomic<size_t> liveKeys{0};
+        atomic<uint64_t> evictedKeys{0};
+    };
+    unique_ptr<Shard[]> shards;
+    size_t shardMask;
+    long long idleTimeoutSeconds = 0; // 0 keeps users forever
+    function<void(State&, Arena&)> onEvict;
+    function<bool(uint64_t, string_view, State&, Arena&)> firstTouchLoader;
+
+    // Scratch space for batched calls, reused across batches on the same thread
+    struct BatchScratch {
+        vector<uint64_t> hashes;
+        vector<uint32_t> order; // Batch indices grouped by shard
+        vector<uint32_t> shardEnd; // End of each shard's group in order
+        vector<uint32_t> missing; // Users a shared-locked pass did not find
+    };
+
+    // The upper half of the hash picks the shard, the lower half the slot inside it
+    size_t shardIndex(uint64_t keyHash) const { return (keyHash >> 32) & shardMask; }
+    Shard& shardFor(uint64_t keyHash) { return shards[shardIndex(keyHash)]; }
+    template<typename Fn>
+    static auto invoke(Fn& fn, size_t i, State& state, bool inserted, Arena& arena) {
+        if constexpr (is_invocable_v<Fn&, size_t, State&, bool, Arena&>) return fn(i, state, inserted, arena);
+        else return fn(i, state, inserted);
+    }
+    // Hashes the batch once and groups its indices by shard with a counting sort, keeping batch order within a shard
+    BatchScratch& groupByShard(span<const string> userIds) {
+        static thread_local BatchScratch scratch;
+        size_t n = userIds.size();
+        scratch.hashes.resize(n);
+        scratch.order.resize(n);
+        scratch.shardEnd.assign(shardMask + 1, 0);
+        for(size_t i = 0; i < n; i++){
+            scratch.hashes[i] = hashUserId(userIds[i]);
+            scratch.shardEnd[shardIndex(scratch.hashes[i])]++;
+        }
+        uint32_t offset = 0;
+        for(uint32_t& end : scratch.shardEnd){ // Counts -> start offsets
+            uint32_t count = end;
+            end = offset;
+            offset += count;
+        }
+        for(size_t i = 0; i < n; i++) scratch.order[scratch.shardEnd[shardIndex(scratch.hashes[i])]++] = i; // Starts -> ends
+        return scratch;
+    }
+    static long long tickOf(long long nowNanos) { return nowNanos / 1000000000; } // Idle timers tick once per second
+    bool needsMaintenance(Shard& shard, long long tick) const {
+        return idleTimeoutSeconds > 0 && (shard.idleTimers.tick() < tick || shard.idleTimers.hasDue());
+    }
+    // Records the access; a new user gets its idle timer. Caller holds the shard lock.
+    void touch(Shard& shard, uint64_t keyHash, string_view userId, Entry& entry, bool inserted, long long tick) {
+        if(inserted) shard.liveKeys.fetch_add(1, memory_order_relaxed);
+        if(idleTimeoutSeconds == 0) return;
+        if(entry.lastAccess.load(memory_order_relaxed) != tick) entry.lastAccess.store(tick, memory_order_relaxed);
+        if(inserted) shard.idleTimers.schedule({keyHash, string(userId), tick + idleTimeoutSeconds + 1});
+    }
+    // touch() for a user that may have just been inserted; returns whether the user is new, which it
+    // no longer is once the first-touch loader has filled in its state. Caller holds the exclusive lock.
+    bool admit(Shard& shard, uint64_t keyHash, string_view userId, Entry& entry, bool inserted, long long tick) {
+        touch(shard, keyHash, userId, entry, inserted, tick);
+        return inserted && !(firstTouchLoader && firstTouchLoader(keyHash, userId, entry.state, shard.arena));
+    }
+    // Advances the shard's idle timers and evicts a bounded number of idle users. Caller holds the exclusive lock.
+    void maintain(Shard& shard, long long tick) {
+        shard.idleTimers.advance(tick, kMaxTicksPerCall);
+        KeyTimer timer;
+        for(int budget = kMaxEvictionsPerCall; budget > 0 && shard.idleTimers.popDue(timer); budget--){
+            Entry* entry = shard.states.find(timer.keyHash, timer.key);
+            if(entry == nullptr) continue;
+            long long deadline = entry->lastAccess.load(memory_order_relaxed) + idleTimeoutSeconds + 1;
+            if(deadline > tick){ // Seen since the timer was armed
+                timer.deadline = deadline;
+                shard.idleTimers.schedule(std::move(timer));
+                continue;
+            }
+            if(onEvict) onEvict(entry->state, shard.arena);
+            shard.states.erase(timer.keyHash, timer.key);
+            shard.liveKeys.fetch_sub(1, memory_order_relaxed);
+            shard.evictedKeys.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    // Single-key lookups take either a plain user id, hashed here, or a KeyHandle, whose cached
+    // slot is used as long as the shard's table layout hasn't changed since it was recorded
+    static size_t findSlot(Shard& shard, string_view userId, uint64_t keyHash) { return shard.states.findSlot(keyHash, userId); }
+    static size_t findSlot(Shard& shard, KeyHandle& handle, uint64_t keyHash) {
+        if(handle.table == &shard.states && handle.generation == shard.states.generation()) return handle.slot;
+        size_t slot = shard.states.findSlot(keyHash, handle.userId);
+        if(slot != FlatHashMap<Entry>::npos) remember(shard, handle, slot);
+        return slot;
+    }
+    static pair<size_t, bool> findOrInsertSlot(Shard& shard, string_view userId, uint64_t keyHash) {
+        return shard.states.findOrInsertSlot(keyHash, userId);
+    }
+    static pair<size_t, bool> findOrInsertSlot(Shard& shard, KeyHandle& handle, uint64_t keyHash) {
+        size_t slot = findSlot(shard, handle, keyHash);
+        if(slot != FlatHashMap<Entry>::npos) return {slot, false};
+        auto result = shard.states.findOrInsertSlot(keyHash, handle.userId);
+        remember(shard, handle, result.first);
+        return result;
+    }
+    static void remember(Shard& shard, KeyHandle& handle, size_t slot) {
+        handle.table = &shard.states;
+        handle.slot = slot;
+        handle.generation = shard.states.generation();
+    }
+
+    template<typename Key, typename Fn>
+    auto withStateImpl(Key& key, long long nowNanos, Fn& fn) {
+        uint64_t keyHash = hashOf(key);
+        Shard& shard = shardFor(keyHash);
+        long long tick = tickOf(nowNanos);
+        CountedLock<Mutex> lock(shard.mtx, shard.lockCounters);
+        if(needsMaintenance(shard, tick)) maintain(shard, tick);
+        auto [slot, inserted] = findOrInsertSlot(shard, key, keyHash);
+        Entry& entry = shard.states.at(slot);
+        inserted = admit(shard, keyHash, userIdOf(key), entry, inserted, tick);
+        if constexpr (is_invocable_v<Fn&, State&, bool, Arena&>) return fn(entry.state, inserted, shard.arena);
+        else return fn(entry.state, inserted);
+    }
+    template<typename Key, typename Fn>
+    auto withSharedStateImpl(Key& key, long long nowNanos, Fn& fn) {
+        static_assert(is_same_v<Mutex, shared_mutex>, "withSharedState requires a shared_mutex store");
+        uint64_t keyHash = hashOf(key);
+        Shard& shard = shardFor(keyHash);
+        long long tick = tickOf(nowNanos);
+        optional<decltype(fn(declval<State&>(), false))> result;
+        bool maintenanceDue = false;
+        {
+            CountedSharedLock<Mutex> lock(shard.mtx, shard.lockCounters);
+            size_t slot = findSlot(shard, key, keyHash);
+            if(slot != FlatHashMap<Entry>::npos){
+                Entry& entry = shard.states.at(slot);
+                touch(shard, keyHash, userIdOf(key), entry, false, tick);
+                result = fn(entry.state, false);
+                maintenanceDue = needsMaintenance(shard, tick);
+            }
+        }
+        if(result){
+            if(maintenanceDue && shard.mtx.try_lock()){
+                maintain(shard, tick);
+                shard.mtx.unlock();
+            }
+            return *result;
+        }
+        CountedLock<Mutex> lock(shard.mtx, shard.lockCounters);
+        if(needsMaintenance(shard, tick)) maintain(shard, tick);
+        auto [slot, inserted] = findOrInsertSlot(shard, key, keyHash);
+        Entry& entry = shard.states.at(slot);
+        inserted = admit(shard, keyHash, userIdOf(key), entry, inserted, tick);
+        return fn(entry.state, inserted);
+    }
+public:
+    template<typename... ArenaArgs>
+    ShardedStore(int shardCount, const ArenaArgs&... arenaArgs) {
+        size_t count = 1;
+        while(count < (size_t)max(shardCount, 1)) count <<= 1; // Round up to a power of two
+        shards = make_unique<Shard[]>(count);
+        shardMask = count - 1;
+        if constexpr (sizeof...(ArenaArgs) > 0) {
+            for(size_t i = 0; i < count; i++) shards[i].arena = Arena(arenaArgs...);
+        }
+    }
+    // Forget users idle for longer than `seconds`; onEvict releases anything the state owns in the arena.
+    // nowNanos is the limiter clock's current time, which the idle timers start from.
+    void setIdleTimeout(int seconds, long long nowNanos, function<void(State&, Arena&)> evictionCallback = nullptr) {
+        idleTimeoutSeconds = max(seconds, 0);
+        onEvict = std::move(evictionCallback);
+        long long tick = tickOf(nowNanos);
+        for(size_t i = 0; i <= shardMask; i++) shards[i].idleTimers = TimerWheel<>(tick);
+    }
+    // Called with the shard exclusively locked whenever a user is inserted; returning true means it
+    // filled in the user's state (e.g. from a snapshot), so the user is not treated as new.
+    // A loader added later is only asked if the earlier ones found nothing.
+    // Add them before the store is used.
+    void addFirstTouchLoader(function<bool(uint64_t keyHash, string_view userId, State&, Arena&)> loader) {
+        if(!firstTouchLoader){
+            firstTouchLoader = std::move(loader);
+            return;
+        }
+        firstTouchLoader = [first = std::move(firstTouchLoader), then = std::move(loader)](uint64_t keyHash, string_view userId, State& state, Arena& arena) {
+            return first(keyHash, userId, state, arena) || then(keyHash, userId, state, arena);
+        };
+    }
+    // Visits every user as fn(userId, keyHash, state, arena), holding one shard's lock at a time
+    template<typename Fn>
+    void forEachState(Fn fn) {
+        for(size_t i = 0; i <= shardMask; i++){
+            Shard& shard = shards[i];
+            CountedLock<Mutex> lock(shard.mtx, shard.lockCounters);
+            shard.states.forEach([&](uint64_t keyHash, string_view userId, Entry& entry) { fn(userId, keyHash, entry.state, shard.arena); });
+        }
+    }
+    // Runs fn(state, isNewUser) or fn(state, isNewUser, arena) with the user's shard locked.
+    // nowNanos is the limiter clock's time for this decision; it drives idle eviction.
+    template<typename Fn>
+    auto withState(string_view userId, long long nowNanos, Fn fn) { return withStateImpl(userId, nowNanos, fn); }
+    template<typename Fn>
+    auto withState(KeyHandle& handle, long long nowNanos, Fn fn) { return withStateImpl(handle, nowNanos, fn); }
+    // Like withState, but an existing user's state is visited with the shard lock held only in
+    // shared mode, so concurrent decisions must synchronize through the state itself (e.g. atomics).
+    // The exclusive lock is needed only to insert or evict users, which may move slots;
+    // eviction is skipped rather than waited for if another thread holds the shard.
+    template<typename Fn>
+    auto withSharedState(string_view userId, long long nowNanos, Fn fn) { return withSharedStateImpl(userId, nowNanos, fn); }
+    template<typename Fn>
+    auto withSharedState(KeyHandle& handle, long long nowNanos, Fn fn) { return withSharedStateImpl(handle, nowNanos, fn); }
+    // Batched withState: runs fn(i, state, isNewUser) or fn(i, state, isNewUser, arena) for every
+    // userIds[i], taking each shard's lock once for all of its users in the batch
+    template<typename Fn>
+    void withStates(span<const string> userIds, long long nowNanos, Fn fn) {
+        BatchScratch& batch = groupByShard(userIds);
+        long long tick = tickOf(nowNanos);
+        uint32_t begin = 0;
+        for(size_t s = 0; s <= shardMask; begin = batch.shardEnd[s++]){
+            if(begin == batch.shardEnd[s]) continue;
+            Shard& shard = shards[s];
+            CountedLock<Mutex> lock(shard.mtx, shard.lockCounters);
+            if(needsMaintenance(shard, tick)) maintain(shard, tick);
+            for(uint32_t k = begin; k < batch.shardEnd[s]; k++){
+                uint32_t i = batch.order[k];
+                auto [entry, inserted] = shard.states.findOrInsert(batch.hashes[i], userIds[i]);
+                inserted = admit(shard, batch.hashes[i], userIds[i], *entry, inserted, tick);
+                invoke(fn, i, entry->state, inserted, shard.arena);
+            }
+        }
+    }
+    // Batched withSharedState: each shard is visited once in shared mode for its known users,
+    // then once exclusively if the batch brought users it has not seen yet
+    template<typename Fn>
+    void withSharedStates(span<const string> userIds, long long nowNanos, Fn fn) {
+        static_assert(is_same_v<Mutex, shared_mutex>, "withSharedStates requires a shared_mutex store");
+        BatchScratch& batch = groupByShard(userIds);
+        long long tick = tickOf(nowNanos);
+        uint32_t begin = 0;
+        for(size_t s = 0; s <= shardMask; begin = batch.shardEnd[s++]){
+            if(begin == batch.shardEnd[s]) continue;
+            Shard& shard = shards[s];
+            batch.missing.clear();
+            bool maintenanceDue;
+            {
+                CountedSharedLock<Mutex> lock(shard.mtx, shard.lockCounters);
+                for(uint32_t k = begin; k < batch.shardEnd[s]; k++){
+                    uint32_t i = batch.order[k];
+                    Entry* entry = shard.states.find(batch.hashes[i], userIds[i]);
+                    if(entry == nullptr){
+                        batch.missing.push_back(i);
+                        continue;
+                    }
+                    touch(shard, batch.hashes[i], userIds[i], *entry, false, tick);
+                    invoke(fn, i, entry->state, false, shard.arena);
+                }
+                maintenanceDue = needsMaintenance(shard, tick);
+            }
+            if(batch.missing.empty()){
+                if(maintenanceDue && shard.mtx.try_lock()){
+                    maintain(shard, tick);
+                    shard.mtx.unlock();
+                }
+                continue;
+            }
+            CountedLock<Mutex> lock(shard.mtx, shard.lockCounters);
+            if(needsMaintenance(shard, tick)) maintain(shard, tick);
+            for(uint32_t i : batch.missing){
+                auto [entry, inserted] = shard.states.findOrInsert(batch.hashes[i], userIds[i]);
+                inserted = admit(shard, batch.hashes[i], userIds[i], *entry, inserted, tick);
+                invoke(fn, i, entry->state, inserted, shard.arena);
+            }
+        }
+    }
+    // Runs fn(states, isNew) with the shards of all `keys` (at most kMaxLockedKeys, all distinct)
+    // locked at once, so one decision can read and update several keys together. Shards are
+    // locked in index order, so concurrent calls over overlapping keys cannot deadlock.
+    static constexpr size_t kMaxLockedKeys = 8;
+    template<typename Fn>
+    auto withStatesLocked(span<const string_view> keys, long long nowNanos, Fn fn) {
+        size_t n = keys.size();
+        if(n > kMaxLockedKeys) throw std::invalid_argument("withStatesLocked takes at most 8 keys");
+        array<uint64_t, kMaxLockedKeys> hashes;
+        array<size_t, kMaxLockedKeys> lockOrder; // Distinct shard indices, ascending
+        size_t lockCount = 0;
+        for(size_t i = 0; i < n; i++){
+            hashes[i] = hashUserId(keys[i]);
+            size_t shard = shardIndex(hashes[i]);
+            size_t at = 0;
+            while(at < lockCount && lockOrder[at] < shard) at++;
+            if(at < lockCount && lockOrder[at] == shard) continue;
+            for(size_t k = lockCount++; k > at; k--) lockOrder[k] = lockOrder[k - 1];
+            lockOrder[at] = shard;
+        }
+        long long tick = tickOf(nowNanos);
+        array<unique_lock<Mutex>, kMaxLockedKeys> locks;
+        for(size_t k = 0; k < lockCount; k++){
+            Shard& shard = shards[lockOrder[k]];
+            shard.lockCounters.lock(shard.mtx);
+            locks[k] = unique_lock<Mutex>(shard.mtx, adopt_lock);
+            if(needsMaintenance(shard, tick)) maintain(shard, tick);
+        }
+        // Insert every key before taking any state's address: an insert may move its shard's slots
+        array<bool, kMaxLockedKeys> isNew;
+        for(size_t i = 0; i < n; i++){
+            Shard& shard = shardFor(hashes[i]);
+            auto [entry, inserted] = shard.states.findOrInsert(hashes[i], keys[i]);
+            isNew[i] = admit(shard, hashes[i], keys[i], *entry, inserted, tick);
+        }
+        array<State*, kMaxLockedKeys> states;
+        for(size_t i = 0; i < n; i++) states[i] = &shardFor(hashes[i]).states.find(hashes[i], keys[i])->state;
+        return fn(span<State* const>(states.data(), n), span<const bool>(isNew.data(), n));
+    }
+    size_t shardCount() const { return shardMask + 1; }
+    size_t liveKeyCount() const {
+        size_t total = 0;
+        for(size_t i = 0; i <= shardMask; i++) total += shards[i].liveKeys.load(memory_order_relaxed);
+        return total;
+    }
+    uint64_t evictedKeyCount() const {
+        uint64_t total = 0;
+        for(size_t i = 0; i <= shardMask; i++) total += shards[i].evictedKeys.load(memory_order_relaxed);
+        return total;
+    }
+    // Bytes held for users: the tables, their keys, the idle timers and the arenas.
+    // Walks every shard under its lock, so it is for stats, not for the decision path.
+    size_t stateBytes() const {
+        size_t total = sizeof(Shard) * (shardMask + 1);
+        for(size_t i = 0; i <= shardMask; i++){
+            Shard& shard = shards[i];
+            lock_guard<Mutex> lock(shard.mtx);
+            total += shard.states.memoryBytes() + shard.idleTimers.memoryBytes();
+            if constexpr (requires { shard.arena.memoryBytes(); }) total += shard.arena.memoryBytes();
+        }
+        return total;
+    }
+    LockStats lockStats() const {
+        LockStats total;
+        for(size_t i = 0; i <= shardMask; i++) total += shards[i].lockCounters.stats();
+        return total;
+    }
+};
+
+// Number of users a limiter currently tracks and how many idle ones it has forgotten so far.
+// Sampling evictedKeys periodically gives the eviction rate.
+struct KeyStats {
+    size_t liveKeys;
+    uint64_t evictedKeys;
+};
+
+// What a limiter holds and how contended its locks are, read with RateLimiter::stats()
+struct LimiterStats {
+    RateLimiterType type;
+    KeyStats keys;
+    size_t stateBytes; // Memory held for per-user state
+    LockStats locks; // All zero with RATE_LIMITER_NO_STATS, or for a limiter that takes no locks
+};
+
+// One allow/deny bit per request of a batch
+class DecisionBitmap {
+    vector<uint64_t> words;
+    size_t bits;
+public:
+    DecisionBitmap(size_t size) : words((size + 63) / 64), bits(size) {}
+    void set(size_t i) { words[i / 64] |= 1ull << (i % 64); }
+    bool test(size_t i) const { return (words[i / 64] >> (i % 64)) & 1; }
+    size_t size() const { return bits; }
+    size_t count() const {
+        size_t total = 0;
+        for(uint64_t word : words) total += __builtin_popcountll(word);
+        return total;
+    }
+    // Decision i is bit i % 8 of byte i / 8 (on the little-endian hosts this targets)
+    string_view bytes() const { return {(const char*)words.data(), (bits + 7) / 8}; }
+};
+
+// Outcome of acquire(). On a denial, retryAfter is how long until the same cost would be allowed
+// if the user sends nothing else meanwhile; kNever when the cost is more than the limit itself.
+struct AcquireResult {
+    static constexpr chrono::nanoseconds kNever = chrono::nanoseconds::max();
+    bool acquired;
+    chrono::nanoseconds retryAfter; // Zero when acquired
+
+    static AcquireResult granted() { return {true, chrono::nanoseconds(0)}; }
+    static AcquireResult never() { return {false, kNever}; }
+    // Denied until clock time readyAt (ns)
+    static AcquireResult deniedUntil(long long readyAt, long long now) { return {false, chrono::nanoseconds(max(1ll, readyAt - now))}; }
+};
+
+// Token buckets refill in whole seconds: the clock time (ns) at which a bucket that held `tokens`
+// at lastRefillSecond holds `cost` again
+inline long long tokenRefillTime(long long tokens, long long lastRefillSecond, int cost, const RateLimiterConfiguration& config) {
+    long long missing = cost - tokens;
+    long long seconds = (missing * config.timeWindowSeconds + config.maxRequests - 1) / config.maxRequests;
+    return (lastRefillSecond + seconds) * 1000000000;
+}
+
+// Snapshot file of one limiter's per-user state, for warm restarts:
+//   header | index of (keyHash, record offset) sorted by hash | records (u16 key length, key, u32 state length, state)
+// Record contents are up to the limiter; times in them are stored relative to the snapshot moment,
+// which the header stamps with the wall clock, so they can be carried over to a new process's clock.
+struct SnapshotHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t limiterType;
+    int32_t maxRequests;
+    int32_t timeWindowSeconds;
+    int64_t wallClockNanos;
+    uint64_t recordCount;
+};
+struct SnapshotIndexEntry {
+    uint64_t keyHash;
+    uint64_t offset; // From the start of the file
+};
+constexpr uint64_t kSnapshotMagic = 0x524c534e41505331ull; // "RLSNAPS1"
+constexpr uint32_t kSnapshotVersion = 1;
+
+inline long long wallClockNanos() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+// Fixed-width fields inside a record
+template<typename T>
+void appendField(string& out, T value) { out.append((const char*)&value, sizeof(T)); }
+template<typename T>
+T takeField(string_view& in) {
+    T value;
+    memcpy(&value, in.data(), sizeof(T));
+    in.remove_prefix(sizeof(T));
+    return value;
+}
+
+class SnapshotWriter {
+    vector<SnapshotIndexEntry> index; // Offsets into records until write()
+    string records;
+public:
+    void add(uint64_t keyHash, string_view userId, string_view state) {
+        if(userId.size() > UINT16_MAX) return; // Not worth a wider length field; such a user starts fresh
+        index.push_back({keyHash, records.size()});
+        appendField<uint16_t>(records, userId.size());
+        records.append(userId);
+        appendField<uint32_t>(records, state.size());
+        records.append(state);
+    }
+    // The snapshot's bytes, as write() would store them
+    string image(RateLimiterType type, const RateLimiterConfiguration& config) {
+        sort(index.begin(), index.end(), [](const SnapshotIndexEntry& a, const SnapshotIndexEntry& b) { return a.keyHash < b.keyHash; });
+        size_t recordsOffset = sizeof(SnapshotHeader) + index.size() * sizeof(SnapshotIndexEntry);
+        string bytes(recordsOffset + records.size(), '\0');
+        SnapshotHeader header{kSnapshotMagic, kSnapshotVersion, (uint32_t)type, config.maxRequests, config.timeWindowSeconds, wallClockNanos(), index.size()};
+        memcpy(bytes.data(), &header, sizeof(header));
+        for(size_t i = 0; i < index.size(); i++){
+            SnapshotIndexEntry entry{index[i].keyHash, recordsOffset + index[i].offset};
+            memcpy(bytes.data() + sizeof(SnapshotHeader) + i * sizeof(SnapshotIndexEntry), &entry, sizeof(entry));
+        }
+        memcpy(bytes.data() + recordsOffset, records.data(), records.size());
+        return bytes;
+    }
+    // Fills a temporary file through a mapping and renames it over path, so readers only ever see
+    // a complete snapshot
+    void write(const string& path, RateLimiterType type, const RateLimiterConfiguration& config) {
+        string contents = image(type, config);
+        size_t bytes = contents.size();
+        string temporaryPath = path + ".tmp";
+        int fd = open(temporaryPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if(fd < 0) throw std::runtime_error("open " + temporaryPath + ": " + strerror(errno));
+        // Until the rename succeeds, every way out closes and removes the temporary file
+        struct TemporaryFile {
+            const string& path;
+            int fd;
+            bool renamed = false;
+            ~TemporaryFile() {
+                close(fd);
+                if(!renamed) unlink(path.c_str());
+            }
+        } temporary{temporaryPath, fd};
+        // Allocated up front, so a full disk fails here rather than as SIGBUS while filling the mapping
+        if(int error = posix_fallocate(fd, 0, bytes)){
+            throw std::runtime_error("allocate " + temporaryPath + ": " + strerror(error));
+        }
+        char* file = (char*)mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(file == MAP_FAILED) throw std::runtime_error("mmap " + temporaryPath + ": " + strerror(errno));
+        memcpy(file, contents.data(), bytes);
+        int error = msync(file, bytes, MS_SYNC) == 0 ? 0 : errno;
+        munmap(file, bytes);
+        if(error == 0 && rename(temporaryPath.c_str(), path.c_str()) != 0) error = errno;
+        if(error) throw std::runtime_error("writing snapshot " + path + ": " + strerror(error));
+        temporary.renamed = true;
+    }
+};
+
+// A snapshot mapped read-only. Opening it reads nothing but the header; a lookup binary-searches
+// the index, so only the pages of users actually looked up are ever read from disk.
+class Snapshot {
+    const char* file = nullptr;
+    size_t bytes = 0;
+    string image; // Backs file when the snapshot was never written out
+    SnapshotHeader header{};
+    const SnapshotIndexEntry* index = nullptr;
+
+    Snapshot() {}
+    // Checks the header of what file points at; nullptr if another limiter type wrote it
+    static unique_ptr<Snapshot> validated(unique_ptr<Snapshot> snapshot, const string& name, RateLimiterType type) {
+        memcpy(&snapshot->header, snapshot->file, sizeof(SnapshotHeader));
+        const SnapshotHeader& header = snapshot->header;
+        if(header.magic != kSnapshotMagic || header.version != kSnapshotVersion
+           || header.recordCount > (snapshot->bytes - sizeof(SnapshotHeader)) / sizeof(SnapshotIndexEntry)){
+            throw std::runtime_error("Snapshot " + name + " is damaged");
+        }
+        if(header.limiterType != (uint32_t)type || header.maxRequests <= 0 || header.timeWindowSeconds <= 0) return nullptr;
+        snapshot->index = (const SnapshotIndexEntry*)(snapshot->file + sizeof(SnapshotHeader));
+        return snapshot;
+    }
+public:
+    // nullptr when there is no snapshot at path, or it was written by another limiter type
+    // (starting empty is the safe fallback); throws if the file is damaged
+    static unique_ptr<Snapshot> open(const string& path, RateLimiterType type) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0) return nullptr;
+        struct stat info;
+        if(fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SnapshotHeader)){
+            close(fd);
+            throw std::runtime_error("Snapshot " + path + " is truncated");
+        }
+        unique_ptr<Snapshot> snapshot(new Snapshot());
+        snapshot->bytes = info.st_size;
+        void* mapping = mmap(nullptr, snapshot->bytes, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(mapping == MAP_FAILED) throw std::runtime_error("mmap " + path + ": " + strerror(errno));
+        madvise(mapping, snapshot->bytes, MADV_RANDOM); // Lookups jump around; don't read ahead
+        snapshot->file = (const char*)mapping;
+        return validated(std::move(snapshot), path, type);
+    }
+    // A snapshot held in memory, from SnapshotWriter::image
+    static unique_ptr<Snapshot> fromImage(string image, RateLimiterType type) {
+        unique_ptr<Snapshot> snapshot(new Snapshot());
+        snapshot->image = std::move(image);
+        snapshot->file = snapshot->image.data();
+        snapshot->bytes = snapshot->image.size();
+        return validated(std::move(snapshot), "image", type);
+    }
+    ~Snapshot() { if(image.empty()) munmap((void*)file, bytes); }
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    long long wallClockNanos() const { return header.wallClockNanos; }
+    // Limits of the limiter that wrote it
+    RateLimiterConfiguration limits() const { return RateLimiterConfiguration(header.maxRequests, header.timeWindowSeconds); }
+    uint64_t recordCount() const { return header.recordCount; }
+    // The user's state record, if the snapshot has one
+    optional<string_view> find(uint64_t keyHash, string_view userId) const {
+        const SnapshotIndexEntry* end = index + header.recordCount;
+        const SnapshotIndexEntry* entry = lower_bound(index, end, keyHash, [](const SnapshotIndexEntry& e, uint64_t hash) { return e.keyHash < hash; });
+        for(; entry != end && entry->keyHash == keyHash; entry++){
+            if(entry->offset > bytes) return nullopt;
+            string_view record(file + entry->offset, bytes - entry->offset);
+            if(record.size() < sizeof(uint16_t)) return nullopt;
+            size_t keyLength = takeField<uint16_t>(record);
+            if(record.size() < keyLength + sizeof(uint32_t)) return nullopt;
+            string_view key = record.substr(0, keyLength);
+            record.remove_prefix(keyLength);
+            size_t stateLength = takeField<uint32_t>(record);
+            if(record.size() < stateLength) return nullopt;
+            if(key == userId) return record.substr(0, stateLength);
+        }
+        return nullopt;
+    }
+};
+
+// The limiter classes, each templated on the clock it reads. With one of the final clocks the
+// reads are direct calls; with Clock (the default) they go through the vtable.
+template<typename ClockType = Clock> class TokenBucketRateLimiter;
+template<typename ClockType = Clock> class LockFreeTokenBucketRateLimiter;
+template<typename ClockType = Clock> class SharedMemoryTokenBucketRateLimiter;
+template<typename ClockType = Clock> class FixedWindowRateLimiter;
+template<typename ClockType = Clock> class SlidingWindowRateLimiter;
+template<typename ClockType = Clock> class SlidingWindowCounterRateLimiter;
+template<typename ClockType = Clock> class GCRARateLimiter;
+template<typename ClockType = Clock> class CountMinSketchRateLimiter;
+
+// A limiter as its concrete type, by clock and then algorithm. visitLimiter switches on each index
+// and calls that class's decision directly (the compiler may inline it), instead of through the
+// vtable; with a final clock the decision reads the clock directly too. Nested because std::visit
+// only compiles to a switch up to 11 alternatives, and a table of function pointers beyond.
+template<typename ClockType>
+using LimiterOn = variant<TokenBucketRateLimiter<ClockType>*, LockFreeTokenBucketRateLimiter<ClockType>*,
+                          SharedMemoryTokenBucketRateLimiter<ClockType>*, FixedWindowRateLimiter<ClockType>*,
+                          SlidingWindowRateLimiter<ClockType>*, SlidingWindowCounterRateLimiter<ClockType>*,
+                          GCRARateLimiter<ClockType>*, CountMinSketchRateLimiter<ClockType>*>;
+using LimiterRef = variant<LimiterOn<Clock>, LimiterOn<MonotonicClock>, LimiterOn<CoarseClock>, LimiterOn<ManualClock>>;
+
+template<typename Visitor>
+decltype(auto) visitLimiter(Visitor&& visitor, const LimiterRef& limiter) {
+    return visit([&](const auto& concrete) -> decltype(auto) { return visit(visitor, concrete); }, limiter);
+}
+
+// RateLimiter interface
+class RateLimiter {
+protected:
+    RateLimiterConfiguration config;
+    shared_ptr<Clock> clock;
+
+    // The clock read as the limiter class's ClockType: not through the vtable when that is final
+    template<typename ClockType>
+    long long nowNanos() { return static_cast<ClockType&>(*clock).nowNanos(); }
+    // Snapshot plumbing for limiters that keep their users in a ShardedStore.
+    // encode(state, arena, now, out) appends one user's state, with times as ages, and returns
+    // false to leave the user out (e.g. nothing left that differs from a new user).
+    template<typename Store, typename Encode>
+    void writeSnapshot(Store& store, SnapshotWriter& writer, Encode encode) {
+        long long now = clock->nowNanos();
+        string record;
+        store.forEachState([&](string_view userId, uint64_t keyHash, auto& state, auto& arena) {
+            record.clear();
+            if(encode(state, arena, now, record)) writer.add(keyHash, userId, record);
+        });
+    }
+    // decode(record, origin, saved, state, arena) rebuilds a user's state the first time the user
+    // is seen. origin is the snapshot moment on this limiter's clock: the clock now, less the
+    // wall-clock time since the snapshot was written. saved is the limits the snapshot was taken
+    // under; when they differ from this limiter's, what the user already used stays used and
+    // the new limits apply to the rest. After `horizon` every saved state would have aged into
+    // a new user's, so the snapshot is no longer consulted.
+    template<typename Store, typename Decode>
+    bool readSnapshot(Store& store, shared_ptr<Snapshot> snapshot, chrono::seconds horizon, Decode decode) {
+        long long origin = clock->nowNanos() - max(0ll, wallClockNanos() - snapshot->wallClockNanos());
+        long long expiresAt = origin + chrono::duration_cast<chrono::nanoseconds>(horizon).count();
+        store.addFirstTouchLoader([this, snapshot, origin, expiresAt, decode](uint64_t keyHash, string_view userId, auto& state, auto& arena) {
+            if(clock->nowNanos() >= expiresAt) return false;
+            optional<string_view> record = snapshot->find(keyHash, userId);
+            return record.has_value() && decode(*record, origin, snapshot->limits(), state, arena);
+        });
+        return true;
+    }
+public:
+    RateLimiter(RateLimiterConfiguration config, shared_ptr<Clock> clock) : config(config), clock(clock ? clock : Clock::monotonic()) {}
+    // std::string ids convert to string_view without a copy; the state keeps its own copy of new users only
+    virtual bool allowRequest(string_view userId) = 0;
+    // Same decision for a pre-resolved key: no hashing, and no lookup while its cached slot is current
+    virtual bool allowRequest(KeyHandle& handle) = 0;
+    // Decides a whole batch with one clock read, locking each shard once for all of its users.
+    // costs[i] (default 1 each) is how many requests userIds[i] counts as.
+    virtual DecisionBitmap allowRequests(span<const string> userIds, span<const int> costs = {}) = 0;
+    // Takes `cost` requests' worth of the user's limit if it has room; if not, takes nothing and
+    // says how long until it will (see AcquireScheduler to wait for that instead of polling)
+    virtual AcquireResult acquire(string_view userId, int cost = 1) = 0;
+    virtual KeyStats keyStats() const = 0;
+    virtual size_t stateBytes() const = 0;
+    virtual LockStats lockStats() const { return {}; }
+    LimiterStats stats() const { return {type(), keyStats(), stateBytes(), lockStats()}; }
+    virtual RateLimiterType type() const = 0;
+    // This limiter as its concrete type (see LimiterRef)
+    virtual LimiterRef ref() = 0;
+    const RateLimiterConfiguration& configuration() const { return config; }
+    // Warm restart. saveSnapshot writes every tracked user's state to path (safe while decisions
+    // run); loadSnapshot maps a snapshot and reads a user's saved state only when that user is first
+    // seen. Load before taking decisions; returns false if path has no snapshot for this limiter.
+    void saveSnapshot(const string& path) {
+        SnapshotWriter writer;
+        writeStates(writer);
+        writer.write(path, type(), config);
+    }
+    bool loadSnapshot(const string& path) {
+        shared_ptr<Snapshot> snapshot = Snapshot::open(path, type());
+        return snapshot && readStates(snapshot);
+    }
+    // What the two above are made of: every tracked user's state into writer, and a snapshot
+    // of this limiter's type to read users from on first touch
+    virtual void writeStates(SnapshotWriter& writer) = 0;
+    virtual bool readStates(shared_ptr<Snapshot> snapshot) = 0;
+    virtual ~RateLimiter() {}
+};
+
+// Decision algorithms as policies: the per-user State and consume(state, isNewUser, now, cost,
+// config), which charges the request if it fits (now is clock nanoseconds). The limiter classes
+// below decide through them, and so does PolicyRateLimiter, which composes one at compile time.
+struct TokenBucketPolicy {
+    struct State {
+        int tokens;
+        long long lastRefillTime; // Clock seconds
+    };
+    static constexpr RateLimiterType type = RateLimiterType::TokenBucket;
+    static int idleTimeoutSeconds(const RateLimiterConfiguration& config) { return config.timeWindowSeconds; } // Bucket full again
+    static void refill(int& tokens, long long& lastRefillTime, bool isNewUser, long long currentTime, const RateLimiterConfiguration& config) {
+        if(isNewUser){ // When user is seen for the first time
+            lastRefillTime = currentTime;
+            tokens = config.maxRequests;
+        }else{
+            // In long long, like PackedTokenBucket: elapsed seconds times a large quota overflows an int
+            long long elapsedTime = currentTime - lastRefillTime;
+            long long tokensToAdd = (elapsedTime * config.maxRequests) / config.timeWindowSeconds;
+            tokens = (int)min<long long>(config.maxRequests, tokens + tokensToAdd);
+            lastRefillTime = currentTime;
+        }
+    }
+    static bool consume(State& state, bool isNewUser, long long now, int cost, const RateLimiterConfiguration& config) {
+        refill(state.tokens, state.lastRefillTime, isNewUser, now / 1000000000, config);
+        if(state.tokens >= cost){
+            state.tokens -= cost;
+            return true;
+        }
+        return false;
+    }
+};
+
+struct FixedWindowPolicy {
+    struct State {
+        int requestCount;
+        long long windowStartTime; // Clock nanoseconds
+    };
+    static constexpr RateLimiterType type = RateLimiterType::FixedWindow;
+    static int idleTimeoutSeconds(const RateLimiterConfiguration& config) { return config.timeWindowSeconds; } // Window expired
+    static bool consume(State& state, bool isNewUser, long long now, int cost, const RateLimiterConfiguration& config) {
+        long long windowDuration = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(config.timeWindowSeconds)).count();
+        // Check if the user exists or if current window has expired
+        if(isNewUser || now - state.windowStartTime > windowDuration){
+            // Start a new window
+            state.windowStartTime = now;
+            state.requestCount = 0;
+        }
+        // Within the same window, check if we can allow the request
+        if(state.requestCount + cost <= config.maxRequests){
+            state.requestCount += cost;
+            return true;
+        }
+        return false;
+    }
+};
+
+// Approximates the sliding window with two fixed-window counters: the previous window's count,
+// weighted by how much of it still overlaps the sliding window, plus the current window's count
+struct SlidingWindowCounterPolicy {
+    struct State {
+        long long windowIndex; // Which fixed window currentCount belongs to
+        int currentCount;
+        int previousCount;
+    };
+    static constexpr RateLimiterType type = RateLimiterType::SlidingWindowCounter;
+    // The previous window still carries weight one window after the last request, so wait two
+    static int idleTimeoutSeconds(const RateLimiterConfiguration& config) { return 2 * config.timeWindowSeconds; }
+    static bool consume(State& state, bool, long long now, int cost, const RateLimiterConfiguration& config) {
+        long long windowDuration = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(config.timeWindowSeconds)).count();
+        long long windowIndex = now / windowDuration;
+        // Roll the counters forward if we moved into a new window
+        if(state.windowIndex != windowIndex){
+            state.previousCount = (state.windowIndex == windowIndex - 1) ? state.currentCount : 0;
+            state.currentCount = 0;
+            state.windowIndex = windowIndex;
+        }
+        // Weight of previous window = part of it still inside the sliding window
+        double previousWeight = 1.0 - (double)(now % windowDuration) / windowDuration;
+        double estimatedCount = state.previousCount * previousWeight + state.currentCount;
+        if(estimatedCount + cost <= config.maxRequests){
+            state.currentCount += cost;
+            return true;
+        }
+        return false;
+    }
+    // Retry time after consume denied `cost`: when the previous window's weight has fallen far
+    // enough; if this window's own count already leaves no room, in the next window, where this
+    // one is the previous
+    static AcquireResult denial(const State& state, long long now, int cost, const RateLimiterConfiguration& config) {
+        if(cost > config.maxRequests) return AcquireResult::never();
+        long long windowDuration = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(config.timeWindowSeconds)).count();
+        double room = config.maxRequests - cost;
+        long long windowStart = state.windowIndex * windowDuration;
+        if(state.currentCount <= room){ // previousCount > 0, or the request would have fit
+            double elapsed = 1.0 - (room - state.currentCount) / state.previousCount;
+            return AcquireResult::deniedUntil(windowStart + (long long)ceil(elapsed * windowDuration) + 1, now);
+        }
+        double elapsed = 1.0 - room / state.currentCount;
+        return AcquireResult::deniedUntil(windowStart + windowDuration + (long long)ceil(elapsed * windowDuration) + 1, now);
+    }
+};
+
+// Generic cell rate algorithm: the token bucket expressed as a single "theoretical arrival time"
+// (TAT) per user. Requests are spaced one emission interval (window / maxRequests) apart and
+// may run ahead of that schedule by at most one window, which is a burst of maxRequests.
+struct GCRAPolicy {
+    using State = long long; // TAT, clock nanoseconds
+    static constexpr RateLimiterType type = RateLimiterType::GCRA;
+    static int idleTimeoutSeconds(const RateLimiterConfiguration& config) { return config.timeWindowSeconds; } // TAT in the past
+    static bool consume(State& theoreticalArrivalTime, bool, long long now, int cost, const RateLimiterConfiguration& config) {
+        long long windowDuration = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(config.timeWindowSeconds)).count();
+        long long emissionInterval = windowDuration / config.maxRequests;
+        long long newArrivalTime = max(theoreticalArrivalTime, now) + cost * emissionInterval;
+        if(newArrivalTime - now > windowDuration) return false; // Would exceed the burst allowance
+        theoreticalArrivalTime = newArrivalTime;
+        return true;
+    }
+};
+
+// Lock policy for a limiter that only one thread uses: a store with it takes no locks at all
+struct NullMutex {
+    void lock() {}
+    bool try_lock() { return true; }
+    void unlock() {}
+};
+
+// Token leasing for very hot users. A thread takes a batch of tokens out of the user's bucket and
+// spends them from thread-local storage, so most of its decisions touch no shared cache line.
+// Unspent tokens go back when the lease expires. While tokens are leased out the bucket keeps
+// refilling as if they were spent, so maxLeasedTokens also bounds the over-admission.
+struct TokenLeaseConfiguration {
+    int maxLeasedTokens = 0; // Most tokens one user may have out in leases at once; 0 = leasing off
+    chrono::microseconds leaseDuration{1000};
+};
+
+template<typename ClockType>
+class TokenBucketRateLimiter final : public RateLimiter {
+    struct State {
+        int tokens;
+        int leasedTokens; // Tokens out in thread leases of the current lease epoch
+        long long lastRefillTime; // Clock seconds
+        long long leasesExpireAt; // Every lease of this epoch has expired by then (clock ns)
+        uint32_t leaseEpoch; // Bumped when leases that were never returned are written off
+        uint32_t rateSecond; // Second requestsThisSecond is counting
+        int requestsThisSecond;
+        int observedRate; // Smoothed requests/second, sizes the leases
+    };
+    ShardedStore<State> userStates; // Per-user tokens and last refill time
+
+    // One thread's lease on one user's tokens
+    struct TokenLease {
+        uint64_t limiterId = 0; // Owning limiter; ids are never reused, so a destroyed limiter never matches
+        uint64_t keyHash = 0;
+        string userId;
+        int tokens = 0; // Not spent yet
+        int granted = 0;
+        uint32_t epoch = 0;
+        long long expiresAt = 0;
+    };
+    static constexpr size_t kLeaseSlots = 64; // Per thread, shared by every token bucket limiter
+    static inline atomic<uint64_t> nextLimiterId{1};
+    const uint64_t limiterId = nextLimiterId++;
+    TokenLeaseConfiguration leasing;
+
+    static array<TokenLease, kLeaseSlots>& threadLeases() {
+        static thread_local array<TokenLease, kLeaseSlots> leases;
+        return leases;
+    }
+    void refill(State& state, bool isNewUser, long long currentTime) {
+        TokenBucketPolicy::refill(state.tokens, state.lastRefillTime, isNewUser, currentTime, config);
+    }
+    // Demand estimate for lease sizing: each finished second is averaged into observedRate,
+    // and a silent second in between means the user has cooled down. A thread that read the
+    // clock just before the second turned over counts into the new second.
+    void observeDemand(State& state, long long currentTime, int requests) {
+        int32_t secondsPassed = (int32_t)((uint32_t)currentTime - state.rateSecond);
+        if(secondsPassed > 0 || state.rateSecond == 0){
+            state.observedRate = secondsPassed == 1 ? (state.observedRate + state.requestsThisSecond) / 2 : 0;
+            state.rateSecond = (uint32_t)currentTime;
+            state.requestsThisSecond = 0;
+        }
+        state.requestsThisSecond = max(0, state.requestsThisSecond + requests);
+    }
+    bool consume(State& state, bool isNewUser, long long currentTime, int cost) {
+        // Refill tokens based on time elapsed
+        refill(state, isNewUser, currentTime);
+        if(leasing.maxLeasedTokens > 0) observeDemand(state, currentTime, cost);
+        if(state.tokens >= cost){
+            state.tokens -= cost;
+            return true;
+        }
+        return false;
+    }
+    // Single decision for a plain user id or a pre-resolved KeyHandle
+    template<typename Key>
+    bool decide(Key& key) {
+        long long now = nowNanos<ClockType>();
+        if(leasing.maxLeasedTokens > 0) return decideLeased(key, now);
+        long long currentTime = now / 1000000000;
+        return userStates.withState(key, now, [&](State& state, bool isNewUser) {
+            return consume(state, isNewUser, currentTime, 1);
+        });
+    }
+    template<typename Key>
+    bool decideLeased(Key& key, long long now) {
+        uint64_t keyHash = hashOf(key);
+        TokenLease& lease = threadLeases()[(keyHash ^ limiterId * 0x9E3779B97F4A7C15ull) % kLeaseSlots];
+        bool ours = lease.limiterId == limiterId && lease.keyHash == keyHash && lease.userId == userIdOf(key);
+        if(ours && now < lease.expiresAt){
+            if(lease.tokens > 0){
+                lease.tokens--;
+                return true;
+            }
+            if(lease.granted == 0) return false; // The bucket was empty and does not refill before expiresAt
+        }
+        // The slot's lease is used up, expired or for another user. A lease from another limiter
+        // is dropped: its owner writes those tokens off once the lease's epoch runs out.
+        if(lease.limiterId == limiterId && lease.granted > 0) returnLease(lease, now);
+        lease.limiterId = 0;
+        long long currentTime = now / 1000000000;
+        return userStates.withState(key, now, [&](State& state, bool isNewUser) {
+            refill(state, isNewUser, currentTime);
+            if(isNewUser || now >= state.leasesExpireAt + 4 * leaseNanos()){
+                // Leases still out this long after expiring belong to threads that stopped asking
+                state.leaseEpoch++;
+                state.leasedTokens = 0;
+            }
+            observeDemand(state, currentTime, 1);
+            long long demand = (long long)state.observedRate * leaseNanos() / 1000000000; // Requests per lease period
+            // Lease about one lease period of demand, and at most half of what the bound has
+            // left, so every thread working on the user can hold a lease at the same time
+            long long leaseSize = min<long long>({demand, (leasing.maxLeasedTokens - state.leasedTokens) / 2, state.tokens});
+            if(leaseSize < 2){ // Not hot enough to be worth a lease, or nothing left to lease
+                if(state.tokens >= 1){
+                    state.tokens--;
+                    return true;
+                }
+                if(demand >= 2){
+                    // Hot and empty: refill only happens on a new second, so this thread can deny
+                    // locally until then (tokens other leases hand back meanwhile wait for it)
+                    grantLease(lease, key, state, 0, min(now + leaseNanos(), (currentTime + 1) * 1000000000));
+                }
+                return false;
+            }
+            state.tokens -= leaseSize;
+            state.leasedTokens += leaseSize;
+            state.leasesExpireAt = max(state.leasesExpireAt, now + leaseNanos());
+            grantLease(lease, key, state, leaseSize, now + leaseNanos());
+            lease.tokens--; // One is spent on this request
+            return true;
+        });
+    }
+    template<typename Key>
+    void grantLease(TokenLease& lease, Key& key, const State& state, int tokens, long long expiresAt) {
+        lease.limiterId = limiterId;
+        lease.keyHash = hashOf(key);
+        lease.userId = userIdOf(key);
+        lease.tokens = tokens;
+        lease.granted = tokens;
+        lease.epoch = state.leaseEpoch;
+        lease.expiresAt = expiresAt;
+    }
+    void returnLease(TokenLease& lease, long long now) {
+        long long currentTime = now / 1000000000;
+        userStates.withState(string_view(lease.userId), now, [&](State& state, bool isNewUser) {
+            refill(state, isNewUser, currentTime);
+            // A lease from a written-off epoch is no longer counted in leasedTokens, so handing
+            // its tokens back could exceed the bound; they are dropped instead
+            if(isNewUser || lease.epoch != state.leaseEpoch) return;
+            state.leasedTokens -= lease.granted;
+            state.tokens = min(config.maxRequests, state.tokens + lease.tokens);
+            observeDemand(state, currentTime, -lease.tokens);
+        });
+    }
+    long long leaseNanos() const { return chrono::duration_cast<chrono::nanoseconds>(leasing.leaseDuration).count(); }
+public:
+    TokenBucketRateLimiter(RateLimiterConfiguration config, shared_ptr<ClockType> clock = nullptr) : RateLimiter(config, clock ? clock : defaultClock<ClockType>()), userStates(config.shardCount) {
+        userStates.setIdleTimeout(config.timeWindowSeconds, nowNanos<ClockType>()); // Idle a full window = bucket full again, same as a new user
+    }
+    // Turns on token leasing for single decisions (batches always go to the bucket).
+    // Call before the limiter starts taking decisions.
+    void enableLeasing(TokenLeaseConfiguration leaseConfiguration) { leasing = leaseConfiguration; }
+    LimiterRef ref() override { return LimiterOn<ClockType>(this); }
+    RateLimiterType type() const override { return RateLimiterType::TokenBucket; }
+    KeyStats keyStats() const override { return {userStates.liveKeyCount(), userStates.evictedKeyCount()}; }
+    size_t stateBytes() const override { return userStates.stateBytes(); }
+    LockStats lockStats() const override { return userStates.lockStats(); }
+    // Records: tokens, seconds since the last refill
+    void writeStates(SnapshotWriter& writer) override {
+        writeSnapshot(userStates, writer, [&](State& state, monostate&, long long now, string& out) {
+            long long age = now / 1000000000 - state.lastRefillTime;
+            if(age >= config.timeWindowSeconds) return false; // Refilled to full by now: same as a new user
+            appendField<int32_t>(out, state.tokens);
+            appendField<int64_t>(out, age);
+            return true;
+        });
+    }
+    bool readStates(shared_ptr<Snapshot> snapshot) override {
+        return readSnapshot(userStates, snapshot, chrono::seconds(config.timeWindowSeconds), [this](string_view record, long long origin, const RateLimiterConfiguration& saved, State& state, monostate&) {
+            if(record.size() != sizeof(int32_t) + sizeof(int64_t)) return false;
+            // Keep the tokens already spent spent
+            state.tokens = clamp(takeField<int32_t>(record) + config.maxRequests - saved.maxRequests, 0, config.maxRequests);
+            state.lastRefillTime = origin / 1000000000 - takeField<int64_t>(record);
+            return true;
+        });
+    }
+    bool allowRequest(string_view userId) override { DecisionTimer timer(type()); return decide(userId); }
+    bool allowRequest(KeyHandle& handle) override { DecisionTimer timer(type()); return decide(handle); }
+    DecisionBitmap allowRequests(span<const string> userIds, span<const int> costs = {}) override {
+        long long now = nowNanos<ClockType>(); // One clock read for the whole batch
+        long long currentTime = now / 1000000000;
+        DecisionBitmap decisions(userIds.size());
+        userStates.withStates(userIds, now, [&](size_t i, State& state, bool isNewUser) {
+            if(consume(state, isNewUser, currentTime, costs.empty() ? 1 : costs[i])) decisions.set(i);
+        });
+        return decisions;
+    }
+    // Always decided at the bucket, even with leasing on
+    AcquireResult acquire(string_view userId, int cost = 1) override {
+        DecisionTimer timer(type());
+        long long now = nowNanos<ClockType>();
+        long long currentTime = now / 1000000000;
+        return userStates.withState(userId, now, [&](State& state, bool isNewUser) {
+            if(consume(state, isNewUser, currentTime, cost)) return AcquireResult::granted();
+            if(cost > config.maxRequests) return AcquireResult::never();
+            return AcquireResult::deniedUntil(tokenRefillTime(state.tokens, state.lastRefillTime, cost, config), now);
+        });
+    }
+};
+
+// A user's token count and last refill second packed into one 64-bit word and updated with a
+// CAS loop, so a decision for a hot user never waits on a lock. Uses the same refill formula as
+// TokenBucketRateLimiter.
+struct PackedTokenBucket {
+    // Layout: [63..32] last refill time (seconds) | [31] initialized | [30..0] tokens
+    static constexpr uint64_t kInitializedBit = 1ull << 31;
+    static constexpr uint64_t kTokenMask = kInitializedBit - 1;
+
+    static uint64_t pack(uint32_t lastRefillTime, int tokens) {
+        return ((uint64_t)lastRefillTime << 32) | kInitializedBit | (uint64_t)tokens;
+    }
+    // True once a full window has passed since the last refill: the bucket is full again,
+    // so the user is no different from one never seen
+    static bool idle(uint64_t word, uint32_t currentTime, const RateLimiterConfiguration& config) {
+        return !(word & kInitializedBit) || (int32_t)(currentTime - (uint32_t)(word >> 32)) >= config.timeWindowSeconds;
+    }
+    static bool consume(atomic<uint64_t>& packedState, uint32_t currentTime, int cost, const RateLimiterConfiguration& config) {
+        uint64_t current = packedState.load(memory_order_relaxed);
+        while(true){
+            int tokens;
+            if(!(current & kInitializedBit)){ // When user is seen for the first time
+                tokens = config.maxRequests;
+            }else{
+                // Refill tokens based on time elapsed
+                long long elapsedTime = (int32_t)(currentTime - (uint32_t)(current >> 32));
+                long long tokensToAdd = (elapsedTime * config.maxRequests) / config.timeWindowSeconds;
+                tokens = (int)min<long long>(config.maxRequests, (long long)(current & kTokenMask) + tokensToAdd);
+            }
+            bool allowed = tokens >= cost;
+            if(allowed) tokens -= cost;
+            uint64_t desired = pack(currentTime, tokens);
+            if(desired == current) return allowed; // Nothing to publish (denied within the same second)
+            if(packedState.compare_exchange_weak(current, desired, memory_order_acq_rel, memory_order_relaxed)){
+                return allowed;
+            }
+            // Another thread updated the bucket first; retry against the value it published
+        }
+    }
+    // Retry time after consume denied `cost`, from the word the denial left behind
+    static AcquireResult denial(uint64_t word, long long now, int cost, const RateLimiterConfiguration& config) {
+        if(cost > config.maxRequests) return AcquireResult::never();
+        uint32_t currentTime = (uint32_t)(now / 1000000000);
+        long long lastRefillTime = now / 1000000000 - (int32_t)(currentTime - (uint32_t)(word >> 32)); // Undo the 32-bit wrap
+        return AcquireResult::deniedUntil(tokenRefillTime(word & kTokenMask, lastRefillTime, cost, config), now);
+    }
+};
+
+template<typename ClockType>
+class LockFreeTokenBucketRateLimiter final : public RateLimiter {
+    struct PackedState {
+        atomic<uint64_t> word{0}; // Zero until the user's first request
+        PackedState() {}
+        // Slots only move while the shard is exclusively locked, so a plain load/store is enough
+        PackedState(PackedState&& other) : word(other.word.load(memory_order_relaxed)) {}
+        PackedState& operator=(PackedState&& other) {
+            word.store(other.word.load(memory_order_relaxed), memory_order_relaxed);
+            return *this;
+        }
+    };
+    ShardedStore<PackedState, shared_mutex> userStates; // Per-user packed state
+
+    template<typename Key>
+    bool decide(Key& key) {
+        long long now = nowNanos<ClockType>();
+        uint32_t currentTime = (uint32_t)(now / 1000000000);
+        return userStates.withSharedState(key, now, [&](PackedState& state, bool) {
+            return PackedTokenBucket::consume(state.word, currentTime, 1, config);
+        });
+    }
+public:
+    LockFreeTokenBucketRateLimiter(RateLimiterConfiguration config, shared_ptr<ClockType> clock = nullptr) : RateLimiter(config, clock ? clock : defaultClock<ClockType>()), userStates(config.shardCount) {
+        userStates.setIdleTimeout(config.timeWindowSeconds, nowNanos<ClockType>()); // Idle a full window = bucket full again, same as a new user
+    }
+    LimiterRef ref() override { return LimiterOn<ClockType>(this); }
+    RateLimiterType type() const override { return RateLimiterType::LockFreeTokenBucket; }
+    KeyStats keyStats() const override { return {userStates.liveKeyCount(), userStates.evictedKeyCount()}; }
+    size_t stateBytes() const override { return userStates.stateBytes(); }
+    LockStats lockStats() const override { return userStates.lockStats(); }
+    // Records: tokens, seconds since the last refill
+    void writeStates(SnapshotWriter& writer) override {
+        writeSnapshot(userStates, writer, [&](PackedState& state, monostate&, long long now, string& out) {
+            uint64_t word = state.word.load(memory_order_relaxed);
+            uint32_t currentTime = (uint32_t)(now / 1000000000);
+            if(PackedTokenBucket::idle(word, currentTime, config)) return false;
+            appendField<int32_t>(out, word & PackedTokenBucket::kTokenMask);
+            appendField<int64_t>(out, (int32_t)(currentTime - (uint32_t)(word >> 32)));
+            return true;
+        });
+    }
+    bool readStates(shared_ptr<Snapshot> snapshot) override {
+        return readSnapshot(userStates, snapshot, chrono::seconds(config.timeWindowSeconds), [this](string_view record, long long origin, const RateLimiterConfiguration& saved, PackedState& state, monostate&) {
+            if(record.size() != sizeof(int32_t) + sizeof(int64_t)) return false;
+            int tokens = clamp(takeField<int32_t>(record) + config.maxRequests - saved.maxRequests, 0, config.maxRequests);
+            state.word.store(PackedTokenBucket::pack((uint32_t)(origin / 1000000000 - takeField<int64_t>(record)), tokens), memory_order_relaxed);
+            return true;
+        });
+    }
+    bool allowRequest(string_view userId) override { DecisionTimer timer(type()); return decide(userId); }
+    bool allowRequest(KeyHandle& handle) override { DecisionTimer timer(type()); return decide(handle); }
+    AcquireResult acquire(string_view userId, int cost = 1) override {
+        DecisionTimer timer(type());
+        long long now = nowNanos<ClockType>();
+        return userStates.withSharedState(userId, now, [&](PackedState& state, bool) {
+            if(PackedTokenBucket::consume(state.word, (uint32_t)(now / 1000000000), cost, config)) return AcquireResult::granted();
+            return PackedTokenBucket::denial(state.word.load(memory_order_relaxed), now, cost, config);
+        });
+    }
+    DecisionBitmap allowRequests(span<const string> userIds, span<const int> costs = {}) override {
+        long long now = nowNanos<ClockType>(); // One clock read for the whole batch
+        uint32_t currentTime = (uint32_t)(now / 1000000000);
+        DecisionBitmap decisions(userIds.size());
+        userStates.withSharedStates(userIds, now, [&](size_t i, PackedState& state, bool) {
+            if(PackedTokenBucket::consume(state.word, currentTime, costs.empty() ? 1 : costs[i], config)) decisions.set(i);
+        });
+        return decisions;
+    }
+};
+
+// Token bucket whose per-user state lives in a POSIX shared-memory segment, so all worker processes
+// on a host that open the same segment enforce one limit between them. The segment is a fixed-size
+// open-addressing table of cache-line slots, each holding the user id and a PackedTokenBucket word,
+// so a decision is the same single CAS whichever process makes it.
+// Crash safety: a decision never leaves a half-written state, since it is one CAS. The only
+// multi-step writes, setting up the segment and claiming a slot for a new user, are tagged with the
+// writer's pid, and a claim whose process has died is rolled back by whoever runs into it.
+// A key lives within kMaxProbes slots of its home slot. When that run is full it reuses the slot of
+// a user idle for a whole window; with no such slot the decision is allowed and counted in
+// overflowDecisions, so size the table for the users active within one window.
+template<typename ClockType>
+class SharedMemoryTokenBucketRateLimiter final : public RateLimiter {
+    static constexpr uint64_t kMagic = 0x524c53484d544231ull; // "RLSHMTB1"
+    static constexpr uint64_t kReady = 1;
+    static constexpr uint64_t kClaimBit = 1ull << 63; // kClaimBit | pid = being written by that process
+    static constexpr uint64_t kTombstone = kClaimBit; // Rolled-back claim: free, but probing goes on past it
+    static constexpr size_t kKeyWords = 5; // Ids up to 40 bytes are stored whole, longer ones by prefix + length + hash
+    static constexpr uint64_t kMaxProbes = 64;
+    static_assert(atomic<uint64_t>::is_always_lock_free, "shared-memory state needs address-free atomics");
+
+    struct alignas(64) Header {
+        atomic<uint64_t> state; // 0 = new, kClaimBit | pid while that process sets it up, kReady after
+        uint64_t magic;
+        uint64_t slotCount;
+        int32_t maxRequests;
+        int32_t timeWindowSeconds;
+        atomic<uint64_t> liveKeys;
+        atomic<uint64_t> reclaimedKeys; // Slots handed from an idle user to a new one
+        atomic<uint64_t> overflowDecisions;
+    };
+    struct alignas(64) Slot {
+        atomic<uint64_t> tag; // 0 = empty, kClaimBit | pid while claimed, kTombstone, else the key's tag
+        atomic<uint64_t> word; // PackedTokenBucket state
+        atomic<uint64_t> keyLength;
+        atomic<uint64_t> keyWords[kKeyWords];
+    };
+
+    string segmentName;
+    size_t mappedBytes = 0;
+    Header* header = nullptr;
+    Slot* slots = nullptr;
+    uint64_t slotMask = 0;
+
+    static uint64_t tagOf(uint64_t keyHash) { return (keyHash & ~kClaimBit) ? (keyHash & ~kClaimBit) : 1; }
+    static bool isClaim(uint64_t tag) { return (tag & kClaimBit) && tag != kTombstone; }
+    static bool processAlive(pid_t pid) { return kill(pid, 0) == 0 || errno != ESRCH; }
+    static uint64_t claimTag() { return kClaimBit | (uint64_t)getpid(); }
+
+    // Key bytes are written only while the slot is claimed and read only after seeing it published,
+    // but they are atomics anyway since another process may be reusing the slot meanwhile
+    static void storeKey(Slot& slot, string_view key) {
+        uint64_t words[kKeyWords] = {};
+        memcpy(words, key.data(), min(key.size(), sizeof(words)));
+        for(size_t i = 0; i < kKeyWords; i++) slot.keyWords[i].store(words[i], memory_order_relaxed);
+        slot.keyLength.store(key.size(), memory_order_relaxed);
+    }
+    static bool keyMatches(const Slot& slot, string_view key) {
+        if(slot.keyLength.load(memory_order_relaxed) != key.size()) return false;
+        uint64_t words[kKeyWords] = {};
+        memcpy(words, key.data(), min(key.size(), sizeof(words)));
+        for(size_t i = 0; i < kKeyWords; i++){
+            if(slot.keyWords[i].load(memory_order_relaxed) != words[i]) return false;
+        }
+        return true;
+    }
+    // Waits out another process's claim on the slot, rolling it back if that process died
+    static uint64_t settledTag(Slot& slot) {
+        uint64_t tag = slot.tag.load(memory_order_acquire);
+        while(isClaim(tag)){
+            if(!processAlive((pid_t)(tag & ~kClaimBit))){
+                slot.tag.compare_exchange_strong(tag, kTombstone, memory_order_acq_rel);
+            }else{
+                this_thread::yield();
+            }
+            tag = slot.tag.load(memory_order_acquire);
+        }
+        return tag;
+    }
+    // Takes over `slot` (currently tagged `expected`) for the key, starting it as a new user
+    bool claim(Slot& slot, uint64_t expected, uint64_t keyTag, string_view key, uint32_t currentTime) {
+        if(!slot.tag.compare_exchange_strong(expected, claimTag(), memory_order_acq_rel)) return false;
+        bool reclaimed = expected != 0 && expected != kTombstone;
+        if(reclaimed && !PackedTokenBucket::idle(slot.word.load(memory_order_acquire), currentTime, config)){
+            slot.tag.store(expected, memory_order_release); // Its user came back meanwhile
+            return false;
+        }
+        slot.word.store(0, memory_order_relaxed);
+        storeKey(slot, key);
+        slot.tag.store(keyTag, memory_order_release);
+        (reclaimed ? header->reclaimedKeys : header->liveKeys).fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+    // Linear probing from the key's home slot. A key is absent once an empty slot or the end of its
+    // probe run is reached; it then takes the first reusable slot on its path (tombstone or idle
+    // user), else that empty one.
+    Slot* findOrClaim(string_view key, uint64_t keyHash, uint32_t currentTime) {
+        uint64_t keyTag = tagOf(keyHash);
+        for(int attempt = 0; attempt < 8; attempt++){ // Only repeated when another process changed the path
+            Slot* reusable = nullptr;
+            uint64_t reusableTag = 0;
+            bool changed = false;
+            for(uint64_t probe = 0; probe < min(kMaxProbes, slotMask + 1) && !changed; probe++){
+                Slot& slot = slots[(keyHash + probe) & slotMask];
+                uint64_t tag = settledTag(slot);
+                if(tag == keyTag && keyMatches(slot, key)) return &slot;
+                if(tag == 0){
+                    if(reusable == nullptr){
+                        reusable = &slot;
+                        reusableTag = 0;
+                    }
+                    if(claim(*reusable, reusableTag, keyTag, key, currentTime)) return reusable;
+                    changed = true;
+                }else if(reusable == nullptr && (tag == kTombstone || PackedTokenBucket::idle(slot.word.load(memory_order_relaxed), currentTime, config))){
+                    reusable = &slot;
+                    reusableTag = tag;
+                }
+            }
+            if(!changed){ // The whole run is in use: reuse an idle slot if there was any
+                if(reusable == nullptr) return nullptr;
+                if(claim(*reusable, reusableTag, keyTag, key, currentTime)) return reusable;
+            }
+        }
+        return nullptr;
+    }
+    Slot* slotFor(string_view userId, uint32_t currentTime) { return findOrClaim(userId, hashUserId(userId), currentTime); }
+    Slot* slotFor(KeyHandle& handle, uint32_t currentTime) {
+        if(handle.table == slots && slots[handle.slot].tag.load(memory_order_acquire) == handle.generation) return &slots[handle.slot];
+        Slot* slot = findOrClaim(handle.userId, handle.keyHash, currentTime);
+        if(slot != nullptr){
+            handle.table = slots;
+            handle.slot = slot - slots;
+            handle.generation = tagOf(handle.keyHash);
+        }
+        return slot;
+    }
+    template<typename Key>
+    bool decide(Key& key, uint32_t currentTime, int cost) {
+        Slot* slot = slotFor(key, currentTime);
+        if(slot == nullptr){
+            header->overflowDecisions.fetch_add(1, memory_order_relaxed);
+            return true;
+        }
+        return PackedTokenBucket::consume(slot->word, currentTime, cost, config);
+    }
+    // Sets up a new segment, or waits for the process that is doing it (taking over if it died)
+    void attach() {
+        while(true){
+            uint64_t state = header->state.load(memory_order_acquire);
+            if(state == kReady) break;
+            if(state == 0){
+                if(!header->state.compare_exchange_strong(state, claimTag(), memory_order_acq_rel)) continue;
+                header->magic = kMagic;
+                header->slotCount = (mappedBytes - sizeof(Header)) / sizeof(Slot);
+                header->maxRequests = config.maxRequests;
+                header->timeWindowSeconds = config.timeWindowSeconds;
+                header->state.store(kReady, memory_order_release);
+                break;
+            }
+            if(!processAlive((pid_t)(state & ~kClaimBit))){
+                header->state.compare_exchange_strong(state, 0, memory_order_acq_rel);
+            }else{
+                this_thread::yield();
+            }
+        }
+        if(header->magic != kMagic || header->slotCount == 0 || (header->slotCount & (header->slotCount - 1)) != 0
+           || sizeof(Header) + header->slotCount * sizeof(Slot) > mappedBytes){
+            throw std::runtime_error("Shared memory segment " + segmentName + " is not a rate limiter table");
+        }
+        if(header->maxRequests != config.maxRequests || header->timeWindowSeconds != config.timeWindowSeconds){
+            throw std::runtime_error("Shared memory segment " + segmentName + " was created with a different configuration");
+        }
+        slotMask = header->slotCount - 1;
+    }
+public:
+    // Opens the host-wide segment `segmentName` (e.g. "/rate-limiter-premium"), creating it sized for
+    // maxUsers users if it does not exist yet; an existing segment keeps the size it was created with
+    SharedMemoryTokenBucketRateLimiter(const string& segmentName, size_t maxUsers, RateLimiterConfiguration config, shared_ptr<ClockType> clock = nullptr)
+        : RateLimiter(config, clock ? clock : defaultClock<ClockType>()), segmentName(segmentName) {
+        int fd = shm_open(segmentName.c_str(), O_RDWR | O_CREAT, 0600);
+        if(fd < 0) throw std::runtime_error("shm_open " + segmentName + ": " + strerror(errno));
+        struct stat info;
+        size_t slotCount = bit_ceil(max<size_t>(2 * maxUsers, 64)); // Load factor at most 1/2
+        if(fstat(fd, &info) == 0 && info.st_size == 0 && ftruncate(fd, sizeof(Header) + slotCount * sizeof(Slot)) != 0){
+            close(fd);
+            throw std::runtime_error("ftruncate " + segmentName + ": " + strerror(errno));
+        }
+        fstat(fd, &info);
+        mappedBytes = info.st_size;
+        void* region = mmap(nullptr, mappedBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if(region == MAP_FAILED) throw std::runtime_error("mmap " + segmentName + ": " + strerror(errno));
+        header = (Header*)region; // ftruncate zero-fills, and zero is a valid value for every field
+        slots = (Slot*)((char*)region + sizeof(Header));
+        try{
+            attach();
+        }catch(...){
+            munmap(region, mappedBytes);
+            throw;
+        }
+    }
+    ~SharedMemoryTokenBucketRateLimiter() { munmap(header, mappedBytes); }
+    // The segment outlives every process using it; removing it resets all users on the host
+    static void removeSegment(const string& segmentName) { shm_unlink(segmentName.c_str()); }
+    // Segment the factory uses: one per configuration
+    static string defaultSegmentName(const RateLimiterConfiguration& config) {
+        return "/rate-limiter-" + to_string(config.maxRequests) + "-" + to_string(config.timeWindowSeconds);
+    }
+
+    LimiterRef ref() override { return LimiterOn<ClockType>(this); }
+    RateLimiterType type() const override { return RateLimiterType::SharedMemoryTokenBucket; }
+    // Host-wide: counts users of every process sharing the segment
+    KeyStats keyStats() const override {
+        return {header->liveKeys.load(memory_order_relaxed), header->reclaimedKeys.load(memory_order_relaxed)};
+    }
+    // The whole mapped segment, which every process on the host shares; decisions take no locks
+    size_t stateBytes() const override { return mappedBytes; }
+    // The segment already outlives worker restarts, so there is nothing to save or load
+    void writeStates(SnapshotWriter&) override {}
+    bool readStates(shared_ptr<Snapshot>) override { return false; }
+    uint64_t overflowDecisions() const { return header->overflowDecisions.load(memory_order_relaxed); }
+    bool allowRequest(string_view userId) override { DecisionTimer timer(type()); return decide(userId, (uint32_t)(nowNanos<ClockType>() / 1000000000), 1); }
+    bool allowRequest(KeyHandle& handle) override { DecisionTimer timer(type()); return decide(handle, (uint32_t)(nowNanos<ClockType>() / 1000000000), 1); }
+    AcquireResult acquire(string_view userId, int cost = 1) override {
+        DecisionTimer timer(type());
+        long long now = nowNanos<ClockType>();
+        uint32_t currentTime = (uint32_t)(now / 1000000000);
+        Slot* slot = slotFor(userId, currentTime);
+        if(slot == nullptr){
+            header->overflowDecisions.fetch_add(1, memory_order_relaxed);
+            return AcquireResult::granted();
+        }
+        if(PackedTokenBucket::consume(slot->word, currentTime, cost, config)) return AcquireResult::granted();
+        return PackedTokenBucket::denial(slot->word.load(memory_order_relaxed), now, cost, config);
+    }
+    DecisionBitmap allowRequests(span<const string> userIds, span<const int> costs = {}) override {
+        uint32_t currentTime = (uint32_t)(nowNanos<ClockType>() / 1000000000); // One clock read for the whole batch
+        DecisionBitmap decisions(userIds.size());
+        for(size_t i = 0; i < userIds.size(); i++){
+            string_view userId = userIds[i];
+            if(decide(userId, currentTime, costs.empty() ? 1 : costs[i])) decisions.set(i);
+        }
+        return decisions;
+    }
+};
+
+template<typename ClockType>
+class FixedWindowRateLimiter final : public RateLimiter {
+    using State = FixedWindowPolicy::State;
+    ShardedStore<State> userStates; // Per-user request count and window start time
+
+    bool consume(State& state, bool isNewUser, long long now, int cost) {
+        return FixedWindowPolicy::consume(state, isNewUser, now, cost, config);
+    }
+    template<typename Key>
+    bool decide(Key& key) {
+        long long now = nowNanos<ClockType>();
+        return userStates.withState(key, now, [&](State& state, bool isNewUser) {
+            return consume(state, isNewUser, now, 1);
+        });
+    }
+public:
+    FixedWindowRateLimiter(RateLimiterConfiguration config, shared_ptr<ClockType> clock = nullptr) : RateLimiter(config, clock ? clock : defaultClock<ClockType>()), userStates(config.shardCount) {
+        userStates.setIdleTimeout(config.timeWindowSeconds, nowNanos<ClockType>()); // Idle a full window = window expired, same as a new user
+    }
+    // Denied requests wait for the window to expire
+    AcquireResult acquire(string_view userId, int cost = 1) override {
+        DecisionTimer timer(type());
+        long long now = nowNanos<ClockType>();
+        long long windowDuration = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(config.timeWindowSeconds)).count();
+        return userStates.withState(userId, now, [&](State& state, bool isNewUser) {
+            if(consume(state, isNewUser, now, cost)) return AcquireResult::granted();
+            if(cost > config.maxRequests) return AcquireResult::never();
+            return AcquireResult::deniedUntil(state.windowStartTime + windowDuration + 1, now);
+        });
+    }
+    LimiterRef ref() override { return LimiterOn<ClockType>(this); }
+    RateLimiterType type() const override { return RateLimiterType::FixedWindow; }
+    KeyStats keyStats() const override { return {userStates.liveKeyCount(), userStates.evictedKeyCount()}; }
+    size_t stateBytes() const override { return userStates.stateBytes(); }
+    LockStats lockStats() const override { return userStates.lockStats(); }
+    // Records: request count, nanoseconds since the window started
+    void writeStates(SnapshotWriter& writer) override {
+        long long windowDuration = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(config.timeWindowSeconds)).count();
+        writeSnapshot(userStates, writer, [&](State& state, monostate&, long long now, string& out) {
+            long long age = now - state.windowStartTime;
+            if(age > windowDuration) return false; // Window over: same as a new user
+            appendField<int32_t>(out, state.requestCount);
+            appendField<int64_t>(out, age);
+            return true;
+        });
+    }
+    bool readStates(shared_ptr<Snapshot> snapshot) override {
+        return readSnapshot(userStates, snapshot, chrono::seconds(config.timeWindowSeconds), [](string_view record, long long origin, const RateLimiterConfiguration&, State& state, monostate&) {
+            if(record.size() != sizeof(int32_t) + sizeof(int64_t)) return false;
+            state.requestCount = takeField<int32_t>(record);
+            state.windowStartTime = origin - takeField<int64_t>(record);
+            return true;
+        });
+    }
+    bool allowRequest(string_view userId) override { DecisionTimer timer(type()); return decide(userId); }
+    bool allowRequest(KeyHandle& handle) override { DecisionTimer timer(type()); return decide(handle); }
+    DecisionBitmap allowRequests(span<const string> userIds, span<const int> costs = {}) override {
+        long long now = nowNanos<ClockType>(); // One clock read for the whole batch
+        DecisionBitmap decisions(userIds.size());
+        userStates.withStates(userIds, now, [&](size_t i, State& state, bool isNewUser) {
+            if(consume(state, isNewUser, now, costs.empty() ? 1 : costs[i])) decisions.set(i);
+        });
+        return decisions;
+    }
+};
+
+// Slab allocator for per-user timestamp rings. Rings come in size classes (8, 16, 32, ... capped
+// at maxEntries) carved out of large chunks; a released ring goes on its class's free list and is
+// handed out again, so once users have reached their steady-state size nothing is allocated.
+class TimestampRingSlab {
+    static constexpr size_t kChunkBytes = 1 << 16;
+    struct SizeClass {
+        size_t capacity; // Timestamps per ring
+        size_t ringsPerChunk;
+        uint32_t ringCount = 0; // Rings carved so far
+        vector<unique_ptr<long long[]>> chunks;
+        vector<uint32_t> freeRings;
+    };
+    vector<SizeClass> classes;
+public:
+    TimestampRingSlab() {}
+    TimestampRingSlab(int maxEntries) {
+        size_t limit = max(maxEntries, 1);
+        for(size_t capacity = 8; ; capacity *= 2){
+            SizeClass sizeClass;
+            sizeClass.capacity = min(capacity, limit);
+            sizeClass.ringsPerChunk = max<size_t>(1, kChunkBytes / (sizeClass.capacity * sizeof(long long)));
+            classes.push_back(std::move(sizeClass));
+            if(capacity >= limit) break;
+        }
+    }
+    int classCount() const { return classes.size(); }
+    size_t capacity(int sizeClass) const { return classes[sizeClass].capacity; }
+    uint32_t allocate(int sizeClass) {
+        SizeClass& c = classes[sizeClass];
+        if(!c.freeRings.empty()){
+            uint32_t ring = c.freeRings.back();
+            c.freeRings.pop_back();
+            return ring;
+        }
+        if(c.ringCount == c.chunks.size() * c.ringsPerChunk){
+            c.chunks.push_back(make_unique<long long[]>(c.ringsPerChunk * c.capacity));
+        }
+        return c.ringCount++;
+    }
+    void release(int sizeClass, uint32_t ring) { classes[sizeClass].freeRings.push_back(ring); }
+    size_t memoryBytes() const {
+        size_t total = 0;
+        for(const SizeClass& c : classes) total += c.chunks.size() * c.ringsPerChunk * c.capacity * sizeof(long long) + c.freeRings.capacity() * sizeof(uint32_t);
+        return total;
+    }
+    long long* ring(int sizeClass, uint32_t ring) {
+        SizeClass& c = classes[sizeClass];
+        return c.chunks[ring / c.ringsPerChunk].get() + (ring % c.ringsPerChunk) * c.capacity;
+    }
+};
+
+template<typename ClockType>
+class SlidingWindowRateLimiter final : public RateLimiter {
+    // A user's request times (steady clock nanoseconds), oldest first, in a ring from the shard's slab
+    struct TimestampLog {
+        uint32_t ring;
+        int sizeClass;
+        uint32_t head; // Position of the oldest timestamp
+        uint32_t count;
+    };
+    ShardedStore<TimestampLog, mutex, TimestampRingSlab> userTimestamps; // Per-user request times
+
+    static long long at(const long long* ring, size_t capacity, const TimestampLog& log, size_t i) {
+        size_t index = log.head + i;
+        return ring[index >= capacity ? index - capacity : index];
+    }
+    // Moves the log into the next size class, keeping its order
+    static void grow(TimestampLog& log, TimestampRingSlab& slab) {
+        const long long* oldRing = slab.ring(log.sizeClass, log.ring);
+        size_t oldCapacity = slab.capacity(log.sizeClass);
+        uint32_t newRing = slab.allocate(log.sizeClass + 1);
+        long long* ring = slab.ring(log.sizeClass + 1, newRing);
+        for(size_t i = 0; i < log.count; i++) ring[i] = at(oldRing, oldCapacity, log, i);
+        slab.release(log.sizeClass, log.ring);
+        log.ring = newRing;
+        log.sizeClass++;
+        log.head = 0;
+    }
+    bool consume(TimestampLog& log, bool isNewUser, TimestampRingSlab& slab, long long now, int cost) {
+        long long windowDuration = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(config.timeWindowSeconds)).count();
+        if(isNewUser){
+            log.sizeClass = 0;
+            log.ring = slab.allocate(0);
+        }
+        long long* ring = slab.ring(log.sizeClass, log.ring);
+        size_t capacity = slab.capacity(log.sizeClass);
+        // Another thread may have logged a later clock reading first; keep the log sorted
+        if(log.count > 0) now = max(now, at(ring, capacity, log, log.count - 1));
+
+        // Drop timestamps outside the current window: binary search for the first one still inside
+        size_t low = 0, high = log.count;
+        while(low < high){
+            size_t mid = (low + high) / 2;
+            if(now - at(ring, capacity, log, mid) > windowDuration) low = mid + 1;
+            else high = mid;
+        }
+        log.head = (log.head + low) % capacity;
+        log.count -= low;
+
+        // Check if we can allow the request
+        if(log.count + cost > (size_t)config.maxRequests) return false;
+        while(log.count + cost > capacity){
+            grow(log, slab);
+            ring = slab.ring(log.sizeClass, log.ring);
+            capacity = slab.capacity(log.sizeClass);
+        }
+        for(int i = 0; i < cost; i++){
+            size_t tail = log.head + log.count;
+            ring[tail >= capacity ? tail - capacity : tail] = now;
+            log.count++;
+        }
+        return true;
+    }
+    template<typename Key>
+    bool decide(Key& key) {
+        long long now = nowNanos<ClockType>();
+        // Get or create timestamp log for this user
+        return userTimestamps.withState(key, now, [&](TimestampLog& log, bool isNewUser, TimestampRingSlab& slab) {
+            return consume(log, isNewUser, slab, now, 1);
+        });
+    }
+public:
+    SlidingWindowRateLimiter(RateLimiterConfiguration config, shared_ptr<ClockType> clock = nullptr) : RateLimiter(config, clock ? clock : defaultClock<ClockType>()), userTimestamps(config.shardCount, config.maxRequests) {
+        // Idle a full window = every timestamp expired; hand the user's ring back to the slab
+        userTimestamps.setIdleTimeout(config.timeWindowSeconds, nowNanos<ClockType>(), [](TimestampLog& log, TimestampRingSlab& slab) {
+            slab.release(log.sizeClass, log.ring);
+        });
+    }
+    // Denied requests wait until enough of the oldest timestamps have left the window
+    AcquireResult acquire(string_view userId, int cost = 1) override {
+        DecisionTimer timer(type());
+        long long now = nowNanos<ClockType>();
+        long long windowDuration = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(config.timeWindowSeconds)).count();
+        return userTimestamps.withState(userId, now, [&](TimestampLog& log, bool isNewUser, TimestampRingSlab& slab) {
+            if(consume(log, isNewUser, slab, now, cost)) return AcquireResult::granted();
+            if(cost > config.maxRequests) return AcquireResult::never();
+            size_t mustExpire = log.count + cost - config.maxRequests;
+            long long lastToExpire = at(slab.ring(log.sizeClass, log.ring), slab.capacity(log.sizeClass), log, mustExpire - 1);
+            return AcquireResult::deniedUntil(lastToExpire + windowDuration + 1, now);
+        });
+    }
+    LimiterRef ref() override { return LimiterOn<ClockType>(this); }
+    RateLimiterType type() const override { return RateLimiterType::SlidingWindow; }
+    KeyStats keyStats() const override { return {userTimestamps.liveKeyCount(), userTimestamps.evictedKeyCount()}; }
+    size_t stateBytes() const override { return userTimestamps.stateBytes(); }
+    LockStats lockStats() const override { return userTimestamps.lockStats(); }
+    // Records: timestamp count, then each timestamp's age in nanoseconds, oldest first
+    void writeStates(SnapshotWriter& writer) override {
+        long long windowDuration = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(config.timeWindowSeconds)).count();
+        writeSnapshot(userTimestamps, writer, [&](TimestampLog& log, TimestampRingSlab& slab, long long now, string& out) {
+            const long long* ring = slab.ring(log.sizeClass, log.ring);
+            size_t capacity = slab.capacity(log.sizeClass);
+            size_t first = 0;
+            while(first < log.count && now - at(ring, capacity, log, first) > windowDuration) first++;
+            if(first == log.count) return false; // Every timestamp expired: same as a new user
+            appendField<uint32_t>(out, log.count - first);
+            for(size_t i = first; i < log.count; i++) appendField<int64_t>(out, max(0ll, now - at(ring, capacity, log, i)));
+            return true;
+        });
+    }
+    bool readStates(shared_ptr<Snapshot> snapshot) override {
+        return readSnapshot(userTimestamps, snapshot, chrono::seconds(config.timeWindowSeconds), [this](string_view record, long long origin, const RateLimiterConfiguration&, TimestampLog& log, TimestampRingSlab& slab) {
+            if(record.size() < sizeof(uint32_t)) return false;
+            uint32_t count = takeField<uint32_t>(record);
+            if(count == 0 || record.size() != count * sizeof(int64_t)) return false;
+            if(count > (uint32_t)config.maxRequests){ // Saved under a higher limit: the newest ones are what counts
+                record.remove_prefix((count - config.maxRequests) * sizeof(int64_t));
+                count = config.maxRequests;
+            }
+            log.sizeClass = 0;
+            while(slab.capacity(log.sizeClass) < count) log.sizeClass++;
+            log.ring = slab.allocate(log.sizeClass);
+            log.head = 0;
+            log.count = count;
+            long long* ring = slab.ring(log.sizeClass, log.ring);
+            for(uint32_t i = 0; i < count; i++) ring[i] = origin - takeField<int64_t>(record);
+            return true;
+        });
+    }
+    bool allowRequest(string_view userId) override { DecisionTimer timer(type()); return decide(userId); }
+    bool allowRequest(KeyHandle& handle) override { DecisionTimer timer(type()); return decide(handle); }
+    DecisionBitmap allowRequests(span<const string> userIds, span<const int> costs = {}) override {
+        // One clock read for the whole batch
+        long long now = nowNanos<ClockType>();
+        DecisionBitmap decisions(userIds.size());
+        userTimestamps.withStates(userIds, now, [&](size_t i, TimestampLog& log, bool isNewUser, TimestampRingSlab& slab) {
+            if(consume(log, isNewUser, slab, now, costs.empty() ? 1 : costs[i])) decisions.set(i);
+        });
+        return decisions;
+    }
+};
+
+// Sliding window approximated by two fixed-window counters (see SlidingWindowCounterPolicy)
+template<typename ClockType>
+class SlidingWindowCounterRateLimiter final : public RateLimiter {
+    using State = SlidingWindowCounterPolicy::State;
+    ShardedStore<State> userStates; // Per-user window counters
+
+    bool consume(State& state, long long now, int cost) {
+        return SlidingWindowCounterPolicy::consume(state, false, now, cost, config);
+    }
+    template<typename Key>
+    bool decide(Key& key) {
+        long long now = nowNanos<ClockType>();
+        return userStates.withState(key, now, [&](State& state, bool) {
+            return consume(state, now, 1);
+        });
+    }
+public:
+    SlidingWindowCounterRateLimiter(RateLimiterConfiguration config, shared_ptr<ClockType> clock = nullptr) : RateLimiter(config, clock ? clock : defaultClock<ClockType>()), userStates(config.shardCount) {
+        // The previous window still carries weight one window after the last request, so wait two
+        userStates.setIdleTimeout(2 * config.timeWindowSeconds, nowNanos<ClockType>());
+    }
+    // Denied requests wait for the previous window's weight to fall far enough
+    AcquireResult acquire(string_view userId, int cost = 1) override {
+        DecisionTimer timer(type());
+        long long now = nowNanos<ClockType>();
+        return userStates.withState(userId, now, [&](State& state, bool) {
+            if(consume(state, now, cost)) return AcquireResult::granted();
+            return SlidingWindowCounterPolicy::denial(state, now, cost, config);
+        });
+    }
+    LimiterRef ref() override { return LimiterOn<ClockType>(this); }
+    RateLimiterType type() const override { return RateLimiterType::SlidingWindowCounter; }
+    KeyStats keyStats() const override { return {userStates.liveKeyCount(), userStates.evictedKeyCount()}; }
+    size_t stateBytes() const override { return userStates.stateBytes(); }
+    LockStats lockStats() const override { return userStates.lockStats(); }
+    // Records: current and previous counts, nanoseconds since the current window started
+    void writeStates(SnapshotWriter& writer) override {
+        long long windowDuration = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(config.timeWindowSeconds)).count();
+        writeSnapshot(userStates, writer, [&](State& state, monostate&, long long now, string& out) {
+            if(state.windowIndex < now / windowDuration - 1) return false; // Neither window counts any more
+            appendField<int32_t>(out, state.currentCount);
+            appendField<int32_t>(out, state.previousCount);
+            appendField<int64_t>(out, now - state.windowIndex * windowDuration);
+            return true;
+        });
+    }
+    // The restored window is the one of this clock's fixed windows the saved window started in
+    bool readStates(shared_ptr<Snapshot> snapshot) override {
+        return readSnapshot(userStates, snapshot, chrono::seconds(2 * config.timeWindowSeconds), [this](string_view record, long long origin, const RateLimiterConfiguration&, State& state, monostate&) {
+            if(record.size() != 2 * sizeof(int32_t) + sizeof(int64_t)) return false;
+            long long windowDuration = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(config.timeWindowSeconds)).count();
+            state.currentCount = takeField<int32_t>(record);
+            state.previousCount = takeField<int32_t>(record);
+            // Nearest window start: origin is only as exact as the wall clock
+            state.windowIndex = (origin - takeField<int64_t>(record) + windowDuration / 2) / windowDuration;
+            return true;
+        });
+    }
+    bool allowRequest(string_view userId) override { DecisionTimer timer(type()); return decide(userId); }
+    bool allowRequest(KeyHandle& handle) override { DecisionTimer timer(type()); return decide(handle); }
+    DecisionBitmap allowRequests(span<const string> userIds, span<const int> costs = {}) override {
+        // One clock read for the whole batch
+        long long now = nowNanos<ClockType>();
+        DecisionBitmap decisions(userIds.size());
+        userStates.withStates(userIds, now, [&](size_t i, State& state, bool) {
+            if(consume(state, now, costs.empty() ? 1 : costs[i])) decisions.set(i);
+        });
+        return decisions;
+    }
+};
+
+// Generic cell rate algorithm (see GCRAPolicy)
+template<typename ClockType>
+class GCRARateLimiter final : public RateLimiter {
+    ShardedStore<long long> theoreticalArrivalTimes; // Per-user TAT, steady clock nanoseconds
+
+    bool consume(long long& theoreticalArrivalTime, long long now, int cost) {
+        return GCRAPolicy::consume(theoreticalArrivalTime, false, now, cost, config);
+    }
+    template<typename Key>
+    bool decide(Key& key) {
+        long long now = nowNanos<ClockType>();
+        return theoreticalArrivalTimes.withState(key, now, [&](long long& theoreticalArrivalTime, bool) {
+            return consume(theoreticalArrivalTime, now, 1);
+        });
+    }
+public:
+    GCRARateLimiter(RateLimiterConfiguration config, shared_ptr<ClockType> clock = nullptr) : RateLimiter(config, clock ? clock : defaultClock<ClockType>()), theoreticalArrivalTimes(config.shardCount) {
+        theoreticalArrivalTimes.setIdleTimeout(config.timeWindowSeconds, nowNanos<ClockType>()); // Idle a full window = TAT in the past, same as a new user
+    }
+    // Denied requests wait until the TAT is close enough to now for `cost` more intervals
+    AcquireResult acquire(string_view userId, int cost = 1) override {
+        DecisionTimer timer(type());
+        long long now = nowNanos<ClockType>();
+        long long windowDuration = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(config.timeWindowSeconds)).count();
+        long long emissionInterval = windowDuration / config.maxRequests;
+        return theoreticalArrivalTimes.withState(userId, now, [&](long long& theoreticalArrivalTime, bool) {
+            if(consume(theoreticalArrivalTime, now, cost)) return AcquireResult::granted();
+            if(cost * emissionInterval > windowDuration) return AcquireResult::never();
+            return AcquireResult::deniedUntil(max(theoreticalArrivalTime, now) + cost * emissionInterval - windowDuration, now);
+        });
+    }
+    LimiterRef ref() override { return LimiterOn<ClockType>(this); }
+    RateLimiterType type() const override { return RateLimiterType::GCRA; }
+    KeyStats keyStats() const override { return {theoreticalArrivalTimes.liveKeyCount(), theoreticalArrivalTimes.evictedKeyCount()}; }
+    size_t stateBytes() const override { return theoreticalArrivalTimes.stateBytes(); }
+    LockStats lockStats() const override { return theoreticalArrivalTimes.lockStats(); }
+    // Records: nanoseconds the TAT lies ahead of the snapshot moment
+    void writeStates(SnapshotWriter& writer) override {
+        writeSnapshot(theoreticalArrivalTimes, writer, [&](long long& theoreticalArrivalTime, monostate&, long long now, string& out) {
+            if(theoreticalArrivalTime <= now) return false; // Full burst available: same as a new user
+            appendField<int64_t>(out, theoreticalArrivalTime - now);
+            return true;
+        });
+    }
+    bool readStates(shared_ptr<Snapshot> snapshot) override {
+        return readSnapshot(theoreticalArrivalTimes, snapshot, chrono::seconds(config.timeWindowSeconds), [this](string_view record, long long origin, const RateLimiterConfiguration& saved, long long& theoreticalArrivalTime, monostate&) {
+            if(record.size() != sizeof(int64_t)) return false;
+            // The TAT is ahead by the emission intervals used; the same number of intervals under these limits
+            long long ahead = takeField<int64_t>(record);
+            long long savedInterval = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(saved.timeWindowSeconds)).count() / saved.maxRequests;
+            long long interval = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(config.timeWindowSeconds)).count() / config.maxRequests;
+            theoreticalArrivalTime = origin + (long long)((__int128)ahead * interval / savedInterval);
+            return true;
+        });
+    }
+    bool allowRequest(string_view userId) override { DecisionTimer timer(type()); return decide(userId); }
+    bool allowRequest(KeyHandle& handle) override { DecisionTimer timer(type()); return decide(handle); }
+    DecisionBitmap allowRequests(span<const string> userIds, span<const int> costs = {}) override {
+        // One clock read for the whole batch
+        long long now = nowNanos<ClockType>();
+        DecisionBitmap decisions(userIds.size());
+        theoreticalArrivalTimes.withStates(userIds, now, [&](size_t i, long long& theoreticalArrivalTime, bool) {
+            if(consume(theoreticalArrivalTime, now, costs.empty() ? 1 : costs[i])) decisions.set(i);
+        });
+        return decisions;
+    }
+};
+
+// Sizing of a CountMinSketchRateLimiter; its memory is fixed up front, however many keys show up
+struct CountMinSketchConfiguration {
+    size_t memoryBytes = 4 << 20; // Counters of both windows over all shards
+    int depth = 4; // Rows per sketch, 1..CountMinSketchRateLimiter<>::kMaxDepth
+    size_t heavyHitterSlots = 256; // Per shard: keys counted exactly once they are promoted; 0 = never promote
+    double promoteAt = 0.5; // Fraction of maxRequests a key's two windows must reach for promotion
+};
+
+// With probability at least 1 - delta, a key's estimate exceeds what it really used by at most
+// epsilon times the requests its shard counted in the window
+struct SketchErrorBound {
+    double epsilon;
+    double delta;
+    long long maxOvercount; // epsilon times the busiest shard's count, as of its latest decision
+};
+
+// Sliding window counter for unbounded key spaces (per IP, per API key) in fixed memory. Instead
+// of a state per key, each shard keeps one count-min sketch per window: `depth` rows of counters,
+// where a key adds to one counter in every row and reads the smallest of them. Keys sharing a
+// counter only ever raise each other's estimates, so the sketch may deny a key early but never
+// lets it use more than its limit. A key whose counts reach promoteAt of the limit is moved to
+// an exact counter (up to heavyHitterSlots per shard), so heavy hitters stop inflating the
+// estimates of the keys they collide with; it goes back to the sketch once its windows expire.
+template<typename ClockType>
+class CountMinSketchRateLimiter final : public RateLimiter {
+public:
+    static constexpr int kMaxDepth = 8;
+private:
+    using ExactState = SlidingWindowCounterPolicy::State;
+    using Columns = array<uint32_t, kMaxDepth>;
+    struct alignas(64) Shard {
+        mutex mtx;
+        LockCounters lockCounters; // Decisions only
+        long long windowIndex = 0; // Window the current sketch counts
+        int current = 0; // Which of the two sketches is the current window's
+        unique_ptr<uint32_t[]> counters; // [sketch][row][column]
+        array<long long, 2> windowTotals{}; // Requests each sketch counted
+        FlatHashMap<ExactState> heavyHitters;
+    };
+    CountMinSketchConfiguration sketch;
+    size_t width = 1; // Columns per row, a power of two
+    unique_ptr<Shard[]> shards;
+    size_t shardMask;
+    long long windowDuration;
+    atomic<uint64_t> demotedKeys{0};
+
+    Shard& shardFor(uint64_t keyHash) { return shards[(keyHash >> 32) & shardMask]; }
+    size_t sketchSize() const { return (size_t)sketch.depth * width; }
+    uint32_t* row(Shard& shard, int which, int r) { return shard.counters.get() + which * sketchSize() + r * width; }
+    // The key's column in each row, by double hashing one remixed hash
+    void columns(uint64_t keyHash, Columns& column) const {
+        uint64_t mixed = keyHash;
+        mixed ^= mixed >> 33;
+        mixed *= 0xff51afd7ed558ccdull;
+        mixed ^= mixed >> 33;
+        mixed *= 0xc4ceb9fe1a85ec53ull;
+        mixed ^= mixed >> 33;
+        uint32_t first = (uint32_t)mixed, step = (uint32_t)(mixed >> 32) | 1;
+        for(int r = 0; r < kMaxDepth; r++) column[r] = (first + r * step) & (width - 1);
+    }
+    // Moves the shard on to windowIndex: the current sketch becomes the previous one and the
+    // other is cleared. Caller holds the shard lock.
+    void roll(Shard& shard, long long windowIndex) {
+        if(shard.windowIndex >= windowIndex) return;
+        if(windowIndex == shard.windowIndex + 1){
+            shard.current ^= 1;
+            fill_n(shard.counters.get() + shard.current * sketchSize(), sketchSize(), 0);
+            shard.windowTotals[shard.current] = 0;
+        }else{
+            fill_n(shard.counters.get(), 2 * sketchSize(), 0);
+            shard.windowTotals = {};
+        }
+        shard.windowIndex = windowIndex;
+        // Promoted keys whose windows no longer count go back to the sketch
+        vector<pair<uint64_t, string>> expired;
+        shard.heavyHitters.forEach([&](uint64_t keyHash, string_view key, ExactState& state) {
+            if(state.windowIndex < windowIndex - 1) expired.push_back({keyHash, string(key)});
+        });
+        for(auto& [keyHash, key] : expired) shard.heavyHitters.erase(keyHash, key);
+        demotedKeys += expired.size();
+    }
+    // The key's counts in both windows: the smallest of its counters in each sketch. The rows are
+    // read into fixed-size arrays first so the minimum is a straight loop the compiler vectorizes.
+    ExactState estimate(Shard& shard, const Columns& column) {
+        Columns current{}, previous{};
+        for(int r = 0; r < sketch.depth; r++){
+            current[r] = row(shard, shard.current, r)[column[r]];
+            previous[r] = row(shard, shard.current ^ 1, r)[column[r]];
+        }
+        uint32_t currentMin = UINT32_MAX, previousMin = UINT32_MAX;
+        for(int r = 0; r < sketch.depth; r++){
+            currentMin = min(currentMin, current[r]);
+            previousMin = min(previousMin, previous[r]);
+        }
+        return {shard.windowIndex, (int)min<uint32_t>(currentMin, INT_MAX), (int)min<uint32_t>(previousMin, INT_MAX)};
+    }
+    // One decision under the shard lock; `seen` is the state it was judged by (for retry-after)
+    bool consume(Shard& shard, uint64_t keyHash, string_view key, long long now, int cost, ExactState& seen) {
+        roll(shard, now / windowDuration);
+        if(ExactState* exact = shard.heavyHitters.find(keyHash, key)){
+            bool allowed = SlidingWindowCounterPolicy::consume(*exact, false, now, cost, config);
+            seen = *exact;
+            return allowed;
+        }
+        Columns column;
+        columns(keyHash, column);
+        seen = estimate(shard, column);
+        ExactState counted = seen;
+        bool allowed = SlidingWindowCounterPolicy::consume(counted, false, now, cost, config);
+        if(sketch.heavyHitterSlots > 0 && counted.currentCount + counted.previousCount >= sketch.promoteAt * config.maxRequests
+           && shard.heavyHitters.size() < sketch.heavyHitterSlots){
+            *shard.heavyHitters.findOrInsert(keyHash, key).first = counted; // From here on its requests skip the sketch
+            return allowed;
+        }
+        if(allowed){
+            for(int r = 0; r < sketch.depth; r++){
+                uint32_t& counter = row(shard, shard.current, r)[column[r]];
+                counter += min<uint32_t>(cost, UINT32_MAX - counter); // Saturates instead of wrapping
+            }
+            shard.windowTotals[shard.current] += cost;
+        }
+        return allowed;
+    }
+    template<typename Key>
+    bool decide(Key& key, long long now, int cost) {
+        uint64_t keyHash = hashOf(key);
+        Shard& shard = shardFor(keyHash);
+        CountedLock<mutex> lock(shard.mtx, shard.lockCounters);
+        ExactState seen;
+        return consume(shard, keyHash, userIdOf(key), now, cost, seen);
+    }
+public:
+    CountMinSketchRateLimiter(RateLimiterConfiguration config, shared_ptr<ClockType> clock = nullptr, CountMinSketchConfiguration sketchConfiguration = {})
+        : RateLimiter(config, clock ? clock : defaultClock<ClockType>()), sketch(sketchConfiguration) {
+        sketch.depth = clamp(sketch.depth, 1, kMaxDepth);
+        size_t shardCount = 1;
+        while(shardCount < (size_t)max(config.shardCount, 1)) shardCount <<= 1; // Round up to a power of two
+        shards = make_unique<Shard[]>(shardCount);
+        shardMask = shardCount - 1;
+        size_t columnsPerRow = max<size_t>(1, sketch.memoryBytes / (shardCount * 2 * sketch.depth * sizeof(uint32_t)));
+        while(width * 2 <= columnsPerRow) width *= 2;
+        windowDuration = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(config.timeWindowSeconds)).count();
+        long long windowIndex = nowNanos<ClockType>() / windowDuration;
+        for(size_t i = 0; i < shardCount; i++){
+            shards[i].counters = make_unique<uint32_t[]>(2 * sketchSize());
+            shards[i].windowIndex = windowIndex;
+        }
+    }
+    LimiterRef ref() override { return LimiterOn<ClockType>(this); }
+    RateLimiterType type() const override { return RateLimiterType::CountMinSketch; }
+    // liveKeys counts the keys tracked exactly; the sketch does not know how many keys it has seen
+    KeyStats keyStats() const override {
+        size_t promoted = 0;
+        for(size_t i = 0; i <= shardMask; i++){
+            lock_guard<mutex> lock(shards[i].mtx);
+            promoted += shards[i].heavyHitters.size();
+        }
+        return {promoted, demotedKeys.load()};
+    }
+    size_t memoryBytes() const { return (shardMask + 1) * 2 * sketchSize() * sizeof(uint32_t); }
+    // The sketches plus the promoted keys' exact tables
+    size_t stateBytes() const override {
+        size_t total = memoryBytes() + (shardMask + 1) * sizeof(Shard);
+        for(size_t i = 0; i <= shardMask; i++){
+            lock_guard<mutex> lock(shards[i].mtx);
+            total += shards[i].heavyHitters.memoryBytes();
+        }
+        return total;
+    }
+    LockStats lockStats() const override {
+        LockStats total;
+        for(size_t i = 0; i <= shardMask; i++) total += shards[i].lockCounters.stats();
+        return total;
+    }
+    SketchErrorBound errorBound() const {
+        double epsilon = exp(1.0) / width;
+        long long busiest = 0;
+        for(size_t i = 0; i <= shardMask; i++){
+            lock_guard<mutex> lock(shards[i].mtx);
+            busiest = max(busiest, shards[i].windowTotals[0] + shards[i].windowTotals[1]);
+        }
+        return {epsilon, exp(-(double)sketch.depth), (long long)ceil(epsilon * busiest)};
+    }
+    // What the limiter currently counts for the key in its {current, previous} window
+    pair<int, int> estimatedCounts(string_view userId) {
+        uint64_t keyHash = hashUserId(userId);
+        Shard& shard = shardFor(keyHash);
+        lock_guard<mutex> lock(shard.mtx);
+        roll(shard, nowNanos<ClockType>() / windowDuration);
+        ExactState state;
+        if(ExactState* exact = shard.heavyHitters.find(keyHash, userId)){
+            state = *exact;
+            if(state.windowIndex != shard.windowIndex){ // Promoted key idle since the previous window
+                state.previousCount = state.currentCount;
+                state.currentCount = 0;
+            }
+        }else{
+            Columns column;
+            columns(keyHash, column);
+            state = estimate(shard, column);
+        }
+        return {state.currentCount, state.previousCount};
+    }
+    bool allowRequest(string_view userId) override { DecisionTimer timer(type()); return decide(userId, nowNanos<ClockType>(), 1); }
+    bool allowRequest(KeyHandle& handle) override { DecisionTimer timer(type()); return decide(handle, nowNanos<ClockType>(), 1); }
+    DecisionBitmap allowRequests(span<const string> userIds, span<const int> costs = {}) override {
+        long long now = nowNanos<ClockType>(); // One clock read for the whole batch
+        DecisionBitmap decisions(userIds.size());
+        for(size_t i = 0; i < userIds.size(); i++){
+            string_view userId = userIds[i];
+            if(decide(userId, now, costs.empty() ? 1 : costs[i])) decisions.set(i);
+        }
+        return decisions;
+    }
+    // Retry-after from the estimate the denial was judged by, so it may come early for a key
+    // whose counters others keep raising
+    AcquireResult acquire(string_view userId, int cost = 1) override {
+        DecisionTimer timer(type());
+        long long now = nowNanos<ClockType>();
+        uint64_t keyHash = hashUserId(userId);
+        Shard& shard = shardFor(keyHash);
+        CountedLock<mutex> lock(shard.mtx, shard.lockCounters);
+        ExactState seen;
+        if(consume(shard, keyHash, userId, now, cost, seen)) return AcquireResult::granted();
+        return SlidingWindowCounterPolicy::denial(seen, now, cost, config);
+    }
+    // One record per shard (under an empty user id, keyed by shard index): depth, width,
+    // nanoseconds since the current window started, then the current and previous sketches.
+    // A promoted key's counters are raised to its exact counts (they already hold what it used
+    // before promotion, so adding would count that twice).
+    void writeStates(SnapshotWriter& writer) override {
+        long long now = nowNanos<ClockType>();
+        string record;
+        vector<uint32_t> counters(2 * sketchSize());
+        for(size_t i = 0; i <= shardMask; i++){
+            Shard& shard = shards[i];
+            lock_guard<mutex> lock(shard.mtx);
+            roll(shard, now / windowDuration);
+            copy_n(row(shard, shard.current, 0), sketchSize(), counters.begin());
+            copy_n(row(shard, shard.current ^ 1, 0), sketchSize(), counters.begin() + sketchSize());
+            shard.heavyHitters.forEach([&](uint64_t keyHash, string_view, ExactState& state) {
+                ExactState rolled = state;
+                SlidingWindowCounterPolicy::consume(rolled, false, now, 0, config); // Brings its counts to this window
+                Columns column;
+                columns(keyHash, column);
+                for(int r = 0; r < sketch.depth; r++){
+                    uint32_t& current = counters[r * width + column[r]];
+                    uint32_t& previous = counters[sketchSize() + r * width + column[r]];
+                    current = max<uint32_t>(current, rolled.currentCount);
+                    previous = max<uint32_t>(previous, rolled.previousCount);
+                }
+            });
+            record.clear();
+            appendField<int32_t>(record, sketch.depth);
+            appendField<int64_t>(record, width);
+            appendField<int64_t>(record, now - shard.windowIndex * windowDuration);
+            record.append((const char*)counters.data(), counters.size() * sizeof(uint32_t));
+            writer.add(i, "", record);
+        }
+    }
+    // Adds the snapshot's counts to this limiter's, so loading several snapshots merges them.
+    // Read all at once: the sketch is not per key. Needs the same shard count, depth and width;
+    // counts are kept as they are under new limits.
+    bool readStates(shared_ptr<Snapshot> snapshot) override {
+        if(snapshot->recordCount() != shardMask + 1) return false;
+        long long now = nowNanos<ClockType>();
+        long long origin = now - max(0ll, wallClockNanos() - snapshot->wallClockNanos());
+        size_t recordBytes = sizeof(int32_t) + 2 * sizeof(int64_t) + 2 * sketchSize() * sizeof(uint32_t);
+        vector<string_view> records;
+        for(size_t i = 0; i <= shardMask; i++){
+            optional<string_view> record = snapshot->find(i, "");
+            if(!record || record->size() != recordBytes) return false;
+            string_view fields = *record;
+            if(takeField<int32_t>(fields) != sketch.depth || takeField<int64_t>(fields) != (long long)width) return false;
+            records.push_back(fields);
+        }
+        for(size_t i = 0; i <= shardMask; i++){
+            string_view fields = records[i];
+            // Nearest window start: origin is only as exact as the wall clock
+            long long savedWindow = (origin - takeField<int64_t>(fields) + windowDuration / 2) / windowDuration;
+            Shard& shard = shards[i];
+            lock_guard<mutex> lock(shard.mtx);
+            roll(shard, now / windowDuration);
+            for(int saved = 0; saved < 2; saved++){ // The saved current sketch, then the saved previous one
+                long long windowIndex = savedWindow - saved;
+                if(windowIndex != shard.windowIndex && windowIndex != shard.windowIndex - 1) continue; // No longer counts
+                int which = windowIndex == shard.windowIndex ? shard.current : shard.current ^ 1;
+                string_view counts = fields.substr(saved * sketchSize() * sizeof(uint32_t));
+                uint32_t* counters = row(shard, which, 0);
+                for(size_t c = 0; c < sketchSize(); c++){
+                    uint32_t count = takeField<uint32_t>(counts);
+                    counters[c] += min<uint32_t>(count, UINT32_MAX - counters[c]);
+                    if(c < width) shard.windowTotals[which] += count; // Every row counts every request once
+                }
+            }
+        }
+        return true;
+    }
+};
+
+// A limiter put together at compile time, for code that knows its algorithm when it is built:
+// Algorithm is one of the policies above, ClockType a final Clock (read directly, not through
+// the vtable), Mutex the shard lock (NullMutex when one thread owns the limiter) and Storage the
+// per-user state store. Nothing is virtual, so a decision inlines into its caller.
+template<typename Algorithm, typename ClockType = MonotonicClock, typename Mutex = mutex,
+         template<typename, typename, typename> typename Storage = ShardedStore>
+class PolicyRateLimiter {
+    static_assert(is_final_v<ClockType>, "ClockType must be a final Clock so its reads are not virtual");
+    using State = typename Algorithm::State;
+    RateLimiterConfiguration config;
+    shared_ptr<ClockType> clock;
+    Storage<State, Mutex, monostate> userStates;
+
+    template<typename Key>
+    bool decide(Key& key, int cost) {
+        long long now = clock->nowNanos();
+        return userStates.withState(key, now, [&](State& state, bool isNewUser) {
+            return Algorithm::consume(state, isNewUser, now, cost, config);
+        });
+    }
+public:
+    PolicyRateLimiter(RateLimiterConfiguration config, shared_ptr<ClockType> clock = make_shared<ClockType>()) : config(config), clock(std::move(clock)), userStates(config.shardCount) {
+        userStates.setIdleTimeout(Algorithm::idleTimeoutSeconds(config), this->clock->nowNanos());
+    }
+    static constexpr RateLimiterType type() { return Algorithm::type; }
+    const RateLimiterConfiguration& configuration() const { return config; }
+    KeyStats keyStats() const { return {userStates.liveKeyCount(), userStates.evictedKeyCount()}; }
+    bool allowRequest(string_view userId, int cost = 1) { return decide(userId, cost); }
+    bool allowRequest(KeyHandle& handle, int cost = 1) { return decide(handle, cost); }
+    DecisionBitmap allowRequests(span<const string> userIds, span<const int> costs = {}) {
+        long long now = clock->nowNanos(); // One clock read for the whole batch
+        DecisionBitmap decisions(userIds.size());
+        userStates.withStates(userIds, now, [&](size_t i, State& state, bool isNewUser) {
+            if(Algorithm::consume(state, isNewUser, now, costs.empty() ? 1 : costs[i], config)) decisions.set(i);
+        });
+        return decisions;
+    }
+};
+
+// What a composite limit is counted against
+enum class LimitScope {
+    User,
+    Tier, // All users of the request's tier together
+    Endpoint,
+    Global
+};
+constexpr int kLimitScopeCount = (int)LimitScope::Global + 1;
+
+// One level of a CompositeRateLimiter: at most config.maxRequests per config.timeWindowSeconds
+// for each key of `scope`, optionally only for requests from one tier
+struct LimitRule {
+    LimitScope scope;
+    RateLimiterConfiguration config;
+    optional<UserTier> tier;
+};
+
+struct RequestContext {
+    string_view userId;
+    UserTier tier;
+    string_view endpoint;
+};
+
+// Several levels of limits (per user, per tier, per endpoint, global) decided as one: a request is
+// allowed only if every rule that applies to it has room, and then it is charged to all of them;
+// a denial charges none. Each rule is a GCRA, and the rules of one scope share that scope key's
+// state, so a decision locks at most one shard per scope, all at once, and checks before it commits.
+// The Global key (and a busy Tier key) is one shard lock that every request takes.
+class CompositeRateLimiter {
+public:
+    static constexpr int kMaxRules = 8;
+private:
+    using State = array<long long, kMaxRules>; // Per-rule TAT (clock ns) for one scope key
+    vector<LimitRule> rules;
+    vector<long long> emissionIntervals;
+    vector<long long> windowDurations;
+    shared_ptr<Clock> clock;
+    ShardedStore<State> states;
+    unique_ptr<atomic<uint64_t>[]> denials; // Per rule: requests it was the first to deny
+
+    // Scope keys get a one-byte prefix so e.g. a user and an endpoint of the same name stay apart
+    static void scopeKey(string& out, LimitScope scope, const RequestContext& request) {
+        out.assign(1, (char)('0' + (int)scope));
+        switch(scope){
+            case LimitScope::User: out += request.userId; break;
+            case LimitScope::Tier: out += (char)('0' + (int)request.tier); break;
+            case LimitScope::Endpoint: out += request.endpoint; break;
+            case LimitScope::Global: break;
+        }
+    }
+public:
+    CompositeRateLimiter(vector<LimitRule> limitRules, shared_ptr<Clock> clock = nullptr, int shardCount = 16)
+        : rules(std::move(limitRules)), clock(clock ? clock : Clock::monotonic()), states(shardCount) {
+        if(rules.empty() || rules.size() > (size_t)kMaxRules) throw std::invalid_argument("CompositeRateLimiter needs 1 to 8 rules");
+        int longestWindow = 0;
+        for(const LimitRule& rule : rules){
+            long long windowDuration = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(rule.config.timeWindowSeconds)).count();
+            windowDurations.push_back(windowDuration);
+            emissionIntervals.push_back(windowDuration / rule.config.maxRequests);
+            longestWindow = max(longestWindow, rule.config.timeWindowSeconds);
+        }
+        denials = make_unique<atomic<uint64_t>[]>(rules.size());
+        states.setIdleTimeout(longestWindow, this->clock->nowNanos()); // Every TAT in the past by then
+    }
+    bool allowRequest(const RequestContext& request, int cost = 1) {
+        long long now = clock->nowNanos();
+        static thread_local array<string, kLimitScopeCount> keyBuffers;
+        array<string_view, kLimitScopeCount> keys;
+        array<int, kLimitScopeCount> keyOfScope;
+        keyOfScope.fill(-1);
+        array<int, kMaxRules> keyOfRule; // Index into keys, -1 if the rule does not apply
+        size_t keyCount = 0;
+        for(size_t r = 0; r < rules.size(); r++){
+            keyOfRule[r] = -1;
+            if(rules[r].tier && *rules[r].tier != request.tier) continue;
+            int scope = (int)rules[r].scope;
+            if(keyOfScope[scope] < 0){
+                scopeKey(keyBuffers[scope], rules[r].scope, request);
+                keyOfScope[scope] = keyCount;
+                keys[keyCount++] = keyBuffers[scope];
+            }
+            keyOfRule[r] = keyOfScope[scope];
+        }
+        if(keyCount == 0) return true;
+        return states.withStatesLocked(span<const string_view>(keys.data(), keyCount), now, [&](span<State* const> scopeStates, span<const bool> isNew) {
+            for(size_t k = 0; k < keyCount; k++) if(isNew[k]) scopeStates[k]->fill(0);
+            // Check every rule before charging any
+            for(size_t r = 0; r < rules.size(); r++){
+                if(keyOfRule[r] < 0) continue;
+                long long theoreticalArrivalTime = (*scopeStates[keyOfRule[r]])[r];
+                if(max(theoreticalArrivalTime, now) + cost * emissionIntervals[r] - now > windowDurations[r]){
+                    denials[r].fetch_add(1, memory_order_relaxed);
+                    return false;
+                }
+            }
+            for(size_t r = 0; r < rules.size(); r++){
+                if(keyOfRule[r] < 0) continue;
+                long long& theoreticalArrivalTime = (*scopeStates[keyOfRule[r]])[r];
+                theoreticalArrivalTime = max(theoreticalArrivalTime, now) + cost * emissionIntervals[r];
+            }
+            return true;
+        });
+    }
+    const vector<LimitRule>& limitRules() const { return rules; }
+    // How many requests rules[i] denied (the first failing rule in order is counted)
+    uint64_t deniedBy(size_t rule) const { return denials[rule].load(memory_order_relaxed); }
+    KeyStats keyStats() const { return {states.liveKeyCount(), states.evictedKeyCount()}; }
+};
+
+// Factory to create rate limiters based on user tier
+class RateLimiterFactory {
+    template<typename ClockType>
+    static RateLimiter* create(RateLimiterType type, RateLimiterConfiguration config, shared_ptr<ClockType> clock) {
+        switch (type) {
+            case RateLimiterType::TokenBucket:
+                return new TokenBucketRateLimiter<ClockType>(config, clock);
+            case RateLimiterType::FixedWindow:
+                return new FixedWindowRateLimiter<ClockType>(config, clock);
+            case RateLimiterType::SlidingWindow:
+                return new SlidingWindowRateLimiter<ClockType>(config, clock);
+            case RateLimiterType::SlidingWindowCounter:
+                return new SlidingWindowCounterRateLimiter<ClockType>(config, clock);
+            case RateLimiterType::LockFreeTokenBucket:
+                return new LockFreeTokenBucketRateLimiter<ClockType>(config, clock);
+            case RateLimiterType::GCRA:
+                return new GCRARateLimiter<ClockType>(config, clock);
+            case RateLimiterType::SharedMemoryTokenBucket:
+                // Every process creating a limiter with this configuration shares one segment;
+                // construct it directly to pick the segment name and capacity
+                return new SharedMemoryTokenBucketRateLimiter<ClockType>(SharedMemoryTokenBucketRateLimiter<>::defaultSegmentName(config), 1 << 18, config, clock);
+            case RateLimiterType::CountMinSketch:
+                return new CountMinSketchRateLimiter<ClockType>(config, clock);
+            default:
+                return nullptr;
+        }
+    }
+public:
+    static RateLimiter* createRateLimiter(UserTier tier, RateLimiterConfiguration config, shared_ptr<Clock> clock = nullptr) {
+        switch (tier) {
+            case UserTier::Free:
+                return createRateLimiter(RateLimiterType::FixedWindow, config, clock);
+            case UserTier::Premium:
+                return createRateLimiter(RateLimiterType::TokenBucket, config, clock);
+            case UserTier::Enterprise:
+                return createRateLimiter(RateLimiterType::SlidingWindow, config, clock);
+            default:
+                return nullptr;
+        }
+    }
+    // Built for the clock's final type, so the limiter reads it directly
+    static RateLimiter* createRateLimiter(RateLimiterType type, RateLimiterConfiguration config, shared_ptr<Clock> clock = nullptr) {
+        if(!clock) clock = Clock::monotonic();
+        if(auto monotonic = dynamic_pointer_cast<MonotonicClock>(clock)) return create(type, config, monotonic);
+        if(auto coarse = dynamic_pointer_cast<CoarseClock>(clock)) return create(type, config, coarse);
+        if(auto manual = dynamic_pointer_cast<ManualClock>(clock)) return create(type, config, manual);
+        return create(type, config, clock);
+    }
+};
+
+// Waits out denials instead of polling. A caller over its limit is parked until the limiter has
+// room for it: each user's waiters queue in arrival order, and only the first one is retried, at
+// the retry-after its last acquire reported; once it is let through the next one is tried right
+// away. One thread drives a millisecond TimerWheel for the retries and deadlines. A waiter with a
+// deadline gets false as soon as a retry-after says it cannot make it, or when the deadline passes.
+class AcquireScheduler {
+    struct Waiter {
+        string userId;
+        int cost;
+        long long deadline; // Clock ns; LLONG_MAX waits as long as it takes
+        function<void(bool)> wake;
+        bool finished = false;
+    };
+    struct WaitTimer {
+        string userId;
+        shared_ptr<Waiter> expiring; // Waiter whose deadline this is; null to retry userId's queue
+        long long deadline; // Tick (ms)
+    };
+    struct WaitQueue {
+        deque<shared_ptr<Waiter>> waiters;
+        long long retryTick = -1; // Tick of the armed retry; retry timers for other ticks are stale
+    };
+    RateLimiter& limiter;
+    shared_ptr<Clock> clock;
+    mutex mtx;
+    condition_variable wakeup;
+    TimerWheel<WaitTimer> timers;
+    size_t pendingTimers = 0;
+    unordered_map<string, WaitQueue> queues;
+    bool stopping = false;
+    thread driver;
+
+    // Rounded up, so a timer never fires before its time
+    static long long tickAt(long long nanos) { return nanos / 1000000 + (nanos % 1000000 != 0); }
+    void arm(WaitTimer timer) {
+        if(pendingTimers++ == 0) timers = TimerWheel<WaitTimer>(clock->nowNanos() / 1000000); // Skip the idle gap
+        timers.schedule(std::move(timer));
+        wakeup.notify_one();
+    }
+    // Decides the queue's waiters from the front until one has to wait; woken collects the outcomes
+    void serve(const string& userId, long long now, vector<pair<shared_ptr<Waiter>, bool>>& woken) {
+        auto it = queues.find(userId);
+        if(it == queues.end()) return;
+        WaitQueue& queue = it->second;
+        queue.retryTick = -1;
+        while(!queue.waiters.empty()){
+            shared_ptr<Waiter> waiter = queue.waiters.front();
+            if(!waiter->finished){
+                AcquireResult result = limiter.acquire(waiter->userId, waiter->cost);
+                if(!result.acquired && result.retryAfter.count() < waiter->deadline - now){
+                    queue.retryTick = tickAt(now + result.retryAfter.count());
+                    arm({userId, nullptr, queue.retryTick});
+                    return;
+                }
+                waiter->finished = true;
+                woken.push_back({waiter, result.acquired});
+            }
+            queue.waiters.pop_front();
+        }
+        queues.erase(it);
+    }
+    void run() {
+        unique_lock<mutex> lock(mtx);
+        while(true){
+            if(pendingTimers == 0) wakeup.wait(lock, [&]() { return stopping || pendingTimers > 0; });
+            else wakeup.wait_for(lock, chrono::milliseconds(1));
+            if(stopping) break;
+            long long now = clock->nowNanos();
+            timers.advance(now / 1000000, INT_MAX);
+            vector<pair<shared_ptr<Waiter>, bool>> woken;
+            WaitTimer timer;
+            while(timers.popDue(timer)){
+                pendingTimers--;
+                if(!timer.expiring){
+                    auto it = queues.find(timer.userId);
+                    if(it != queues.end() && it->second.retryTick == timer.deadline) serve(timer.userId, now, woken);
+                }else if(!timer.expiring->finished){
+                    if(now < timer.expiring->deadline){ // The wheel's outer level wrapped around
+                        timer.deadline = tickAt(timer.expiring->deadline);
+                        arm(std::move(timer));
+                        continue;
+                    }
+                    timer.expiring->finished = true;
+                    woken.push_back({timer.expiring, false});
+                    // Waiters behind a timed-out first waiter are due for a try of their own
+                    auto it = queues.find(timer.userId);
+                    if(it != queues.end() && it->second.waiters.front() == timer.expiring) serve(timer.userId, now, woken);
+                }
+            }
+            if(woken.empty()) continue;
+            lock.unlock(); // A woken caller may come straight back to the scheduler
+            for(auto& [waiter, acquired] : woken) waiter->wake(acquired);
+            lock.lock();
+        }
+        // Shutting down: nobody is left waiting forever
+        vector<shared_ptr<Waiter>> remaining;
+        for(auto& [userId, queue] : queues){
+            for(auto& waiter : queue.waiters) if(!waiter->finished) remaining.push_back(waiter);
+        }
+        queues.clear();
+        lock.unlock();
+        for(auto& waiter : remaining) waiter->wake(false);
+    }
+    // Decided on the spot when nobody is queued ahead and the answer is final; otherwise parked,
+    // and wake is called (from the scheduler thread) once it is decided
+    optional<bool> enqueue(string_view userId, int cost, optional<chrono::nanoseconds> timeout, function<void(bool)> wake) {
+        lock_guard<mutex> lock(mtx);
+        long long now = clock->nowNanos();
+        long long deadline = timeout ? now + timeout->count() : LLONG_MAX;
+        auto waiter = make_shared<Waiter>(Waiter{string(userId), cost, deadline, std::move(wake)});
+        auto [it, inserted] = queues.try_emplace(waiter->userId);
+        if(inserted){
+            AcquireResult result = limiter.acquire(userId, cost);
+            if(result.acquired || result.retryAfter.count() >= deadline - now){
+                queues.erase(it);
+                return result.acquired;
+            }
+            it->second.retryTick = tickAt(now + result.retryAfter.count());
+            arm({waiter->userId, nullptr, it->second.retryTick});
+        }
+        it->second.waiters.push_back(waiter);
+        if(timeout) arm({waiter->userId, waiter, tickAt(deadline)});
+        return nullopt;
+    }
+public:
+    // clock must be the one the limiter decides with
+    AcquireScheduler(RateLimiter& limiter, shared_ptr<Clock> clock = nullptr) : limiter(limiter), clock(clock ? clock : Clock::monotonic()) {
+        driver = thread([this]() { run(); });
+    }
+    // Waiters still parked get false
+    ~AcquireScheduler() {
+        {
+            lock_guard<mutex> lock(mtx);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        driver.join();
+    }
+    // Resolves to true once acquired, false if the timeout ran out first
+    future<bool> acquireAsync(string_view userId, int cost = 1, optional<chrono::nanoseconds> timeout = nullopt) {
+        auto promise = make_shared<std::promise<bool>>();
+        future<bool> result = promise->get_future();
+        optional<bool> decided = enqueue(userId, cost, timeout, [promise](bool acquired) { promise->set_value(acquired); });
+        if(decided) promise->set_value(*decided);
+        return result;
+    }
+    // `co_await scheduler.acquire(userId)`: same outcome as acquireAsync. A coroutine that had
+    // to wait is resumed on the scheduler's thread.
+    struct Awaitable {
+        AcquireScheduler& scheduler;
+        string userId;
+        int cost;
+        optional<chrono::nanoseconds> timeout;
+        bool acquired = false;
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(coroutine_handle<> handle) {
+            optional<bool> decided = scheduler.enqueue(userId, cost, timeout, [this, handle](bool result) {
+                acquired = result;
+                handle.resume();
+            });
+            if(!decided) return true; // Parked: the coroutine may already be running again, leave `this` alone
+            acquired = *decided;
+            return false;
+        }
+        bool await_resume() const noexcept { return acquired; }
+    };
+    Awaitable acquire(string_view userId, int cost = 1, optional<chrono::nanoseconds> timeout = nullopt) {
+        return Awaitable{*this, string(userId), cost, timeout};
+    }
+};
+
+// Totals of allowed/denied decisions, indexed [tier or type][allowed ? 1 : 0]
+struct DecisionTotals {
+    array<array<uint64_t, 2>, kUserTierCount> byTier{};
+    array<array<uint64_t, 2>, kRateLimiterTypeCount> byType{};
+};
+
+// A decision picked by sampling, handed to the service's event hook
+struct DecisionEvent {
+    string_view userId;
+    UserTier tier;
+    RateLimiterType type;
+    bool allowed;
+};
+
+// Allowed/denied counters per tier and per limiter type. Every thread counts into its own
+// cache-line-aligned block, so recording a decision is a relaxed load/store pair on a line no
+// other thread writes; blocks are only summed when the totals are read.
+class DecisionCounters {
+    struct alignas(64) Block {
+        array<array<atomic<uint64_t>, 2>, kUserTierCount> byTier{};
+        array<array<atomic<uint64_t>, 2>, kRateLimiterTypeCount> byType{};
+    };
+    static inline atomic<size_t> nextId{0};
+    size_t id = nextId++; // Index of this instance's block in each thread's cache
+    mutable mutex registryMutex; // Only taken on a thread's first decision and when reading totals
+    vector<unique_ptr<Block>> blocks; // Kept after their thread exits so totals never go down
+
+    Block& localBlock() {
+        static thread_local vector<Block*> threadBlocks; // Indexed by instance id
+        if(id >= threadBlocks.size()) threadBlocks.resize(id + 1, nullptr);
+        if(threadBlocks[id] == nullptr){
+            lock_guard<mutex> lock(registryMutex);
+            blocks.push_back(make_unique<Block>());
+            threadBlocks[id] = blocks.back().get();
+        }
+        return *threadBlocks[id];
+    }
+    static void add(atomic<uint64_t>& counter, uint64_t amount) {
+        counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed); // Single writer
+    }
+public:
+    void record(UserTier tier, RateLimiterType type, uint64_t allowed, uint64_t denied) {
+        Block& block = localBlock();
+        add(block.byTier[(int)tier][1], allowed);
+        add(block.byTier[(int)tier][0], denied);
+        add(block.byType[(int)type][1], allowed);
+        add(block.byType[(int)type][0], denied);
+    }
+    // Decisions not made by a single limiter type (e.g. composite limits) count per tier only
+    void record(UserTier tier, uint64_t allowed, uint64_t denied) {
+        Block& block = localBlock();
+        add(block.byTier[(int)tier][1], allowed);
+        add(block.byTier[(int)tier][0], denied);
+    }
+    DecisionTotals totals() const {
+        DecisionTotals totals;
+        lock_guard<mutex> lock(registryMutex);
+        for(const auto& block : blocks){
+            for(int t = 0; t < kUserTierCount; t++){
+                for(int a = 0; a < 2; a++) totals.byTier[t][a] += block->byTier[t][a].load(memory_order_relaxed);
+            }
+            for(int t = 0; t < kRateLimiterTypeCount; t++){
+                for(int a = 0; a < 2; a++) totals.byType[t][a] += block->byType[t][a].load(memory_order_relaxed);
+            }
+        }
+        return totals;
+    }
+};
+
+// Lets readers use data that a writer replaces, with no lock on the read side. A reader holds a
+// Guard while it uses what it loaded; the writer publishes the replacement, then synchronize()
+// returns once no reader can still be using the old one, which can then be freed. Each thread
+// counts itself into one of two epochs on its own reader record, registered on its first Guard
+// like DecisionCounters' blocks, so readers never write to a cache line another thread writes.
+class EpochDomain {
+    struct alignas(64) Reader {
+        atomic<long long> guards[2] = {0, 0}; // Written by the owning thread only
+    };
+    static inline atomic<size_t> nextId{0};
+    size_t id = nextId++; // Index of this domain's record in each thread's cache
+    atomic<uint32_t> epoch{0};
+    mutex registryMutex; // Only taken on a thread's first Guard and by synchronize()
+    vector<unique_ptr<Reader>> readers; // Kept after their thread exits, idle
+    mutex writerMutex;
+
+    Reader& localReader() {
+        static thread_local vector<Reader*> threadReaders; // Indexed by domain id
+        if(id >= threadReaders.size()) threadReaders.resize(id + 1, nullptr);
+        if(threadReaders[id] == nullptr){
+            lock_guard<mutex> lock(registryMutex);
+            readers.push_back(make_unique<Reader>());
+            threadReaders[id] = readers.back().get();
+        }
+        return *threadReaders[id];
+    }
+    static void add(atomic<long long>& guards, long long amount, memory_order order) {
+        guards.store(guards.load(memory_order_relaxed) + amount, order); // Single writer
+    }
+public:
+    class Guard {
+        atomic<long long>* guards;
+    public:
+        Guard(EpochDomain& domain) {
+            Reader& reader = domain.localReader();
+            while(true){
+                uint32_t parity = domain.epoch.load(memory_order_relaxed) & 1;
+                guards = &reader.guards[parity];
+                // seq_cst store, then seq_cst load: either this sees the writer's flip, or the
+                // writer, which flips and then reads the records, sees this count
+                add(*guards, 1, memory_order_seq_cst);
+                if((domain.epoch.load(memory_order_seq_cst) & 1) == parity) return;
+                add(*guards, -1, memory_order_release);
+            }
+        }
+        ~Guard() { add(*guards, -1, memory_order_release); }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+    // Waits for every reader that started before the call
+    void synchronize() {
+        lock_guard<mutex> lock(writerMutex);
+        uint32_t parity = epoch.fetch_add(1, memory_order_seq_cst) & 1;
+        // Threads registering from here on see the new epoch, so only the records so far count
+        vector<Reader*> current;
+        {
+            lock_guard<mutex> registryLock(registryMutex);
+            for(auto& reader : readers) current.push_back(reader.get());
+        }
+        for(Reader* reader : current){
+            while(reader->guards[parity].load(memory_order_seq_cst) != 0) this_thread::yield();
+        }
+    }
+};
+
+// How an AdaptiveConcurrencyLimiter moves its limit once per window
+enum class ConcurrencyAlgorithm {
+    Aimd,    // +1 after a window that used the limit within latencyTarget, x backoff after one that did not
+    Gradient // Scaled by baseline / recent latency (with tolerance), plus sqrt(limit) of headroom to probe
+};
+
+struct AdaptiveConcurrencyConfiguration {
+    ConcurrencyAlgorithm algorithm = ConcurrencyAlgorithm::Gradient;
+    int initialLimit = 20;
+    int minLimit = 1;
+    int maxLimit = 1000;
+    chrono::nanoseconds window = chrono::milliseconds(100);
+    int minWindowSamples = 10; // A window with fewer completions (and no drop) is extended
+    double backoff = 0.9; // Applied on overload, and always after a window with a dropped request
+    chrono::nanoseconds latencyTarget = chrono::milliseconds(50); // Aimd: mean latency above this is overload
+    double tolerance = 1.5; // Gradient: latency may reach this multiple of the baseline before the limit shrinks
+    int baselineWindows = 20; // Gradient: how slowly the baseline follows latency up
+    double smoothing = 0.2; // Gradient: weight of each window's new estimate
+    // Fraction of the limit each tier may fill, indexed by UserTier. Every tier gets at least one
+    // request in flight; when the limit shrinks the lower tiers are shed first.
+    array<double, kUserTierCount> tierShares = {0.8, 0.9, 1.0};
+};
+
+struct ConcurrencyStats {
+    int limit;
+    int inFlight;
+    uint64_t admitted;
+    uint64_t rejected;
+    uint64_t dropped;
+    long long baselineLatencyNanos; // Gradient only
+    long long recentLatencyNanos; // Mean of the last closed window
+};
+
+// Caps the requests in flight to a downstream and learns the cap from the latencies callers
+// report as their requests complete: it shrinks while the downstream slows down (or drops
+// requests) and grows back once it recovers, instead of a fixed rate that sheds too little in a
+// brownout and too much when healthy. Nothing here takes a lock. In-flight is one atomic counter
+// bumped by compare-and-swap against the limit; completions add into the window's atomic sums,
+// and whichever completion finds the window over closes it and moves the limit, while the others
+// carry on rather than wait for it.
+class AdaptiveConcurrencyLimiter : public enable_shared_from_this<AdaptiveConcurrencyLimiter> {
+    AdaptiveConcurrencyConfiguration config;
+    shared_ptr<Clock> clock;
+    alignas(64) atomic<int> inFlight{0};
+    atomic<double> limit;
+    alignas(64) atomic<uint64_t> windowSamples{0};
+    atomic<uint64_t> windowLatencyNanos{0};
+    atomic<uint64_t> windowDrops{0};
+    atomic<int> windowPeakInFlight{0};
+    atomic<long long> windowEnd;
+    atomic<bool> adjusting{false}; // Held by the completion closing the window
+    double baseline = 0; // Only touched while adjusting
+    alignas(64) atomic<uint64_t> admitted{0}, rejected{0}, dropped{0};
+    atomic<long long> baselineNanos{0}, recentNanos{0};
+    atomic<function<void()>*> slotFreedHook{nullptr}; // Read under a hookEpoch guard
+    EpochDomain hookEpoch;
+
+    // Closes the window: called with adjusting held
+    void adjust() {
+        uint64_t samples = windowSamples.exchange(0, memory_order_relaxed);
+        uint64_t latencyNanos = windowLatencyNanos.exchange(0, memory_order_relaxed);
+        uint64_t drops = windowDrops.exchange(0, memory_order_relaxed);
+        int peak = windowPeakInFlight.exchange(inFlight.load(memory_order_relaxed), memory_order_relaxed);
+        double current = limit.load(memory_order_relaxed), next = current;
+        double recent = samples ? (double)latencyNanos / samples : 0;
+        bool saturated = 2 * peak >= current; // A window that left most of the limit unused says nothing about more
+        if(config.algorithm == ConcurrencyAlgorithm::Aimd){
+            if(drops > 0 || recent > config.latencyTarget.count()) next = current * config.backoff;
+            else if(saturated) next = current + 1;
+        }else{
+            if(samples > 0){
+                // The no-load latency: follows latency down at once but up only slowly, so queueing
+                // reads as overload while a downstream that became slower for good is eventually the norm
+                baseline = baseline == 0 || recent < baseline ? recent : baseline + (recent - baseline) / config.baselineWindows;
+                double gradient = clamp(config.tolerance * baseline / recent, 0.5, 1.0);
+                double estimate = current * gradient + sqrt(current);
+                if(!saturated) estimate = min(estimate, current);
+                next = current * (1 - config.smoothing) + estimate * config.smoothing;
+            }
+            if(drops > 0) next = min(next, current * config.backoff);
+        }
+        limit.store(clamp(next, (double)config.minLimit, (double)config.maxLimit), memory_order_relaxed);
+        baselineNanos.store((long long)baseline, memory_order_relaxed);
+        if(samples > 0) recentNanos.store((long long)recent, memory_order_relaxed);
+    }
+    void finish(long long latencyNanos, bool drop, bool sample) {
+        inFlight.fetch_sub(1, memory_order_seq_cst); // A scheduler about to sleep sees the slot, or its hook sees it sleeping
+        if(slotFreedHook.load(memory_order_relaxed)){
+            EpochDomain::Guard guard(hookEpoch);
+            if(function<void()>* hook = slotFreedHook.load(memory_order_seq_cst)) (*hook)();
+        }
+        if(!sample) return;
+        if(drop){
+            dropped.fetch_add(1, memory_order_relaxed);
+            windowDrops.fetch_add(1, memory_order_relaxed);
+        }else{
+            windowLatencyNanos.fetch_add(max(latencyNanos, 0LL), memory_order_relaxed);
+            windowSamples.fetch_add(1, memory_order_relaxed);
+        }
+        long long now = clock->nowNanos();
+        if(now < windowEnd.load(memory_order_relaxed) || adjusting.exchange(true, memory_order_acquire)) return;
+        if(now >= windowEnd.load(memory_order_relaxed)
+           && (windowSamples.load(memory_order_relaxed) >= (uint64_t)config.minWindowSamples || windowDrops.load(memory_order_relaxed) > 0)){
+            adjust();
+            windowEnd.store(now + config.window.count(), memory_order_relaxed);
+        }
+        adjusting.store(false, memory_order_release);
+    }
+public:
+    // One admitted request, holding its slot until it is reported (or the permit goes away)
+    // A limiter owned by a shared_ptr stays alive until its last permit is done, so it can be
+    // replaced while requests are in flight.
+    class Permit {
+        AdaptiveConcurrencyLimiter* limiter;
+        shared_ptr<AdaptiveConcurrencyLimiter> owner; // Empty for a limiter not owned by a shared_ptr
+        long long startNanos;
+        void finish(long long latencyNanos, bool drop, bool sample) {
+            if(limiter == nullptr) return;
+            exchange(limiter, nullptr)->finish(latencyNanos, drop, sample);
+            owner.reset();
+        }
+    public:
+        Permit(AdaptiveConcurrencyLimiter* limiter, long long startNanos)
+            : limiter(limiter), owner(limiter->weak_from_this().lock()), startNanos(startNanos) {}
+        Permit(Permit&& other) noexcept
+            : limiter(exchange(other.limiter, nullptr)), owner(std::move(other.owner)), startNanos(other.startNanos) {}
+        Permit& operator=(Permit&& other) noexcept {
+            if(this != &other){
+                release();
+                limiter = exchange(other.limiter, nullptr);
+                owner = std::move(other.owner);
+                startNanos = other.startNanos;
+            }
+            return *this;
+        }
+        ~Permit() { release(); }
+        // The request got its answer after `latency`, as measured by the caller
+        void complete(chrono::nanoseconds latency) { finish(latency.count(), false, true); }
+        // ... or after the time since the permit was acquired, on the limiter's clock
+        void complete() {
+            if(limiter) finish(limiter->clock->nowNanos() - startNanos, false, true);
+        }
+        // The downstream was overloaded (timed out, shed the request): the limit backs off
+        void dropped() { finish(0, true, true); }
+        // Frees the slot without a sample, e.g. for a request that was never sent; the destructor does this too
+        void release() { finish(0, false, false); }
+    };
+
+    AdaptiveConcurrencyLimiter(AdaptiveConcurrencyConfiguration configuration = {}, shared_ptr<Clock> clock = nullptr)
+        : config(configuration), clock(clock ? clock : Clock::monotonic()) {
+        if(config.minLimit < 1 || config.maxLimit < config.minLimit) throw std::invalid_argument("Concurrency limits need 1 <= minLimit <= maxLimit");
+        limit.store(clamp(config.initialLimit, config.minLimit, config.maxLimit), memory_order_relaxed);
+        windowEnd.store(this->clock->nowNanos() + config.window.count(), memory_order_relaxed);
+    }
+    ~AdaptiveConcurrencyLimiter() { delete slotFreedHook.load(); }
+    // A slot if tier's share of the limit is not all in flight yet
+    optional<Permit> tryAcquire(UserTier tier = UserTier::Enterprise) {
+        int allowed = max(1, (int)(limit.load(memory_order_relaxed) * config.tierShares[(int)tier]));
+        int current = inFlight.load(memory_order_relaxed);
+        do{
+            if(current >= allowed){
+                rejected.fetch_add(1, memory_order_relaxed);
+                return nullopt;
+            }
+        }while(!inFlight.compare_exchange_weak(current, current + 1, memory_order_relaxed));
+        admitted.fetch_add(1, memory_order_relaxed);
+        int peak = windowPeakInFlight.load(memory_order_relaxed);
+        while(peak <= current && !windowPeakInFlight.compare_exchange_weak(peak, current + 1, memory_order_relaxed)) {}
+        return Permit(this, clock->nowNanos());
+    }
+    // Whether tryAcquire for the whole limit would find a slot right now
+    bool hasRoom() const { return inFlight.load(memory_order_seq_cst) < max(1, currentLimit()); }
+    // Calls hook on the releasing thread each time a slot is freed, e.g. to hand it to a queued
+    // request. Replacing or clearing it (nullptr) returns once no call of the old hook is running.
+    void onSlotFreed(function<void()> hook) {
+        function<void()>* previous = slotFreedHook.exchange(hook ? new function<void()>(std::move(hook)) : nullptr, memory_order_seq_cst);
+        hookEpoch.synchronize();
+        delete previous;
+    }
+    int currentLimit() const { return (int)limit.load(memory_order_relaxed); }
+    ConcurrencyStats stats() const {
+        return {currentLimit(), inFlight.load(memory_order_relaxed), admitted.load(memory_order_relaxed), rejected.load(memory_order_relaxed),
+                dropped.load(memory_order_relaxed), baselineNanos.load(memory_order_relaxed), recentNanos.load(memory_order_relaxed)};
+    }
+};
+
+// Unbounded multi-producer single-consumer queue (Vyukov's): a push is one exchange and one store
+// and never waits for anyone; only the one consumer may call front and pop. A push that has
+// swapped itself in as the tail but not linked itself yet hides itself (and later pushes) from
+// the consumer until it has.
+template<typename T>
+class MpscQueue {
+    struct Node {
+        atomic<Node*> next{nullptr};
+        T value;
+    };
+    alignas(64) atomic<Node*> tail;
+    alignas(64) Node* head; // Already consumed; head->next is the front
+public:
+    MpscQueue() : tail(new Node()), head(tail.load(memory_order_relaxed)) {}
+    ~MpscQueue() {
+        while(pop()) {}
+        delete head;
+    }
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+    void push(T value) {
+        Node* node = new Node();
+        node->value = std::move(value);
+        Node* previous = tail.exchange(node, memory_order_acq_rel);
+        previous->next.store(node, memory_order_release);
+    }
+    T* front() {
+        Node* next = head->next.load(memory_order_acquire);
+        return next ? &next->value : nullptr;
+    }
+    optional<T> pop() {
+        Node* next = head->next.load(memory_order_acquire);
+        if(next == nullptr) return nullopt;
+        optional<T> value(std::move(next->value));
+        delete head;
+        head = next;
+        return value;
+    }
+};
+
+struct AdmissionSchedulerConfiguration {
+    // Backlogged tiers get slots in proportion to their weights, indexed by UserTier
+    array<double, kUserTierCount> weights = {1, 4, 16};
+    // How long a request may wait for a slot before it is turned away
+    array<chrono::nanoseconds, kUserTierCount> queueBudgets = {chrono::milliseconds(1000), chrono::milliseconds(250), chrono::milliseconds(100)};
+};
+
+struct AdmissionTierStats {
+    uint64_t queued; // Waiting right now
+    uint64_t immediate; // Found a slot free and nobody queued
+    uint64_t dispatched; // Got a slot after waiting
+    uint64_t expired; // Waited out the tier's queue budget
+    LatencyHistogram waits; // Of the dispatched ones
+};
+
+// Queues requests the concurrency limit has no room for, one queue per tier, instead of turning
+// them away, and hands each freed slot to a queued request by weighted fair queueing (self-clocked:
+// a request reaching the front of its tier's queue is tagged max(tier's last tag, virtual time) +
+// 1 / weight, the smallest tag goes first and becomes the virtual time). Backlogged tiers thus share the slots in proportion to
+// their weights, and a tier that was idle starts from the current virtual time rather than with
+// credit saved up. Enterprise keeps a short wait in an overload and Free absorbs the queueing.
+// Requests are pushed onto their tier's lock-free MPSC queue by the calling threads. One
+// dispatcher thread drains the queues whenever a slot is freed, and turns away the requests whose
+// budget ran out. The scheduler hands out slots of the whole limit, so the limiter's tier shares
+// do not apply here. Only one scheduler may use a limiter, and it keeps the limiter alive.
+class AdmissionScheduler {
+public:
+    using Permit = AdaptiveConcurrencyLimiter::Permit;
+private:
+    struct Waiter {
+        long long enqueuedNanos;
+        function<void(optional<Permit>)> admitted;
+    };
+    struct TierQueue {
+        MpscQueue<Waiter> waiters;
+        alignas(64) atomic<uint64_t> enqueued{0};
+        atomic<uint64_t> immediate{0};
+        // Written by the dispatcher only
+        alignas(64) atomic<uint64_t> dispatched{0}, expired{0}, maxWaitNanos{0};
+        array<atomic<uint64_t>, LatencyHistogram::kBucketCount> waitBuckets{};
+        double lastTag = 0;
+        double frontTag = -1; // Fixed when the dispatcher first sees the front request; -1 until then
+    };
+    shared_ptr<AdaptiveConcurrencyLimiter> slots;
+    AdmissionSchedulerConfiguration config; // Dispatcher only, but changed under sleepMutex
+    optional<AdmissionSchedulerConfiguration> nextConfig; // Under sleepMutex, until the dispatcher takes it
+    shared_ptr<Clock> clock;
+    array<TierQueue, kUserTierCount> tiers;
+    alignas(64) atomic<long long> queued{0};
+    atomic<bool> dispatcherSleeping{false};
+    mutex sleepMutex; // Only for putting the dispatcher to sleep and waking it
+    condition_variable wakeup;
+    uint64_t wakeups = 0;
+    bool stopping = false;
+    double virtualTime = 0; // Dispatcher only
+    thread dispatcher;
+
+    static void bump(atomic<uint64_t>& counter, uint64_t amount = 1) {
+        counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed); // Single writer
+    }
+    // Every thread that makes work for the dispatcher (a push, a freed slot) calls this afterwards;
+    // the dispatcher announces it is going to sleep before it looks for work one last time, all of
+    // it seq_cst, so one of the two always sees the other
+    void wake() {
+        if(!dispatcherSleeping.load(memory_order_seq_cst)) return;
+        {
+            lock_guard<mutex> lock(sleepMutex);
+            wakeups++;
+        }
+        wakeup.notify_one();
+    }
+    // Turns away the requests past their budget, then fills the free slots in tag order. Returns
+    // when the next front request's budget runs out (LLONG_MAX if nothing is queued).
+    long long dispatch() {
+        long long now = clock->nowNanos();
+        long long nextDeadline = LLONG_MAX;
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            TierQueue& queue = tiers[tier];
+            long long budget = config.queueBudgets[tier].count();
+            while(Waiter* front = queue.waiters.front()){
+                if(now - front->enqueuedNanos <= budget) break;
+                optional<Waiter> waiter = queue.waiters.pop();
+                queue.frontTag = -1;
+                queued.fetch_sub(1, memory_order_relaxed);
+                bump(queue.expired);
+                waiter->admitted(nullopt);
+            }
+        }
+        while(queued.load(memory_order_acquire) > 0 && slots->hasRoom()){
+            int best = -1;
+            double bestTag = 0;
+            for(int tier = 0; tier < kUserTierCount; tier++){
+                TierQueue& queue = tiers[tier];
+                if(queue.waiters.front() == nullptr) continue;
+                if(queue.frontTag < 0) queue.frontTag = max(queue.lastTag, virtualTime) + 1 / config.weights[tier];
+                double tag = queue.frontTag;
+                if(best < 0 || tag < bestTag){
+                    best = tier;
+                    bestTag = tag;
+                }
+            }
+            if(best < 0) break; // Pushed but not linked yet; its wake() follows
+            optional<Permit> permit = slots->tryAcquire();
+            if(!permit) break;
+            TierQueue& queue = tiers[best];
+            optional<Waiter> waiter = queue.waiters.pop();
+            queued.fetch_sub(1, memory_order_relaxed);
+            queue.lastTag = virtualTime = bestTag;
+            queue.frontTag = -1;
+            uint64_t waited = max(now - waiter->enqueuedNanos, 0LL);
+            atomic<uint64_t>& bucket = queue.waitBuckets[LatencyHistogram::bucketOf(waited)];
+            bump(bucket);
+            if(waited > queue.maxWaitNanos.load(memory_order_relaxed)) queue.maxWaitNanos.store(waited, memory_order_relaxed);
+            bump(queue.dispatched);
+            waiter->admitted(std::move(permit));
+        }
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            if(Waiter* front = tiers[tier].waiters.front()) nextDeadline = min(nextDeadline, front->enqueuedNanos + config.queueBudgets[tier].count() + 1);
+        }
+        return nextDeadline;
+    }
+    void run() {
+        while(true){
+            long long nextDeadline = dispatch();
+            unique_lock<mutex> lock(sleepMutex);
+            if(stopping) return;
+            if(nextConfig){
+                config = *exchange(nextConfig, nullopt);
+                continue;
+            }
+            dispatcherSleeping.store(true, memory_order_seq_cst);
+            uint64_t seen = wakeups;
+            bool runnable = queued.load(memory_order_seq_cst) > 0 && slots->hasRoom();
+            if(!runnable){
+                auto woken = [&]() { return stopping || wakeups != seen; };
+                if(nextDeadline == LLONG_MAX) wakeup.wait(lock, woken);
+                else wakeup.wait_for(lock, chrono::nanoseconds(max(nextDeadline - clock->nowNanos(), 0LL)), woken);
+            }
+            dispatcherSleeping.store(false, memory_order_relaxed);
+        }
+    }
+    void stop() {
+        {
+            lock_guard<mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wakeup.notify_one();
+        if(dispatcher.joinable()) dispatcher.join();
+    }
+    static void validate(const AdmissionSchedulerConfiguration& config) {
+        for(double weight : config.weights){
+            if(!(weight > 0)) throw std::invalid_argument("Tier weights must be positive");
+        }
+    }
+    void enqueue(UserTier tier, Waiter waiter) {
+        TierQueue& queue = tiers[(int)tier];
+        queue.waiters.push(std::move(waiter));
+        queue.enqueued.fetch_add(1, memory_order_relaxed);
+        queued.fetch_add(1, memory_order_seq_cst);
+        wake();
+    }
+public:
+    // clock must be the one the limiter reads
+    AdmissionScheduler(shared_ptr<AdaptiveConcurrencyLimiter> slots, AdmissionSchedulerConfiguration configuration = {}, shared_ptr<Clock> clock = nullptr)
+        : slots(std::move(slots)), config(configuration), clock(clock ? clock : Clock::monotonic()) {
+        validate(config);
+        this->slots->onSlotFreed([this]() {
+            if(queued.load(memory_order_relaxed) > 0) wake();
+        });
+        dispatcher = thread([this]() { run(); });
+    }
+    // Requests still queued are turned away
+    ~AdmissionScheduler() {
+        slots->onSlotFreed(nullptr);
+        stop();
+        for(TierQueue& queue : tiers){
+            while(optional<Waiter> waiter = queue.waiters.pop()) waiter->admitted(nullopt);
+        }
+    }
+    // New weights and budgets for the requests queued now as well as later ones
+    void reconfigure(AdmissionSchedulerConfiguration configuration) {
+        validate(configuration);
+        {
+            lock_guard<mutex> lock(sleepMutex);
+            nextConfig = configuration;
+            wakeups++;
+        }
+        wakeup.notify_one();
+    }
+    AdmissionSchedulerConfiguration configuration() {
+        lock_guard<mutex> lock(sleepMutex);
+        return nextConfig.value_or(config);
+    }
+    // Moves the queued requests, with the time they have waited so far, to successor, e.g. a
+    // scheduler on a new limiter. Stops this one's dispatcher: call once nothing can submit here.
+    void handOver(AdmissionScheduler& successor) {
+        stop();
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            while(optional<Waiter> waiter = tiers[tier].waiters.pop()){
+                queued.fetch_sub(1, memory_order_relaxed);
+                successor.enqueue((UserTier)tier, std::move(*waiter));
+            }
+        }
+    }
+    // Calls admitted with a slot, right away if one is free and nobody is queued, otherwise from
+    // the dispatcher thread once it is this request's turn; with nullopt if the tier's queue budget
+    // runs out first. admitted should hand the request off rather than do the work itself.
+    void submit(UserTier tier, function<void(optional<Permit>)> admitted) {
+        TierQueue& queue = tiers[(int)tier];
+        if(queued.load(memory_order_acquire) == 0 && slots->hasRoom()){
+            if(optional<Permit> permit = slots->tryAcquire()){
+                queue.immediate.fetch_add(1, memory_order_relaxed);
+                admitted(std::move(permit));
+                return;
+            }
+        }
+        enqueue(tier, Waiter{clock->nowNanos(), std::move(admitted)});
+    }
+    future<optional<Permit>> submit(UserTier tier) {
+        auto promise = make_shared<std::promise<optional<Permit>>>();
+        future<optional<Permit>> result = promise->get_future();
+        submit(tier, [promise](optional<Permit> permit) { promise->set_value(std::move(permit)); });
+        return result;
+    }
+    array<AdmissionTierStats, kUserTierCount> stats() const {
+        array<AdmissionTierStats, kUserTierCount> stats;
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            const TierQueue& queue = tiers[tier];
+            AdmissionTierStats& out = stats[tier];
+            out.dispatched = queue.dispatched.load(memory_order_relaxed);
+            out.expired = queue.expired.load(memory_order_relaxed);
+            out.immediate = queue.immediate.load(memory_order_relaxed);
+            uint64_t enqueued = queue.enqueued.load(memory_order_relaxed);
+            out.queued = enqueued > out.dispatched + out.expired ? enqueued - out.dispatched - out.expired : 0;
+            for(int bucket = 0; bucket < LatencyHistogram::kBucketCount; bucket++){
+                if(uint64_t times = queue.waitBuckets[bucket].load(memory_order_relaxed)) out.waits.addBucket(bucket, times);
+            }
+            out.waits.raiseMax(queue.maxWaitNanos.load(memory_order_relaxed));
+        }
+        return stats;
+    }
+};
+
+// An algorithm and its limits, as named in a limits file
+struct LimitSpec {
+    RateLimiterType type;
+    RateLimiterConfiguration config;
+    bool describes(const RateLimiter& limiter) const {
+        return limiter.type() == type && limiter.configuration().maxRequests == config.maxRequests
+            && limiter.configuration().timeWindowSeconds == config.timeWindowSeconds;
+    }
+};
+
+// Limits file, one rule per line ('#' starts a comment):
+//   tier <Free|Premium|Enterprise> <algorithm> <maxRequests> <windowSeconds>
+//   user <userId> <algorithm> <maxRequests> <windowSeconds>
+// algorithm is a rateLimiterTypeName, e.g. GCRA. A user rule applies whatever the user's tier.
+struct LimitsFile {
+    array<optional<LimitSpec>, kUserTierCount> tiers; // Tiers left out keep their current limiter
+    vector<pair<string, LimitSpec>> users;
+
+    static LimitsFile parse(const string& path) {
+        ifstream in(path);
+        if(!in) throw std::runtime_error("Cannot open limits file " + path);
+        static const char* tierNames[kUserTierCount] = {"Free", "Premium", "Enterprise"};
+        LimitsFile file;
+        string line;
+        for(int lineNumber = 1; getline(in, line); lineNumber++){
+            line = line.substr(0, line.find('#'));
+            istringstream fields(line);
+            string kind, name, algorithm, extra;
+            int maxRequests, windowSeconds;
+            if(!(fields >> kind)) continue;
+            auto fail = [&](const string& why) { return std::runtime_error(path + ":" + to_string(lineNumber) + ": " + why); };
+            if(!(fields >> name >> algorithm >> maxRequests >> windowSeconds) || (fields >> extra)){
+                throw fail("expected '" + kind + " <name> <algorithm> <maxRequests> <windowSeconds>'");
+            }
+            if(maxRequests <= 0 || windowSeconds <= 0) throw fail("limits must be positive");
+            int type = 0;
+            while(type < kRateLimiterTypeCount && algorithm != rateLimiterTypeName((RateLimiterType)type)) type++;
+            if(type == kRateLimiterTypeCount) throw fail("unknown algorithm " + algorithm);
+            LimitSpec spec{(RateLimiterType)type, RateLimiterConfiguration(maxRequests, windowSeconds)};
+            if(kind == "tier"){
+                int tier = find(tierNames, tierNames + kUserTierCount, name) - tierNames;
+                if(tier == kUserTierCount) throw fail("unknown tier " + name);
+                file.tiers[tier] = spec;
+            }else if(kind == "user"){
+                file.users.push_back({name, spec});
+            }else{
+                throw fail("unknown rule " + kind);
+            }
+        }
+        return file;
+    }
+};
+
+// Which limiter decides for whom. The service publishes a version by pointer swap and never
+// changes it afterwards; consecutive versions share the limiters they have in common.
+struct ServiceLimits {
+    struct UserIdHash {
+        using is_transparent = void;
+        size_t operator()(string_view userId) const { return hashUserId(userId); }
+    };
+    // A limiter, shared with the versions that keep it, and its concrete type for decisions
+    struct Limiter {
+        shared_ptr<RateLimiter> owner;
+        LimiterRef concrete;
+        Limiter() {}
+        Limiter(shared_ptr<RateLimiter> limiter) : owner(std::move(limiter)), concrete(owner->ref()) {}
+        RateLimiter* get() const { return owner.get(); }
+    };
+    array<Limiter, kUserTierCount> tierLimiters; // Indexed by UserTier
+    unordered_map<string, Limiter, UserIdHash, equal_to<>> userLimiters; // Per-user overrides
+    shared_ptr<CompositeRateLimiter> requestLimits; // For allowRequest(user, endpoint), once configured
+    shared_ptr<AdaptiveConcurrencyLimiter> concurrencyLimit; // For admit(), once configured
+    shared_ptr<AdmissionScheduler> admissionScheduler; // On concurrencyLimit, for admitQueued()
+
+    const Limiter& tierLimiter(UserTier tier) const {
+        const Limiter& limiter = tierLimiters[(int)tier];
+        if(limiter.get() == nullptr){
+            throw std::runtime_error("No rate limiter found for user tier");
+        }
+        return limiter;
+    }
+    const Limiter& limiterFor(UserTier tier, string_view userId) const {
+        if(!userLimiters.empty()){
+            auto it = userLimiters.find(userId);
+            if(it != userLimiters.end()) return it->second;
+        }
+        return tierLimiter(tier);
+    }
+};
+
+// Point-in-time view of a service's instrumentation, from RateLimiterService::stats()
+struct ServiceStats {
+    array<LatencyHistogram, kRateLimiterTypeCount> latencies; // Process-wide, every limiter of each type
+    array<LimiterStats, kUserTierCount> tiers;
+    struct Override {
+        size_t users; // Users sharing the override limiter
+        LimiterStats limiter;
+    };
+    vector<Override> overrides;
+    DecisionTotals decisions;
+    optional<ConcurrencyStats> concurrency; // With configureConcurrency
+    optional<array<AdmissionTierStats, kUserTierCount>> admission; // With configureAdmission
+};
+
+// Stats dumps on a signal. The handler only writes to the eventfds of the services subscribed to
+// that signal, which is async-signal-safe; each service prints from its own thread when woken.
+class StatsDumpSignal {
+    static constexpr int kMaxSubscribers = 16;
+    static inline array<atomic<uint64_t>, kMaxSubscribers> subscribers{}; // signal << 32 | eventFd + 1, 0 = free slot
+
+    static void handle(int signal) {
+        int savedErrno = errno;
+        uint64_t one = 1;
+        for(auto& subscriber : subscribers){
+            uint64_t entry = subscriber.load(memory_order_acquire);
+            if(entry != 0 && (int)(entry >> 32) == signal) (void)!write((int)(uint32_t)entry - 1, &one, sizeof(one));
+        }
+        errno = savedErrno;
+    }
+public:
+    // Returns the subscription's slot, for unsubscribe()
+    static int subscribe(int signal, int eventFd) {
+        uint64_t entry = (uint64_t)signal << 32 | (uint32_t)(eventFd + 1);
+        for(int slot = 0; slot < kMaxSubscribers; slot++){
+            uint64_t expected = 0;
+            if(!subscribers[slot].compare_exchange_strong(expected, entry)) continue;
+            struct sigaction action{};
+            action.sa_handler = handle;
+            action.sa_flags = SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            sigaction(signal, &action, nullptr);
+            return slot;
+        }
+        throw std::runtime_error("Too many stats dump subscriptions");
+    }
+    // Call before closing the eventFd
+    static void unsubscribe(int slot) { subscribers[slot].store(0, memory_order_release); }
+};
+
+class RateLimiterService{
+private:
+    shared_ptr<Clock> clock;
+    atomic<ServiceLimits*> activeLimits{nullptr}; // Read under a limitsEpoch guard
+    EpochDomain limitsEpoch;
+    mutex limitsMutex; // Serializes changes to the limits
+    DecisionCounters decisionCounters;
+    // Background work: periodic snapshots (plus a final one at shutdown) and limits file watching
+    string snapshotDirectory;
+    thread snapshotThread;
+    thread limitsWatchThread;
+    thread statsDumpThread;
+    int statsDumpEventFd = -1;
+    int statsDumpSlot = -1;
+    mutex backgroundMutex;
+    condition_variable backgroundWake;
+    bool stopping = false;
+
+    static string snapshotPath(const string& directory, UserTier tier) {
+        return directory + "/tier-" + to_string((int)tier) + ".snapshot";
+    }
+    // Sampled decision events: the hook is swapped atomically and old hooks are kept alive
+    // until the service goes away, since a decision may still be calling one
+    struct SampledEventHook {
+        function<void(const DecisionEvent&)> callback;
+        uint32_t sampleEvery;
+    };
+    atomic<SampledEventHook*> eventHook{nullptr};
+    vector<unique_ptr<SampledEventHook>> installedHooks;
+    mutex hookMutex;
+
+    void sampleDecision(const SampledEventHook* hook, string_view userId, UserTier tier, RateLimiterType type, bool allowed){
+        static thread_local uint32_t untilNextSample = 0;
+        if(untilNextSample-- > 0) return;
+        untilNextSample = hook->sampleEvery - 1;
+        hook->callback(DecisionEvent{userId, tier, type, allowed});
+    }
+    bool recordDecision(UserTier tier, RateLimiterType type, string_view userId, bool allowed){
+        decisionCounters.record(tier, type, allowed, !allowed);
+        if(SampledEventHook* hook = eventHook.load(memory_order_acquire)){
+            sampleDecision(hook, userId, tier, type, allowed);
+        }
+        return allowed;
+    }
+    // One decision on the limiter's concrete type: two switches on the variant indexes, then a
+    // direct call to that class's decision (type() of a final class is a constant)
+    template<typename Key>
+    bool decide(UserTier tier, const ServiceLimits::Limiter& limiter, Key& key){
+        return visitLimiter([&](auto* concrete) {
+            return recordDecision(tier, concrete->type(), userIdOf(key), concrete->allowRequest(key));
+        }, limiter.concrete);
+    }
+    // Swaps in new limits and frees the old version once no decision can still be reading it.
+    // Caller holds limitsMutex.
+    void publish(unique_ptr<ServiceLimits> limits){
+        ServiceLimits* previous = activeLimits.exchange(limits.release(), memory_order_seq_cst);
+        limitsEpoch.synchronize();
+        delete previous;
+    }
+    // The current tier limiters, kept alive for the caller even if the limits change meanwhile
+    array<shared_ptr<RateLimiter>, kUserTierCount> currentTierLimiters(){
+        EpochDomain::Guard guard(limitsEpoch);
+        const ServiceLimits& limits = *activeLimits.load(memory_order_seq_cst);
+        array<shared_ptr<RateLimiter>, kUserTierCount> limiters;
+        for(int tier = 0; tier < kUserTierCount; tier++) limiters[tier] = limits.tierLimiters[tier].owner;
+        return limiters;
+    }
+    // In-memory snapshots of limiters being replaced by a reload, each taken once; their
+    // successors read users from them on first touch
+    class Handovers {
+        map<RateLimiter*, shared_ptr<Snapshot>> snapshots;
+    public:
+        shared_ptr<Snapshot> of(RateLimiter& limiter){
+            auto [it, inserted] = snapshots.try_emplace(&limiter);
+            if(inserted){
+                SnapshotWriter writer;
+                limiter.writeStates(writer);
+                it->second = Snapshot::fromImage(writer.image(limiter.type(), limiter.configuration()), limiter.type());
+            }
+            return it->second;
+        }
+    };
+    // A new limiter for spec, taking each user's state over from the first predecessor of the same
+    // algorithm that has the user
+    shared_ptr<RateLimiter> successor(const LimitSpec& spec, const vector<RateLimiter*>& predecessors, Handovers& handovers){
+        shared_ptr<RateLimiter> limiter(RateLimiterFactory::createRateLimiter(spec.type, spec.config, clock));
+        set<RateLimiter*> seen;
+        for(RateLimiter* predecessor : predecessors){
+            if(predecessor == nullptr || predecessor->type() != spec.type || !seen.insert(predecessor).second) continue;
+            limiter->readStates(handovers.of(*predecessor));
+        }
+        return limiter;
+    }
+public:
+    // Every tier's limiter reads time from `clock` (monotonic by default)
+    RateLimiterService(shared_ptr<Clock> clock = nullptr) : clock(clock ? clock : Clock::monotonic()) {
+        auto limits = make_unique<ServiceLimits>();
+        limits->tierLimiters[(int)UserTier::Free] = shared_ptr<RateLimiter>(RateLimiterFactory::createRateLimiter(UserTier::Free, RateLimiterConfiguration(10, 60), this->clock));
+        limits->tierLimiters[(int)UserTier::Premium] = shared_ptr<RateLimiter>(RateLimiterFactory::createRateLimiter(UserTier::Premium, RateLimiterConfiguration(100, 60), this->clock));
+        limits->tierLimiters[(int)UserTier::Enterprise] = shared_ptr<RateLimiter>(RateLimiterFactory::createRateLimiter(UserTier::Enterprise, RateLimiterConfiguration(1000, 60), this->clock));
+        activeLimits.store(limits.release());
+    }
+    ~RateLimiterService(){
+        {
+            lock_guard<mutex> lock(backgroundMutex);
+            stopping = true;
+        }
+        backgroundWake.notify_all();
+        if(limitsWatchThread.joinable()) limitsWatchThread.join();
+        if(statsDumpThread.joinable()){
+            StatsDumpSignal::unsubscribe(statsDumpSlot);
+            uint64_t wake = 1;
+            (void)!write(statsDumpEventFd, &wake, sizeof(wake));
+            statsDumpThread.join();
+            close(statsDumpEventFd);
+        }
+        if(snapshotThread.joinable()){
+            snapshotThread.join();
+            saveSnapshots(snapshotDirectory);
+        }
+        delete activeLimits.load();
+    }
+    // Replaces the tier's limiter with one of the given algorithm, e.g. GCRA for Premium
+    void configureTier(UserTier tier, RateLimiterType type, RateLimiterConfiguration config){
+        RateLimiter* limiter = RateLimiterFactory::createRateLimiter(type, config, clock);
+        if(limiter == nullptr){
+            throw std::runtime_error("Unknown rate limiter type");
+        }
+        configureTier(tier, limiter);
+    }
+    // Installs a limiter built by the caller (e.g. a SharedMemoryTokenBucketRateLimiter on a
+    // named segment); the service takes ownership. Safe while decisions are running.
+    void configureTier(UserTier tier, RateLimiter* limiter){
+        shared_ptr<RateLimiter> owned(limiter);
+        lock_guard<mutex> lock(limitsMutex);
+        auto limits = make_unique<ServiceLimits>(*activeLimits.load());
+        limits->tierLimiters[(int)tier] = std::move(owned);
+        publish(std::move(limits));
+    }
+    // Applies a limits file (see LimitsFile) while decisions keep running. A limiter whose algorithm
+    // and limits are unchanged carries on untouched; a changed one is replaced by a new limiter that
+    // takes its users' state over, adapted to the new limits (what a user has used stays used).
+    // Users whose override is added or removed bring their state along the same way, if the
+    // limiter they move to is new. Decisions taken on a replaced limiter while the reload runs
+    // are not carried over. A SharedMemoryTokenBucket limiter can only be kept: its users live in
+    // a segment other processes share under its limits, so there is no moving them. Throws,
+    // changing nothing, if the file is invalid or would replace one.
+    void reloadLimits(const string& path){
+        LimitsFile file = LimitsFile::parse(path);
+        lock_guard<mutex> lock(limitsMutex);
+        const ServiceLimits& current = *activeLimits.load();
+        auto replacesShared = [](const RateLimiter& limiter, const LimitSpec* spec) {
+            return limiter.type() == RateLimiterType::SharedMemoryTokenBucket && !(spec && spec->describes(limiter));
+        };
+        static const char* tierNames[kUserTierCount] = {"Free", "Premium", "Enterprise"};
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            const RateLimiter* previous = current.tierLimiters[tier].owner.get();
+            if(file.tiers[tier] && previous && replacesShared(*previous, &*file.tiers[tier])){
+                throw std::runtime_error(string("Cannot change the ") + tierNames[tier] + " tier's SharedMemoryTokenBucket limits without a restart");
+            }
+        }
+        for(auto& [userId, limiter] : current.userLimiters){
+            auto rule = find_if(file.users.begin(), file.users.end(), [&](auto& user) { return user.first == userId; });
+            if(replacesShared(*limiter.owner, rule == file.users.end() ? nullptr : &rule->second)){
+                throw std::runtime_error("Cannot change user " + userId + "'s SharedMemoryTokenBucket limits without a restart");
+            }
+        }
+        auto limits = make_unique<ServiceLimits>();
+        limits->requestLimits = current.requestLimits; // Not part of the file
+        limits->concurrencyLimit = current.concurrencyLimit;
+        limits->admissionScheduler = current.admissionScheduler;
+        Handovers handovers;
+        vector<RateLimiter*> overrideLimiters;
+        for(auto& [userId, limiter] : current.userLimiters) overrideLimiters.push_back(limiter.get());
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            const shared_ptr<RateLimiter>& previous = current.tierLimiters[tier].owner;
+            if(!file.tiers[tier] || (previous && file.tiers[tier]->describes(*previous))){
+                limits->tierLimiters[tier] = previous;
+                continue;
+            }
+            vector<RateLimiter*> predecessors = {previous.get()};
+            predecessors.insert(predecessors.end(), overrideLimiters.begin(), overrideLimiters.end());
+            limits->tierLimiters[tier] = successor(*file.tiers[tier], predecessors, handovers);
+        }
+        // Users with the same override share one limiter
+        vector<shared_ptr<RateLimiter>> overrides;
+        for(auto& [userId, spec] : file.users){
+            shared_ptr<RateLimiter> limiter;
+            for(auto& candidate : overrides) if(spec.describes(*candidate)) limiter = candidate;
+            for(auto& [otherUser, candidate] : current.userLimiters) if(!limiter && spec.describes(*candidate.get())) limiter = candidate.owner;
+            if(!limiter){
+                vector<RateLimiter*> predecessors = overrideLimiters;
+                for(auto& tierLimiter : current.tierLimiters) predecessors.push_back(tierLimiter.get());
+                limiter = successor(spec, predecessors, handovers);
+            }
+            if(find(overrides.begin(), overrides.end(), limiter) == overrides.end()) overrides.push_back(limiter);
+            limits->userLimiters[userId] = limiter;
+        }
+        publish(std::move(limits));
+    }
+    // Loads the limits file now, then reloads it whenever its modification time changes,
+    // checking every interval. A reload that fails is reported and the limits stay as they were.
+    void watchLimits(const string& path, chrono::milliseconds interval){
+        if(limitsWatchThread.joinable()) throw std::runtime_error("Already watching a limits file");
+        struct stat info{};
+        stat(path.c_str(), &info);
+        reloadLimits(path);
+        limitsWatchThread = thread([this, path, interval, loaded = info.st_mtim]() mutable {
+            unique_lock<mutex> lock(backgroundMutex);
+            while(!backgroundWake.wait_for(lock, interval, [this]() { return stopping; })){
+                lock.unlock();
+                struct stat info{};
+                if(stat(path.c_str(), &info) == 0 && (info.st_mtim.tv_sec != loaded.tv_sec || info.st_mtim.tv_nsec != loaded.tv_nsec)){
+                    loaded = info.st_mtim;
+                    try{
+                        reloadLimits(path);
+                    }catch(const exception& error){
+                        cerr << "limits reload failed: " << error.what() << endl;
+                    }
+                }
+                lock.lock();
+            }
+        });
+    }
+    bool allowRequest(const User& user){
+        return allowRequest(user.tier, user.userId);
+    }
+    bool allowRequest(UserTier tier, string_view userId){
+        EpochDomain::Guard guard(limitsEpoch);
+        return decide(tier, activeLimits.load(memory_order_seq_cst)->limiterFor(tier, userId), userId);
+    }
+    // For callers that resolved the user once, e.g. per connection: no key copy, hash or lookup
+    bool allowRequest(UserTier tier, KeyHandle& handle){
+        EpochDomain::Guard guard(limitsEpoch);
+        return decide(tier, activeLimits.load(memory_order_seq_cst)->limiterFor(tier, handle.userId), handle);
+    }
+    // Layered limits (per user, tier, endpoint, global) decided together for each request by
+    // allowRequest(user, endpoint), which uses them instead of the tier's limiter. Safe while
+    // decisions are running; the new rules start with no requests counted.
+    void configureLimits(vector<LimitRule> rules){
+        auto requestLimits = make_shared<CompositeRateLimiter>(std::move(rules), clock);
+        lock_guard<mutex> lock(limitsMutex);
+        auto limits = make_unique<ServiceLimits>(*activeLimits.load());
+        limits->requestLimits = std::move(requestLimits);
+        publish(std::move(limits));
+    }
+    bool allowRequest(const User& user, string_view endpoint, int cost = 1){
+        EpochDomain::Guard guard(limitsEpoch);
+        CompositeRateLimiter* requestLimits = activeLimits.load(memory_order_seq_cst)->requestLimits.get();
+        if(requestLimits == nullptr){
+            throw std::runtime_error("No request limits configured");
+        }
+        bool allowed = requestLimits->allowRequest(RequestContext{user.userId, user.tier, endpoint}, cost);
+        decisionCounters.record(user.tier, allowed, !allowed);
+        return allowed;
+    }
+    // A cap on requests in flight to the downstream, learned from the latencies reported on the
+    // permits admit() hands out. Safe while requests are being admitted: permits already handed out
+    // keep the old limiter until they are done, and the new one counts only what it admits. A
+    // configured admission scheduler moves to the new limiter with its queue.
+    void configureConcurrency(AdaptiveConcurrencyConfiguration config){
+        auto concurrencyLimit = make_shared<AdaptiveConcurrencyLimiter>(config, clock);
+        lock_guard<mutex> lock(limitsMutex);
+        auto limits = make_unique<ServiceLimits>(*activeLimits.load());
+        shared_ptr<AdmissionScheduler> previous = std::move(limits->admissionScheduler);
+        if(previous) limits->admissionScheduler = make_shared<AdmissionScheduler>(concurrencyLimit, previous->configuration(), clock);
+        limits->concurrencyLimit = std::move(concurrencyLimit);
+        AdmissionScheduler* successor = limits->admissionScheduler.get();
+        publish(std::move(limits));
+        // Nothing can submit to the previous scheduler any more
+        if(previous) previous->handOver(*successor);
+    }
+    // Lets admitQueued() queue the requests the concurrency limit has no room for, per tier, and
+    // hand freed slots out by weighted fair queueing. Call after configureConcurrency; calling it
+    // again changes the weights and budgets, also for the requests already queued.
+    void configureAdmission(AdmissionSchedulerConfiguration config){
+        lock_guard<mutex> lock(limitsMutex);
+        const ServiceLimits& current = *activeLimits.load();
+        if(!current.concurrencyLimit){
+            throw std::runtime_error("No concurrency limit configured");
+        }
+        if(current.admissionScheduler){
+            current.admissionScheduler->reconfigure(config);
+            return;
+        }
+        auto limits = make_unique<ServiceLimits>(current);
+        limits->admissionScheduler = make_shared<AdmissionScheduler>(current.concurrencyLimit, config, clock);
+        publish(std::move(limits));
+    }
+    // Admits a request if its tier's share of the concurrency limit has room and the user's rate
+    // limit allows it. The slot is taken first, so a request shed for lack of room spends none of
+    // the user's rate limit, and one the rate limit denies gives its slot straight back. Report the
+    // request's outcome on the permit.
+    optional<AdaptiveConcurrencyLimiter::Permit> admit(UserTier tier, string_view userId){
+        EpochDomain::Guard guard(limitsEpoch);
+        const ServiceLimits& limits = *activeLimits.load(memory_order_seq_cst);
+        if(!limits.concurrencyLimit){
+            throw std::runtime_error("No concurrency limit configured");
+        }
+        optional<AdaptiveConcurrencyLimiter::Permit> permit = limits.concurrencyLimit->tryAcquire(tier);
+        if(!permit){
+            decisionCounters.record(tier, 0, 1);
+            return nullopt;
+        }
+        if(!decide(tier, limits.limiterFor(tier, userId), userId)) return nullopt;
+        return permit;
+    }
+    // Like admit(), but a request within its rate limit that finds no room waits in its tier's queue
+    // for a slot instead of being shed. admitted gets nullopt if the rate limit denies the request
+    // or the tier's queue budget runs out first; it may be called on the scheduler's thread, and
+    // must not reconfigure the service.
+    void admitQueued(UserTier tier, string_view userId, function<void(optional<AdaptiveConcurrencyLimiter::Permit>)> admitted){
+        EpochDomain::Guard guard(limitsEpoch);
+        const ServiceLimits& limits = *activeLimits.load(memory_order_seq_cst);
+        if(!limits.admissionScheduler){
+            throw std::runtime_error("No admission scheduler configured");
+        }
+        if(!decide(tier, limits.limiterFor(tier, userId), userId)){
+            admitted(nullopt);
+            return;
+        }
+        // Under the guard, so configureConcurrency hands it over with the rest of the queue
+        limits.admissionScheduler->submit(tier, std::move(admitted));
+    }
+    future<optional<AdaptiveConcurrencyLimiter::Permit>> admitQueued(UserTier tier, string_view userId){
+        auto promise = make_shared<std::promise<optional<AdaptiveConcurrencyLimiter::Permit>>>();
+        future<optional<AdaptiveConcurrencyLimiter::Permit>> result = promise->get_future();
+        admitQueued(tier, userId, [promise](optional<AdaptiveConcurrencyLimiter::Permit> permit) { promise->set_value(std::move(permit)); });
+        return result;
+    }
+    optional<ConcurrencyStats> concurrencyStats(){
+        EpochDomain::Guard guard(limitsEpoch);
+        AdaptiveConcurrencyLimiter* concurrencyLimit = activeLimits.load(memory_order_seq_cst)->concurrencyLimit.get();
+        return concurrencyLimit ? optional<ConcurrencyStats>(concurrencyLimit->stats()) : nullopt;
+    }
+    // Batch variant for one tier: no per-request User copy or limiter lookup, one clock read per batch.
+    // Users with an override are decided by their own limiter.
+    DecisionBitmap allowRequests(UserTier tier, span<const string> userIds, span<const int> costs = {}){
+        EpochDomain::Guard guard(limitsEpoch);
+        const ServiceLimits& limits = *activeLimits.load(memory_order_seq_cst);
+        RateLimiter* limiter = limits.tierLimiter(tier).get();
+        SampledEventHook* hook = eventHook.load(memory_order_acquire);
+        if(limits.userLimiters.empty()){
+            DecisionBitmap decisions = limiter->allowRequests(userIds, costs);
+            size_t allowed = decisions.count();
+            decisionCounters.record(tier, limiter->type(), allowed, decisions.size() - allowed);
+            if(hook){
+                for(size_t i = 0; i < decisions.size(); i++) sampleDecision(hook, userIds[i], tier, limiter->type(), decisions.test(i));
+            }
+            return decisions;
+        }
+        DecisionBitmap decisions(userIds.size());
+        vector<string> tierUserIds;
+        vector<int> tierCosts;
+        vector<size_t> tierIndex;
+        for(size_t i = 0; i < userIds.size(); i++){
+            RateLimiter* own = limits.limiterFor(tier, userIds[i]).get();
+            if(own == limiter){
+                tierUserIds.push_back(userIds[i]);
+                if(!costs.empty()) tierCosts.push_back(costs[i]);
+                tierIndex.push_back(i);
+            }else if(recordDecision(tier, own->type(), userIds[i], own->allowRequests(userIds.subspan(i, 1), costs.empty() ? costs : costs.subspan(i, 1)).test(0))){
+                decisions.set(i);
+            }
+        }
+        DecisionBitmap tierDecisions = limiter->allowRequests(tierUserIds, tierCosts);
+        for(size_t k = 0; k < tierIndex.size(); k++){
+            if(recordDecision(tier, limiter->type(), tierUserIds[k], tierDecisions.test(k))) decisions.set(tierIndex[k]);
+        }
+        return decisions;
+    }
+    DecisionTotals decisionTotals() const { return decisionCounters.totals(); }
+    // Latencies, per-limiter state and lock contention, and decision totals. Walks every limiter's
+    // tables, so call it for monitoring, not per request.
+    ServiceStats stats(){
+        ServiceStats stats;
+        stats.latencies = DecisionLatencies::snapshot();
+        stats.decisions = decisionCounters.totals();
+        // Hold the limiters, not the epoch guard: reading them walks their shards
+        array<shared_ptr<RateLimiter>, kUserTierCount> tiers;
+        vector<pair<shared_ptr<RateLimiter>, size_t>> overrides;
+        {
+            EpochDomain::Guard guard(limitsEpoch);
+            const ServiceLimits& limits = *activeLimits.load(memory_order_seq_cst);
+            for(int tier = 0; tier < kUserTierCount; tier++) tiers[tier] = limits.tierLimiters[tier].owner;
+            map<RateLimiter*, size_t> index;
+            for(auto& [userId, limiter] : limits.userLimiters){
+                auto [it, inserted] = index.try_emplace(limiter.get(), overrides.size());
+                if(inserted) overrides.push_back({limiter.owner, 0});
+                overrides[it->second].second++;
+            }
+        }
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            if(tiers[tier]) stats.tiers[tier] = tiers[tier]->stats();
+        }
+        for(auto& [limiter, users] : overrides) stats.overrides.push_back({users, limiter->stats()});
+        stats.concurrency = concurrencyStats();
+        {
+            EpochDomain::Guard guard(limitsEpoch);
+            AdmissionScheduler* admissionScheduler = activeLimits.load(memory_order_seq_cst)->admissionScheduler.get();
+            if(admissionScheduler) stats.admission = admissionScheduler->stats();
+        }
+        return stats;
+    }
+    void dumpStats(ostream& out){
+        ServiceStats current = stats();
+        static const char* tierNames[kUserTierCount] = {"Free", "Premium", "Enterprise"};
+        auto printLimiter = [&](const LimiterStats& limiter) {
+            const LockStats& locks = limiter.locks;
+            out << " " << rateLimiterTypeName(limiter.type) << " keys=" << limiter.keys.liveKeys << " evicted=" << limiter.keys.evictedKeys
+                << " state_bytes=" << limiter.stateBytes << " lock_acquires=" << locks.acquires << " contended=" << locks.contended
+                << " lock_wait_us=" << locks.waitNanos / 1000 << "\n";
+        };
+        out << "rate limiter stats\n";
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            out << "  decisions " << tierNames[tier] << " allowed=" << current.decisions.byTier[tier][1] << " denied=" << current.decisions.byTier[tier][0] << "\n";
+        }
+        for(int type = 0; type < kRateLimiterTypeCount; type++){
+            const LatencyHistogram& latency = current.latencies[type];
+            if(latency.count() == 0) continue;
+            out << "  latency " << rateLimiterTypeName((RateLimiterType)type) << " samples=" << latency.count() << " p50=" << latency.percentile(50)
+                << "ns p90=" << latency.percentile(90) << "ns p99=" << latency.percentile(99) << "ns p99.9=" << latency.percentile(99.9)
+                << "ns max=" << latency.maximum() << "ns\n";
+        }
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            out << "  tier " << tierNames[tier];
+            printLimiter(current.tiers[tier]);
+        }
+        for(const ServiceStats::Override& userOverride : current.overrides){
+            out << "  override users=" << userOverride.users;
+            printLimiter(userOverride.limiter);
+        }
+        if(const optional<ConcurrencyStats>& concurrency = current.concurrency){
+            out << "  concurrency limit=" << concurrency->limit << " in_flight=" << concurrency->inFlight << " admitted=" << concurrency->admitted
+                << " rejected=" << concurrency->rejected << " dropped=" << concurrency->dropped << " baseline_latency_us=" << concurrency->baselineLatencyNanos / 1000
+                << " recent_latency_us=" << concurrency->recentLatencyNanos / 1000 << "\n";
+        }
+        if(current.admission){
+            for(int tier = 0; tier < kUserTierCount; tier++){
+                const AdmissionTierStats& admission = (*current.admission)[tier];
+                out << "  admission " << tierNames[tier] << " queued=" << admission.queued << " immediate=" << admission.immediate
+                    << " dispatched=" << admission.dispatched << " expired=" << admission.expired << " wait_p50_us=" << admission.waits.percentile(50) / 1000
+                    << " wait_p99_us=" << admission.waits.percentile(99) / 1000 << " wait_max_us=" << admission.waits.maximum() / 1000 << "\n";
+            }
+        }
+        out.flush();
+    }
+    // Dumps stats to `out` whenever the process receives `signal` (e.g. kill -USR1 <pid>), from a
+    // thread of the service's own; the signal handler itself does no more than wake that thread.
+    // `out` must outlive the service.
+    void dumpStatsOnSignal(int signal = SIGUSR1, ostream& out = cerr){
+        if(statsDumpThread.joinable()) throw std::runtime_error("Already dumping stats on a signal");
+        statsDumpEventFd = eventfd(0, EFD_CLOEXEC);
+        if(statsDumpEventFd < 0) throw std::runtime_error("eventfd failed");
+        statsDumpSlot = StatsDumpSignal::subscribe(signal, statsDumpEventFd);
+        statsDumpThread = thread([this, &out]() {
+            while(true){
+                uint64_t signals;
+                ssize_t got = read(statsDumpEventFd, &signals, sizeof(signals)); // Signals since the last dump coalesce into one
+                if(got < 0 && errno == EINTR) continue;
+                {
+                    lock_guard<mutex> lock(backgroundMutex);
+                    if(stopping || got < 0) return;
+                }
+                dumpStats(out);
+            }
+        });
+    }
+    // Writes one snapshot file per tier into directory
+    void saveSnapshots(const string& directory){
+        auto limiters = currentTierLimiters();
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            if(limiters[tier]) limiters[tier]->saveSnapshot(snapshotPath(directory, (UserTier)tier));
+        }
+    }
+    // Warm restart from saveSnapshots' files; call after configuring the tiers and before taking
+    // decisions. Returns how many tiers found a snapshot for their current algorithm (state saved
+    // under other limits is adapted to the current ones).
+    int loadSnapshots(const string& directory){
+        auto limiters = currentTierLimiters();
+        int loaded = 0;
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            if(limiters[tier]) loaded += limiters[tier]->loadSnapshot(snapshotPath(directory, (UserTier)tier));
+        }
+        return loaded;
+    }
+    // Saves snapshots every interval from a background thread, and once more on shutdown
+    void startPeriodicSnapshots(const string& directory, chrono::seconds interval){
+        if(snapshotThread.joinable()) throw std::runtime_error("Periodic snapshots already started");
+        snapshotDirectory = directory;
+        snapshotThread = thread([this, interval]() {
+            unique_lock<mutex> lock(backgroundMutex);
+            while(!backgroundWake.wait_for(lock, interval, [this]() { return stopping; })){
+                lock.unlock();
+                try{
+                    saveSnapshots(snapshotDirectory);
+                }catch(const exception& error){
+                    cerr << "snapshot failed: " << error.what() << endl; // Keep serving; the next interval retries
+                }
+                lock.lock();
+            }
+        });
+    }
+    // Calls hook for one in every sampleEvery decisions (per thread); pass nullptr to stop sampling.
+    // The hook runs on the deciding thread, so it should hand the event off rather than do I/O.
+    void setSampledEventHook(function<void(const DecisionEvent&)> hook, uint32_t sampleEvery = 1000){
+        lock_guard<mutex> lock(hookMutex);
+        if(!hook){
+            eventHook.store(nullptr, memory_order_release);
+            return;
+        }
+        installedHooks.push_back(make_unique<SampledEventHook>(SampledEventHook{std::move(hook), max(sampleEvery, 1u)}));
+        eventHook.store(installedHooks.back().get(), memory_order_release);
+    }
+};
+
+// Wire protocol of the decision server. Integers are little-endian, and every frame starts with
+// its length (the bytes after the length field). A client may send any number of requests without
+// waiting for answers; a connection's responses come back in request order.
+//   request:  u32 length | u32 requestId | u8 opcode | u8 tier | u16 count | count x (u16 cost | u16 keyLength | key)
+//   response: u32 length | u32 requestId | u8 status | u8 0 | u16 count | (count + 7) / 8 bytes, bit i = decision i
+// A malformed frame closes the connection; a well-formed request the service cannot decide gets
+// a status other than kOk and no decisions.
+struct DecisionProtocol {
+    static_assert(endian::native == endian::little, "frames are written in host byte order");
+    static constexpr uint8_t kDecide = 1; // A batch of decisions for users of one tier
+    static constexpr uint8_t kOk = 0;
+    static constexpr uint8_t kBadRequest = 1; // Unknown opcode or tier
+    static constexpr uint8_t kNoLimiter = 2; // The tier has no limiter configured
+    static constexpr size_t kHeaderBytes = 12; // Both directions, length field included
+    static constexpr size_t kMaxFrameBytes = 1 << 20;
+    static constexpr size_t kMaxBatch = UINT16_MAX;
+
+    static void appendRequest(string& out, uint32_t requestId, UserTier tier, span<const string> userIds, span<const int> costs = {}) {
+        size_t length = kHeaderBytes - sizeof(uint32_t);
+        for(const string& userId : userIds) length += 2 * sizeof(uint16_t) + userId.size();
+        appendField<uint32_t>(out, length);
+        appendField<uint32_t>(out, requestId);
+        appendField<uint8_t>(out, kDecide);
+        appendField<uint8_t>(out, (uint8_t)tier);
+        appendField<uint16_t>(out, userIds.size());
+        for(size_t i = 0; i < userIds.size(); i++){
+            appendField<uint16_t>(out, costs.empty() ? 1 : costs[i]);
+            appendField<uint16_t>(out, userIds[i].size());
+            out.append(userIds[i]);
+        }
+    }
+    static void appendResponse(string& out, uint32_t requestId, uint8_t status, const DecisionBitmap* decisions) {
+        string_view bits = decisions ? decisions->bytes() : string_view();
+        appendField<uint32_t>(out, kHeaderBytes - sizeof(uint32_t) + bits.size());
+        appendField<uint32_t>(out, requestId);
+        appendField<uint8_t>(out, status);
+        appendField<uint8_t>(out, 0);
+        appendField<uint16_t>(out, decisions ? decisions->size() : 0);
+        out.append(bits);
+    }
+};
+
+struct DecisionServerConfiguration {
+    string unixSocketPath; // Empty = no Unix-domain listener
+    string tcpAddress = "127.0.0.1";
+    int tcpPort = -1; // -1 = no TCP listener, 0 = any free port (see DecisionServer::tcpPort)
+    int eventLoops = 0; // 0 = one per core
+};
+
+// Standalone front end for a RateLimiterService, so processes in any language can ask it for
+// decisions. Each event loop is a thread with its own epoll set, and every loop waits on the
+// listening sockets (EPOLLEXCLUSIVE), so a new connection is accepted by one idle loop and stays
+// on it. A loop reads whatever a connection has sent, decides every complete request in it and
+// answers them all with one write; a request's whole batch is one allowRequests call.
+class DecisionServer {
+    static constexpr size_t kMaxPendingOutput = 4 << 20; // Stop reading from a client this far behind on its answers
+    struct Connection {
+        int fd;
+        string input;
+        string output;
+        size_t written = 0; // Bytes of output already sent
+        uint32_t events = 0; // Registered epoll events
+    };
+    struct alignas(64) EventLoop {
+        int epollFd = -1;
+        int wakeFd = -1;
+        thread worker;
+        unordered_map<int, unique_ptr<Connection>> connections;
+        vector<string> userIds; // Scratch for the batch being decided, reused across requests
+        vector<int> costs;
+        atomic<uint64_t> decisions{0};
+    };
+    RateLimiterService& service;
+    DecisionServerConfiguration configuration;
+    vector<int> listeners;
+    int boundTcpPort = -1;
+    vector<unique_ptr<EventLoop>> loops;
+
+    static void fail(const string& what) { throw std::runtime_error(what + ": " + strerror(errno)); }
+    int listenOn(int fd, const sockaddr* address, socklen_t addressLength, const string& name) {
+        if(fd < 0) fail("socket " + name);
+        listeners.push_back(fd);
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if(::bind(fd, address, addressLength) != 0) fail("bind " + name);
+        if(listen(fd, SOMAXCONN) != 0) fail("listen " + name);
+        return fd;
+    }
+    void watch(EventLoop& loop, Connection& connection, uint32_t events) {
+        if(connection.events == events) return;
+        epoll_event event{events, {.fd = connection.fd}};
+        epoll_ctl(loop.epollFd, EPOLL_CTL_MOD, connection.fd, &event);
+        connection.events = events;
+    }
+    void accept(EventLoop& loop, int listener) {
+        // One connection per wakeup, so a burst of connects spreads over the loops
+        int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) return; // Another loop took it, or the client gave up
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // Fails harmlessly on Unix sockets
+        auto connection = make_unique<Connection>();
+        connection->fd = fd;
+        connection->events = EPOLLIN;
+        epoll_event event{EPOLLIN, {.fd = fd}};
+        if(epoll_ctl(loop.epollFd, EPOLL_CTL_ADD, fd, &event) != 0){
+            close(fd);
+            return;
+        }
+        loop.connections[fd] = std::move(connection);
+    }
+    // Answers one request frame (after its length field); false if it is malformed
+    bool serve(EventLoop& loop, string_view frame, string& out) {
+        uint32_t requestId = takeField<uint32_t>(frame);
+        uint8_t opcode = takeField<uint8_t>(frame);
+        uint8_t tier = takeField<uint8_t>(frame);
+        size_t count = takeField<uint16_t>(frame);
+        if(loop.userIds.size() < count) loop.userIds.resize(count);
+        loop.costs.clear();
+        bool unitCosts = true;
+        for(size_t i = 0; i < count; i++){
+            if(frame.size() < 2 * sizeof(uint16_t)) return false;
+            int cost = takeField<uint16_t>(frame);
+            size_t keyLength = takeField<uint16_t>(frame);
+            if(frame.size() < keyLength) return false;
+            loop.userIds[i].assign(frame.substr(0, keyLength)); // Keeps the string's capacity from earlier requests
+            frame.remove_prefix(keyLength);
+            loop.costs.push_back(cost);
+            unitCosts = unitCosts && cost == 1;
+        }
+        if(!frame.empty()) return false;
+        if(opcode != DecisionProtocol::kDecide || tier >= kUserTierCount){
+            DecisionProtocol::appendResponse(out, requestId, DecisionProtocol::kBadRequest, nullptr);
+            return true;
+        }
+        try{
+            DecisionBitmap decisions(count);
+            if(count == 1 && unitCosts){
+                if(service.allowRequest((UserTier)tier, loop.userIds[0])) decisions.set(0);
+            }else if(count > 0){
+                decisions = service.allowRequests((UserTier)tier, span<const string>(loop.userIds.data(), count),
+                                                  unitCosts ? span<const int>() : span<const int>(loop.costs));
+            }
+            loop.decisions.fetch_add(count, memory_order_relaxed);
+            DecisionProtocol::appendResponse(out, requestId, DecisionProtocol::kOk, &decisions);
+        }catch(const std::runtime_error&){
+            DecisionProtocol::appendResponse(out, requestId, DecisionProtocol::kNoLimiter, nullptr);
+        }
+        return true;
+    }
+    // Reads what the client sent and answers every complete request; false to close the connection
+    bool readAndServe(EventLoop& loop, Connection& connection) {
+        char buffer[1 << 16];
+        while(true){
+            ssize_t got = read(connection.fd, buffer, sizeof(buffer));
+            if(got > 0){
+                connection.input.append(buffer, got);
+                if((size_t)got < sizeof(buffer)) break;
+            }else if(got == 0){
+                return false;
+            }else if(errno == EINTR){
+                continue;
+            }else if(errno == EAGAIN || errno == EWOULDBLOCK){
+                break;
+            }else{
+                return false;
+            }
+        }
+        size_t offset = 0;
+        while(connection.input.size() - offset >= sizeof(uint32_t)){
+            string_view pending = string_view(connection.input).substr(offset);
+            size_t length = takeField<uint32_t>(pending);
+            if(length < DecisionProtocol::kHeaderBytes - sizeof(uint32_t) || length > DecisionProtocol::kMaxFrameBytes) return false;
+            if(pending.size() < length) break; // Rest of the frame not here yet
+            if(!serve(loop, pending.substr(0, length), connection.output)) return false;
+            offset += sizeof(uint32_t) + length;
+        }
+        connection.input.erase(0, offset);
+        return flush(loop, connection);
+    }
+    // Sends as much pending output as the socket takes, and waits for writability for the rest
+    bool flush(EventLoop& loop, Connection& connection) {
+        while(connection.written < connection.output.size()){
+            ssize_t sent = send(connection.fd, connection.output.data() + connection.written, connection.output.size() - connection.written, MSG_NOSIGNAL);
+            if(sent > 0){
+                connection.written += sent;
+            }else if(sent < 0 && errno == EINTR){
+                continue;
+            }else if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                break;
+            }else{
+                return false;
+            }
+        }
+        if(connection.written == connection.output.size()){
+            connection.output.clear();
+            connection.written = 0;
+        }
+        size_t pending = connection.output.size() - connection.written;
+        watch(loop, connection, (pending < kMaxPendingOutput ? (uint32_t)EPOLLIN : 0) | (pending > 0 ? (uint32_t)EPOLLOUT : 0));
+        return true;
+    }
+    void run(EventLoop& loop) {
+        epoll_event events[64];
+        while(true){
+            int ready = epoll_wait(loop.epollFd, events, 64, -1);
+            if(ready < 0){
+                if(errno == EINTR) continue;
+                break;
+            }
+            for(int i = 0; i < ready; i++){
+                int fd = events[i].data.fd;
+                if(fd == loop.wakeFd) return; // Stopping
+                if(find(listeners.begin(), listeners.end(), fd) != listeners.end()){
+                    accept(loop, fd);
+                    continue;
+                }
+                auto it = loop.connections.find(fd);
+                if(it == loop.connections.end()) continue;
+                Connection& connection = *it->second;
+                bool open = true;
+                if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) open = readAndServe(loop, connection);
+                if(open && (events[i].events & EPOLLOUT)) open = flush(loop, connection);
+                if(!open){
+                    close(fd); // Also takes it out of the epoll set
+                    loop.connections.erase(it);
+                }
+            }
+        }
+    }
+public:
+    // Starts listening and serving right away; throws if a listener cannot be set up
+    DecisionServer(RateLimiterService& service, DecisionServerConfiguration configuration) : service(service), configuration(configuration) {
+        try{
+            if(!configuration.unixSocketPath.empty()){
+                sockaddr_un address{};
+                address.sun_family = AF_UNIX;
+                if(configuration.unixSocketPath.size() >= sizeof(address.sun_path)) throw std::runtime_error("Unix socket path too long");
+                strcpy(address.sun_path, configuration.unixSocketPath.c_str());
+                unlink(address.sun_path); // Left over from a server that did not shut down
+                listenOn(socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), (sockaddr*)&address, sizeof(address), configuration.unixSocketPath);
+            }
+            if(configuration.tcpPort >= 0){
+                sockaddr_in address{};
+                address.sin_family = AF_INET;
+                address.sin_port = htons(configuration.tcpPort);
+                if(inet_pton(AF_INET, configuration.tcpAddress.c_str(), &address.sin_addr) != 1) throw std::runtime_error("Bad TCP address " + configuration.tcpAddress);
+                int fd = listenOn(socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), (sockaddr*)&address, sizeof(address), "tcp");
+                socklen_t length = sizeof(address);
+                getsockname(fd, (sockaddr*)&address, &length);
+                boundTcpPort = ntohs(address.sin_port);
+            }
+            if(listeners.empty()) throw std::runtime_error("Decision server needs a Unix socket path or a TCP port");
+            int loopCount = configuration.eventLoops > 0 ? configuration.eventLoops : max(1u, thread::hardware_concurrency());
+            for(int i = 0; i < loopCount; i++){
+                auto loop = make_unique<EventLoop>();
+                loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+                loop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if(loop->epollFd < 0 || loop->wakeFd < 0) fail("epoll");
+                for(int fd : listeners){
+                    epoll_event event{EPOLLIN | EPOLLEXCLUSIVE, {.fd = fd}};
+                    epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event);
+                }
+                epoll_event wake{EPOLLIN, {.fd = loop->wakeFd}};
+                epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakeFd, &wake);
+                loops.push_back(std::move(loop));
+            }
+        }catch(...){
+            stop();
+            throw;
+        }
+        for(auto& loop : loops) loop->worker = thread([this, loop = loop.get()]() { run(*loop); });
+    }
+    ~DecisionServer() { stop(); }
+    DecisionServer(const DecisionServer&) = delete;
+    DecisionServer& operator=(const DecisionServer&) = delete;
+
+    // Port the TCP listener got (useful with tcpPort 0), or -1 without one
+    int tcpPort() const { return boundTcpPort; }
+    int eventLoopCount() const { return loops.size(); }
+    uint64_t decisionCount() const {
+        uint64_t total = 0;
+        for(auto& loop : loops) total += loop->decisions.load(memory_order_relaxed);
+        return total;
+    }
+    // Stops every loop and closes all connections; requests not yet answered are dropped
+    void stop() {
+        for(auto& loop : loops){
+            if(loop->worker.joinable()){
+                uint64_t one = 1;
+                if(write(loop->wakeFd, &one, sizeof(one)) < 0) {} // Nothing to do if the eventfd is gone
+                loop->worker.join();
+            }
+            for(auto& [fd, connection] : loop->connections) close(fd);
+            loop->connections.clear();
+            if(loop->epollFd >= 0) close(loop->epollFd);
+            if(loop->wakeFd >= 0) close(loop->wakeFd);
+        }
+        loops.clear();
+        for(int fd : listeners) close(fd);
+        listeners.clear();
+        if(!configuration.unixSocketPath.empty()) unlink(configuration.unixSocketPath.c_str());
+    }
+};
+
+struct DecisionResponse {
+    uint32_t requestId;
+    uint8_t status;
+    DecisionBitmap decisions;
+};
+
+// Blocking client of the decision server; also the reference for clients in other languages.
+// Requests are queued by send() and go out together on flush(), so a caller pipelines by sending
+// several before reading their responses.
+class DecisionClient {
+    int fd = -1;
+    string input;
+    string output;
+
+    DecisionClient(int fd) : fd(fd) {}
+    static DecisionClient connectTo(int fd, const sockaddr* address, socklen_t addressLength, const string& name) {
+        if(fd < 0 || ::connect(fd, address, addressLength) != 0){
+            string error = strerror(errno);
+            if(fd >= 0) close(fd);
+            throw std::runtime_error("connect " + name + ": " + error);
+        }
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        return DecisionClient(fd);
+    }
+public:
+    static DecisionClient unixSocket(const string& path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+        return connectTo(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0), (sockaddr*)&address, sizeof(address), path);
+    }
+    static DecisionClient tcp(const string& host, int port) {
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        inet_pton(AF_INET, host.c_str(), &address.sin_addr);
+        return connectTo(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0), (sockaddr*)&address, sizeof(address), host + ":" + to_string(port));
+    }
+    DecisionClient(DecisionClient&& other) : fd(exchange(other.fd, -1)), input(std::move(other.input)), output(std::move(other.output)) {}
+    ~DecisionClient() { if(fd >= 0) close(fd); }
+
+    void send(uint32_t requestId, UserTier tier, span<const string> userIds, span<const int> costs = {}) {
+        DecisionProtocol::appendRequest(output, requestId, tier, userIds, costs);
+    }
+    // Raw bytes, e.g. to test how the server treats a malformed frame
+    void sendBytes(string_view bytes) { output.append(bytes); }
+    void flush() {
+        for(size_t written = 0; written < output.size(); ){
+            ssize_t sent = ::send(fd, output.data() + written, output.size() - written, MSG_NOSIGNAL);
+            if(sent < 0 && errno == EINTR) continue;
+            if(sent <= 0) throw std::runtime_error(string("send: ") + strerror(errno));
+            written += sent;
+        }
+        output.clear();
+    }
+    // Next response, in request order; throws if the server closed the connection
+    DecisionResponse receive() {
+        uint32_t length = 0;
+        while(true){
+            if(input.size() >= sizeof(uint32_t)){
+                memcpy(&length, input.data(), sizeof(uint32_t));
+                if(input.size() >= sizeof(uint32_t) + length) break;
+            }
+            char buffer[1 << 16];
+            ssize_t got = read(fd, buffer, sizeof(buffer));
+            if(got < 0 && errno == EINTR) continue;
+            if(got <= 0) throw std::runtime_error("decision server closed the connection");
+            input.append(buffer, got);
+        }
+        string_view frame = string_view(input).substr(sizeof(uint32_t), length);
+        uint32_t requestId = takeField<uint32_t>(frame);
+        uint8_t status = takeField<uint8_t>(frame);
+        takeField<uint8_t>(frame);
+        size_t count = takeField<uint16_t>(frame);
+        DecisionBitmap decisions(count);
+        for(size_t i = 0; i < count && i / 8 < frame.size(); i++){
+            if(((uint8_t)frame[i / 8] >> (i % 8)) & 1) decisions.set(i);
+        }
+        input.erase(0, sizeof(uint32_t) + length);
+        return {requestId, status, std::move(decisions)};
+    }
+};
+
+// Access log for replay, one request per line: "<timestamp> <key> <tier>", where timestamp is in
+// seconds with up to 9 decimals, key is any token without whitespace and tier is a tier name or
+// number. Blank lines and lines starting with '#' are skipped. The file is memory-mapped and
+// parsed as it is walked, so a trace costs nothing beyond the page cache, however large.
+class AccessTrace {
+    const char* file = nullptr;
+    size_t bytes = 0;
+
+    static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+    // Next whitespace-separated field of [at, end), or an empty view
+    static string_view field(const char*& at, const char* end) {
+        while(at < end && isSpace(*at)) at++;
+        const char* start = at;
+        while(at < end && !isSpace(*at)) at++;
+        return {start, (size_t)(at - start)};
+    }
+    // Seconds with up to 9 decimals, in one pass over the digits
+    static optional<long long> parseNanos(string_view text) {
+        long long seconds = 0, fraction = 0;
+        int wholeDigits = 0, decimals = -1; // Digits after the '.', -1 before it
+        for(char c : text){
+            if(c == '.' && decimals < 0){
+                decimals = 0;
+            }else if(c < '0' || c > '9' || decimals >= 9 || (decimals < 0 && ++wholeDigits > 10)){
+                return nullopt;
+            }else if(decimals < 0){
+                seconds = seconds * 10 + (c - '0');
+            }else{
+                fraction = fraction * 10 + (c - '0');
+                decimals++;
+            }
+        }
+        if(wholeDigits == 0 || seconds >= LLONG_MAX / 1000000000) return nullopt; // Nanoseconds would overflow
+        for(int digits = max(decimals, 0); digits < 9; digits++) fraction *= 10;
+        return seconds * 1000000000 + fraction;
+    }
+    static optional<UserTier> parseTier(string_view text) {
+        static constexpr string_view tierNames[kUserTierCount] = {"Free", "Premium", "Enterprise"};
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            if(text == tierNames[tier] || (text.size() == 1 && text[0] == '0' + tier)) return (UserTier)tier;
+        }
+        return nullopt;
+    }
+public:
+    struct Request {
+        long long nanos;
+        string_view key; // Points into the mapped file
+        UserTier tier;
+    };
+    explicit AccessTrace(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0) throw std::runtime_error("Cannot open trace " + path);
+        struct stat info;
+        if(fstat(fd, &info) != 0){
+            close(fd);
+            throw std::runtime_error("Cannot stat trace " + path);
+        }
+        bytes = info.st_size;
+        if(bytes > 0){
+            void* mapping = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+            if(mapping == MAP_FAILED){
+                close(fd);
+                throw std::runtime_error("mmap " + path + ": " + strerror(errno));
+            }
+            madvise(mapping, bytes, MADV_WILLNEED); // Start reading ahead now
+            file = (const char*)mapping;
+        }
+        close(fd);
+    }
+    ~AccessTrace() { if(file) munmap((void*)file, bytes); }
+    AccessTrace(const AccessTrace&) = delete;
+    AccessTrace& operator=(const AccessTrace&) = delete;
+    size_t size() const { return bytes; }
+    // Offset of the first line that starts at or after offset, so the file can be cut into
+    // pieces [lineStart(a), lineStart(b)) that hold whole lines and are parsed independently
+    size_t lineStart(size_t offset) const {
+        if(offset == 0 || offset >= bytes) return min(offset, bytes);
+        const char* newline = (const char*)memchr(file + offset - 1, '\n', bytes - offset + 1);
+        return newline ? newline + 1 - file : bytes;
+    }
+    // Calls fn(request) for every well-formed line in [begin, end) (both line starts) in file order,
+    // until an fn returning bool says false; returns how many malformed lines were skipped
+    template<typename Fn>
+    uint64_t forEach(Fn fn, size_t begin = 0, size_t end = SIZE_MAX) const {
+        uint64_t malformed = 0;
+        const char* last = file + min(end, bytes);
+        for(const char* line = file + begin; line < last; ){
+            const char* lineEnd = (const char*)memchr(line, '\n', last - line);
+            if(lineEnd == nullptr) lineEnd = last;
+            const char* at = line;
+            string_view timestamp = field(at, lineEnd);
+            if(!timestamp.empty() && timestamp[0] != '#'){
+                string_view key = field(at, lineEnd), tierName = field(at, lineEnd);
+                optional<long long> nanos = parseNanos(timestamp);
+                optional<UserTier> tier = parseTier(tierName);
+                if(!nanos || key.empty() || !tier || !field(at, lineEnd).empty()){
+                    malformed++;
+                }else if constexpr (is_same_v<invoke_result_t<Fn&, const Request&>, bool>) {
+                    if(!fn(Request{*nanos, key, *tier})) break;
+                }else{
+                    fn(Request{*nanos, key, *tier});
+                }
+            }
+            line = lineEnd + 1;
+        }
+        return malformed;
+    }
+    optional<long long> firstRequestNanos() const {
+        optional<long long> first;
+        forEach([&](const Request& request) {
+            first = request.nanos;
+            return false;
+        });
+        return first;
+    }
+};
+
+// Replays an AccessTrace through limiter algorithms on virtual clocks, as fast as they decide.
+// Parser threads cut the mapped file into chunks of whole lines and parse them into a ring of
+// blocks, which the replay threads then decide in trace order; a block is reused once every
+// replay thread is done with it, so memory stays flat however long the trace.
+// Each algorithm's keys are split into partitions by hash, one thread each with its own clock
+// and one limiter per tier: a key's decisions only depend on its own requests and their times,
+// so they come out the same as in one limiter. CountMinSketch is the exception (keys share its
+// counters) and always runs as a single partition.
+// Clock time only moves forward: a line older than the one before it is decided at the later time.
+class TraceReplay {
+public:
+    struct TierResult {
+        uint64_t requests = 0;
+        uint64_t allowed = 0;
+        int worstWindow = 0; // Most requests one key had admitted within any one window
+        uint64_t keysOverLimit = 0; // Keys admitted more than maxRequests within some window
+        size_t peakStateBytes = 0; // Summed over partitions, each at its own peak
+    };
+    struct AlgorithmResult {
+        RateLimiterType type;
+        array<TierResult, kUserTierCount> tiers;
+        double cpuSeconds = 0; // Summed over the algorithm's replay threads
+    };
+private:
+    static constexpr size_t kChunkBytes = 1 << 21;
+    static constexpr uint64_t kStateSampleEvery = 1 << 20; // Requests between state size samples, per replay thread
+    const AccessTrace& trace;
+    array<RateLimiterConfiguration, kUserTierCount> limits;
+    int partitions;
+    int parsers;
+    uint64_t malformed = 0;
+    size_t algorithmCount = 0;
+    // Requests two algorithms decided alike, per tier: [tier][a * algorithmCount + b]
+    array<vector<uint64_t>, kUserTierCount> agreed;
+    array<uint64_t, kUserTierCount> tierRequests{};
+
+    struct Block {
+        static constexpr uint64_t kEmpty = UINT64_MAX;
+        static constexpr uint64_t kClaimed = UINT64_MAX - 1; // A parser is filling it
+        uint64_t chunk = kEmpty; // Chunk it holds, once parsed
+        vector<AccessTrace::Request> requests;
+        vector<uint8_t> partitions;
+        vector<vector<uint8_t>> decisions; // [algorithm][request]
+        atomic<size_t> pendingReaders{0};
+    };
+    // Admission times of one key within the last window, to find bursts past the limit
+    struct AdmissionLog {
+        vector<long long> times;
+        size_t head = 0; // times before head have left the window
+        bool overLimit = false;
+    };
+    // One partition of one algorithm: a limiter per tier on a shared virtual clock
+    class Replayer {
+        const TraceReplay& replay;
+        AlgorithmResult result;
+        shared_ptr<ManualClock> clock;
+        array<unique_ptr<RateLimiter>, kUserTierCount> limiters;
+        array<long long, kUserTierCount> windows;
+        array<FlatHashMap<AdmissionLog>, kUserTierCount> admissions;
+        long long now;
+        uint64_t replayed = 0;
+
+        void admitted(int tier, string_view key) {
+            TierResult& tierResult = result.tiers[tier];
+            AdmissionLog& log = *admissions[tier].findOrInsert(hashUserId(key), key).first;
+            log.times.push_back(now);
+            while(now - log.times[log.head] > windows[tier]) log.head++; // Same window edge as SlidingWindow
+            int inWindow = log.times.size() - log.head;
+            tierResult.worstWindow = max(tierResult.worstWindow, inWindow);
+            if(inWindow > replay.limits[tier].maxRequests && !log.overLimit){
+                log.overLimit = true;
+                tierResult.keysOverLimit++;
+            }
+            if(log.head > 64 && log.head * 2 > log.times.size()){
+                log.times.erase(log.times.begin(), log.times.begin() + log.head);
+                log.head = 0;
+            }
+        }
+        void sampleState() {
+            for(int tier = 0; tier < kUserTierCount; tier++) result.tiers[tier].peakStateBytes = max(result.tiers[tier].peakStateBytes, limiters[tier]->stateBytes());
+        }
+    public:
+        Replayer(const TraceReplay& replay, RateLimiterType type, long long startNanos) : replay(replay), clock(make_shared<ManualClock>(startNanos)), now(startNanos) {
+            result.type = type;
+            for(int tier = 0; tier < kUserTierCount; tier++){
+                limiters[tier].reset(RateLimiterFactory::createRateLimiter(type, replay.limits[tier], clock));
+                windows[tier] = chrono::duration_cast<chrono::nanoseconds>(chrono::seconds(replay.limits[tier].timeWindowSeconds)).count();
+            }
+        }
+        bool decide(const AccessTrace::Request& request) {
+            if(request.nanos > now){
+                now = request.nanos;
+                clock->set(now);
+            }
+            int tier = (int)request.tier;
+            bool allowed = limiters[tier]->allowRequest(request.key);
+            result.tiers[tier].requests++;
+            if(allowed){
+                result.tiers[tier].allowed++;
+                admitted(tier, request.key);
+            }
+            if(++replayed % kStateSampleEvery == 0) sampleState();
+            return allowed;
+        }
+        AlgorithmResult finish() {
+            sampleState();
+            return std::move(result);
+        }
+    };
+    static double threadCpuSeconds() {
+        timespec time;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+        return time.tv_sec + time.tv_nsec * 1e-9;
+    }
+    // Adds a fully decided block to the agreement counts. Called by the block's last reader: each
+    // request's decisions become one bit per algorithm, and pairs are only compared per distinct pattern.
+    void tally(const Block& block, size_t algorithms, mutex& resultsMutex) {
+        array<unordered_map<uint64_t, uint64_t>, kUserTierCount> patterns; // Decision pattern -> requests
+        for(size_t i = 0; i < block.requests.size(); i++){
+            uint64_t pattern = 0;
+            for(size_t a = 0; a < algorithms; a++) pattern |= (uint64_t)block.decisions[a][i] << a;
+            patterns[(int)block.requests[i].tier][pattern]++;
+        }
+        lock_guard<mutex> lock(resultsMutex);
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            for(auto& [pattern, count] : patterns[tier]){
+                tierRequests[tier] += count;
+                for(size_t a = 0; a < algorithms; a++){
+                    for(size_t b = 0; b < algorithms; b++) agreed[tier][a * algorithms + b] += ((pattern >> a ^ pattern >> b) & 1) ? 0 : count;
+                }
+            }
+        }
+    }
+public:
+    // partitions and parsers default to splitting the machine's cores between the algorithms
+    TraceReplay(const AccessTrace& trace, array<RateLimiterConfiguration, kUserTierCount> limits, int partitions = 0, int parsers = 0)
+        : trace(trace), limits(limits), partitions(partitions), parsers(parsers) {}
+    // Replays the whole trace once through each algorithm, all of them concurrently
+    vector<AlgorithmResult> run(const vector<RateLimiterType>& types) {
+        int cores = max(1u, thread::hardware_concurrency());
+        int parserCount = parsers > 0 ? parsers : max(1, cores / 8);
+        int partitionCount = clamp(partitions > 0 ? partitions : (cores - parserCount) / (int)types.size(), 1, 255);
+        long long startNanos = trace.firstRequestNanos().value_or(0); // The limiters' clocks start at the first request
+        size_t algorithms = algorithmCount = types.size();
+        if(algorithms > 64) throw std::invalid_argument("At most 64 algorithms per replay");
+        for(auto& counts : agreed) counts.assign(algorithms * algorithms, 0);
+        tierRequests = {};
+        uint64_t chunks = (trace.size() + kChunkBytes - 1) / kChunkBytes;
+        vector<Block> blocks(4 * parserCount + 4);
+        for(Block& block : blocks) block.decisions.resize(algorithms);
+        mutex blocksMutex, resultsMutex;
+        condition_variable blocksChanged;
+        uint64_t nextChunk = 0;
+        atomic<uint64_t> malformedLines{0};
+
+        vector<thread> parserThreads;
+        for(int p = 0; p < parserCount; p++){
+            parserThreads.emplace_back([&]() {
+                while(true){
+                    uint64_t chunk;
+                    Block* block;
+                    {
+                        unique_lock<mutex> lock(blocksMutex);
+                        if(nextChunk == chunks) return;
+                        chunk = nextChunk++;
+                        block = &blocks[chunk % blocks.size()];
+                        // Its previous chunk must have been read by every replay thread, and no other
+                        // parser may still be filling it (with chunk - blocks.size(), if replay stalls)
+                        blocksChanged.wait(lock, [&]() { return block->chunk == Block::kEmpty; });
+                        block->chunk = Block::kClaimed;
+                    }
+                    block->requests.clear();
+                    block->partitions.clear();
+                    malformedLines += trace.forEach([&](const AccessTrace::Request& request) {
+                        block->requests.push_back(request);
+                        block->partitions.push_back((hashUserId(request.key) >> 40) % partitionCount);
+                    }, trace.lineStart(chunk * kChunkBytes), trace.lineStart((chunk + 1) * kChunkBytes));
+                    for(auto& decisions : block->decisions) decisions.resize(block->requests.size());
+                    {
+                        lock_guard<mutex> lock(blocksMutex);
+                        block->pendingReaders.store(0, memory_order_relaxed);
+                        block->chunk = chunk;
+                    }
+                    blocksChanged.notify_all();
+                }
+            });
+        }
+
+        vector<AlgorithmResult> partitionResults(algorithms * partitionCount);
+        vector<thread> replayThreads;
+        // Counted up front: a block is released by whichever of them reads it last
+        size_t readers = 0;
+        for(RateLimiterType type : types) readers += type == RateLimiterType::CountMinSketch ? 1 : partitionCount;
+        for(size_t a = 0; a < algorithms; a++){
+            int algorithmPartitions = types[a] == RateLimiterType::CountMinSketch ? 1 : partitionCount;
+            for(int partition = 0; partition < algorithmPartitions; partition++){
+                replayThreads.emplace_back([&, a, partition, algorithmPartitions]() {
+                    double cpuStart = threadCpuSeconds();
+                    Replayer replayer(*this, types[a], startNanos);
+                    for(uint64_t chunk = 0; chunk < chunks; chunk++){
+                        Block& block = blocks[chunk % blocks.size()];
+                        {
+                            unique_lock<mutex> lock(blocksMutex);
+                            blocksChanged.wait(lock, [&]() { return block.chunk == chunk; });
+                        }
+                        vector<uint8_t>& decisions = block.decisions[a];
+                        for(size_t i = 0; i < block.requests.size(); i++){
+                            if(algorithmPartitions == 1 || block.partitions[i] == partition) decisions[i] = replayer.decide(block.requests[i]);
+                        }
+                        if(block.pendingReaders.fetch_add(1, memory_order_acq_rel) + 1 == readers){
+                            tally(block, algorithms, resultsMutex);
+                            {
+                                lock_guard<mutex> lock(blocksMutex);
+                                block.chunk = Block::kEmpty;
+                            }
+                            blocksChanged.notify_all();
+                        }
+                    }
+                    AlgorithmResult result = replayer.finish();
+                    result.cpuSeconds = threadCpuSeconds() - cpuStart;
+                    partitionResults[a * partitionCount + partition] = std::move(result);
+                });
+            }
+        }
+        for(thread& parser : parserThreads) parser.join();
+        for(thread& replayThread : replayThreads) replayThread.join();
+        malformed = malformedLines;
+
+        vector<AlgorithmResult> results(algorithms);
+        for(size_t a = 0; a < algorithms; a++){
+            results[a].type = types[a];
+            for(int partition = 0; partition < partitionCount; partition++){
+                const AlgorithmResult& part = partitionResults[a * partitionCount + partition];
+                results[a].cpuSeconds += part.cpuSeconds;
+                for(int tier = 0; tier < kUserTierCount; tier++){
+                    TierResult& total = results[a].tiers[tier];
+                    total.requests += part.tiers[tier].requests;
+                    total.allowed += part.tiers[tier].allowed;
+                    total.worstWindow = max(total.worstWindow, part.tiers[tier].worstWindow);
+                    total.keysOverLimit += part.tiers[tier].keysOverLimit;
+                    total.peakStateBytes += part.tiers[tier].peakStateBytes;
+                }
+            }
+        }
+        return results;
+    }
+    uint64_t malformedLines() const { return malformed; }
+    // Fraction of the tier's requests that algorithms a and b (indices into run's types) decided alike
+    double agreement(int tier, size_t a, size_t b) const {
+        return tierRequests[tier] == 0 ? 1 : (double)agreed[tier][a * algorithmCount + b] / tierRequests[tier];
+    }
+};
@@ -0,0 +1,1622 @@
+// Benchmarks and checks, one per mode: ./benchmarks <mode> [arguments]. Build with make benchmarks
+// (make benchmarks-nostats for the same without instrumentation); make check runs the quick checks.
+#include "RateLimiter.h"
+
+// Benchmarks never touch the factory's host-wide segments, which live workers may be using: a
+// shared-memory limiter gets this process's own segment, emptied for every new limiter
+string benchmarkSegmentName() { return "/rate-limiter-bench-" + to_string(getpid()); }
+unique_ptr<RateLimiter> createBenchmarkLimiter(RateLimiterType type, RateLimiterConfiguration config, shared_ptr<Clock> clock = nullptr) {
+    if(type == RateLimiterType::SharedMemoryTokenBucket){
+        SharedMemoryTokenBucketRateLimiter<>::removeSegment(benchmarkSegmentName());
+        return make_unique<SharedMemoryTokenBucketRateLimiter<>>(benchmarkSegmentName(), 1 << 18, config, clock);
+    }
+    return unique_ptr<RateLimiter>(RateLimiterFactory::createRateLimiter(type, config, clock));
+}
+
+// Resident set size in bytes, used to estimate per-key state memory (Linux only, 0 elsewhere)
+size_t residentBytes() {
+    ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    if(!(statm >> pages >> resident)) return 0;
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// How much resident memory grew while work ran. Keep what earlier measurements built alive until
+// the last one is done, or this one's growth hides in the pages they freed.
+size_t measureResidentGrowth(const function<void()>& work) {
+#ifdef __GLIBC__
+    malloc_trim(0); // Return freed pages to the system first, for the same reason
+#endif
+    size_t before = residentBytes();
+    work();
+    size_t after = residentBytes();
+    return after > before ? after - before : 0;
+}
+
+// Runs work(0..threads-1) on that many threads at once; returns the seconds until all are done
+double timeThreads(int threads, const function<void(int)>& work) {
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now();
+    for(int t = 0; t < threads; t++) workers.emplace_back(work, t);
+    for(thread& worker : workers) worker.join();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Folds a check into passed, and gives the mark that ends its report line
+const char* verdict(bool& passed, bool ok) {
+    passed = passed && ok;
+    return ok ? " PASS" : " FAIL";
+}
+
+// Multi-threaded throughput benchmark: every thread drives its own set of users,
+// so with enough shards the decisions should scale close to linearly with threads
+void runShardingBenchmark() {
+    const int usersPerThread = 1000;
+    const int requestsPerThread = 200000;
+    int maxThreads = max(1u, thread::hardware_concurrency());
+    vector<pair<string, UserTier>> limiters = {
+        {"FixedWindow", UserTier::Free}, {"TokenBucket", UserTier::Premium}, {"SlidingWindow", UserTier::Enterprise}
+    };
+    for(auto& [name, tier] : limiters){
+        for(int shards : {1, 64}){
+            for(int threads = 1; threads <= maxThreads; threads *= 2){
+                unique_ptr<RateLimiter> limiter(RateLimiterFactory::createRateLimiter(tier, RateLimiterConfiguration(1000000, 60, shards)));
+                double seconds = timeThreads(threads, [&](int t) {
+                    vector<string> users;
+                    for(int u = 0; u < usersPerThread; u++) users.push_back("t" + to_string(t) + "-user" + to_string(u));
+                    for(int i = 0; i < requestsPerThread; i++) limiter->allowRequest(users[i % usersPerThread]);
+                });
+                cout << name << " shards=" << shards << " threads=" << threads
+                     << " decisions/sec=" << (long long)(threads * (double)requestsPerThread / seconds) << endl;
+            }
+        }
+    }
+}
+
+// Single-threaded key-count scaling: cost per decision and memory per tracked user
+// once every user is known, for 10k, 1M and 10M distinct users
+void runKeyScalingBenchmark() {
+    vector<pair<string, RateLimiterType>> limiters = {
+        {"TokenBucket", RateLimiterType::TokenBucket}, {"FixedWindow", RateLimiterType::FixedWindow}
+    };
+    for(int keys : {10000, 1000000, 10000000}){
+        vector<string> users;
+        users.reserve(keys);
+        for(int u = 0; u < keys; u++) users.push_back("user" + to_string(u));
+        vector<int> order(keys);
+        iota(order.begin(), order.end(), 0);
+        shuffle(order.begin(), order.end(), mt19937(42));
+        vector<unique_ptr<RateLimiter>> alive;
+        for(auto& [name, type] : limiters){
+            size_t growth = measureResidentGrowth([&]() {
+                alive.emplace_back(RateLimiterFactory::createRateLimiter(type, RateLimiterConfiguration(1000000, 60)));
+                for(int u = 0; u < keys; u++) alive.back()->allowRequest(users[u]);
+            });
+            RateLimiter* limiter = alive.back().get();
+            long long decisions = max(keys, 2000000);
+            auto start = chrono::steady_clock::now();
+            for(long long i = 0; i < decisions; i++) limiter->allowRequest(users[order[i % keys]]);
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << name << " keys=" << keys << " ns/decision=" << (seconds * 1e9 / decisions)
+                 << " bytes/key=" << growth / keys << endl;
+        }
+    }
+}
+
+// Sliding window counter vs. sliding window log.
+// Memory: Enterprise-sized quota (1000 per window) with every user's log full.
+// Accuracy: both limiters see the same stream of requests arriving at ~1.5x the limit over a
+// few 1-second windows; reports how often their decisions agree and how much each admitted.
+void runSlidingWindowCounterBenchmark() {
+    const int users = 10000;
+    const int maxRequests = 1000;
+    vector<string> userIds;
+    for(int u = 0; u < users; u++) userIds.push_back("user" + to_string(u));
+    vector<unique_ptr<RateLimiter>> alive;
+    for(RateLimiterType type : {RateLimiterType::SlidingWindow, RateLimiterType::SlidingWindowCounter}){
+        size_t growth = measureResidentGrowth([&]() {
+            alive.emplace_back(RateLimiterFactory::createRateLimiter(type, RateLimiterConfiguration(maxRequests, 60)));
+            for(int u = 0; u < users; u++){
+                for(int i = 0; i < maxRequests; i++) alive.back()->allowRequest(userIds[u]);
+            }
+        });
+        cout << (type == RateLimiterType::SlidingWindow ? "SlidingWindow" : "SlidingWindowCounter")
+             << " users=" << users << " maxRequests=" << maxRequests << " bytes/user=" << growth / users << endl;
+    }
+
+    const int accuracyUsers = 50;
+    const int limitPerSecond = 100;
+    const auto interval = chrono::microseconds(1000000 / (accuracyUsers * limitPerSecond * 3 / 2));
+    // Simulated time: both limiters see the same instants, and the 4 seconds take no wall time
+    auto clock = make_shared<ManualClock>();
+    SlidingWindowRateLimiter logLimiter(RateLimiterConfiguration(limitPerSecond, 1), clock);
+    SlidingWindowCounterRateLimiter counterLimiter(RateLimiterConfiguration(limitPerSecond, 1), clock);
+    mt19937 rng(7);
+    long long requests = 0, agreed = 0, logAllowed = 0, counterAllowed = 0;
+    for(auto elapsed = chrono::microseconds(0); elapsed < chrono::seconds(4); elapsed += interval){
+        clock->advance(interval);
+        const string& userId = userIds[rng() % accuracyUsers];
+        bool byLog = logLimiter.allowRequest(userId);
+        bool byCounter = counterLimiter.allowRequest(userId);
+        requests++;
+        agreed += byLog == byCounter;
+        logAllowed += byLog;
+        counterAllowed += byCounter;
+    }
+    cout << "accuracy requests=" << requests << " agreement=" << (100.0 * agreed / requests) << "%"
+         << " allowed(log)=" << logAllowed << " allowed(counter)=" << counterAllowed << endl;
+}
+
+// Churning users: every request comes from a user never seen before, on a 1-second window.
+// Without eviction the live-key count would grow by the request rate forever; with it, it should
+// level off at a few seconds' worth of users while the eviction rate catches up to the arrival rate.
+void runIdleEvictionBenchmark() {
+    const int seconds = 6;
+    const int newUsersPerSecond = 200000;
+    vector<pair<string, RateLimiterType>> limiters = {
+        {"TokenBucket", RateLimiterType::TokenBucket}, {"FixedWindow", RateLimiterType::FixedWindow},
+        {"SlidingWindow", RateLimiterType::SlidingWindow}, {"SlidingWindowCounter", RateLimiterType::SlidingWindowCounter},
+        {"LockFreeTokenBucket", RateLimiterType::LockFreeTokenBucket}
+    };
+    for(auto& [name, type] : limiters){
+        unique_ptr<RateLimiter> limiter(RateLimiterFactory::createRateLimiter(type, RateLimiterConfiguration(10, 1)));
+        long long userCounter = 0;
+        uint64_t lastEvicted = 0;
+        auto start = chrono::steady_clock::now();
+        for(int second = 1; second <= seconds; second++){
+            auto end = start + chrono::seconds(second);
+            long long requests = 0;
+            while(requests < newUsersPerSecond && chrono::steady_clock::now() < end){
+                limiter->allowRequest("anon" + to_string(userCounter++));
+                requests++;
+            }
+            this_thread::sleep_until(end);
+            KeyStats stats = limiter->keyStats();
+            cout << name << " t=" << second << "s liveKeys=" << stats.liveKeys
+                 << " evictions/sec=" << (stats.evictedKeys - lastEvicted) << endl;
+            lastEvicted = stats.evictedKeys;
+        }
+    }
+}
+
+// Per-decision cost of the batch API at gateway-sized batches, compared with one allowRequest call
+// per request, by user id and by pre-resolved KeyHandle
+void runBatchBenchmark() {
+    const int users = 10000;
+    const int decisions = 2000000;
+    vector<string> userIds;
+    for(int u = 0; u < users; u++) userIds.push_back("user" + to_string(u));
+    vector<int> streamUsers(decisions);
+    vector<string> stream(decisions);
+    mt19937 rng(3);
+    for(int i = 0; i < decisions; i++) stream[i] = userIds[streamUsers[i] = rng() % users];
+    vector<pair<string, RateLimiterType>> limiters = {
+        {"TokenBucket", RateLimiterType::TokenBucket}, {"FixedWindow", RateLimiterType::FixedWindow},
+        {"SlidingWindow", RateLimiterType::SlidingWindow}, {"SlidingWindowCounter", RateLimiterType::SlidingWindowCounter},
+        {"LockFreeTokenBucket", RateLimiterType::LockFreeTokenBucket}
+    };
+    for(auto& [name, type] : limiters){
+        for(int batchSize : {-1, 0, 1, 8, 64, 256, 512}){ // -1 = KeyHandle per user, 0 = single-request API
+            unique_ptr<RateLimiter> limiter(RateLimiterFactory::createRateLimiter(type, RateLimiterConfiguration(1000000, 60)));
+            vector<KeyHandle> handles(userIds.begin(), userIds.end());
+            for(KeyHandle& handle : handles) limiter->allowRequest(handle); // Every user known before timing
+            size_t allowed = 0;
+            auto start = chrono::steady_clock::now();
+            if(batchSize == -1){
+                for(int user : streamUsers) allowed += limiter->allowRequest(handles[user]);
+            }else if(batchSize == 0){
+                for(const string& userId : stream) allowed += limiter->allowRequest(userId);
+            }else{
+                for(size_t i = 0; i < stream.size(); i += batchSize){
+                    span<const string> batch(stream.data() + i, min<size_t>(batchSize, stream.size() - i));
+                    allowed += limiter->allowRequests(batch).count();
+                }
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << name << (batchSize == -1 ? " handle" : batchSize == 0 ? " single" : " batch=" + to_string(batchSize))
+                 << " ns/decision=" << (seconds * 1e9 / decisions) << " allowed=" << allowed << endl;
+        }
+    }
+}
+
+// Cost of one clock read, and per-decision cost of each limiter on the precise clock vs a 1ms coarse clock
+void runClockBenchmark() {
+    const int users = 10000;
+    const int decisions = 2000000;
+    vector<pair<string, shared_ptr<Clock>>> clocks = {
+        {"Monotonic", Clock::monotonic()}, {"Coarse1ms", make_shared<CoarseClock>(chrono::microseconds(1000))}
+    };
+    for(auto& [clockName, clock] : clocks){
+        volatile long long sink = 0; // Keeps the reads from being optimized away
+        auto start = chrono::steady_clock::now();
+        for(int i = 0; i < decisions; i++) sink = clock->nowNanos();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << clockName << " ns/read=" << (seconds * 1e9 / decisions) << endl;
+        (void)sink;
+    }
+    vector<string> userIds;
+    for(int u = 0; u < users; u++) userIds.push_back("user" + to_string(u));
+    vector<KeyHandle> handles(userIds.begin(), userIds.end());
+    mt19937 rng(5);
+    vector<int> streamUsers(decisions);
+    for(int& user : streamUsers) user = rng() % users;
+    for(RateLimiterType type : {RateLimiterType::TokenBucket, RateLimiterType::FixedWindow, RateLimiterType::SlidingWindow,
+                                RateLimiterType::SlidingWindowCounter, RateLimiterType::LockFreeTokenBucket, RateLimiterType::GCRA}){
+        for(auto& [clockName, clock] : clocks){
+            unique_ptr<RateLimiter> limiter(RateLimiterFactory::createRateLimiter(type, RateLimiterConfiguration(1000000, 60), clock));
+            for(KeyHandle& handle : handles) limiter->allowRequest(handle);
+            size_t allowed = 0;
+            auto start = chrono::steady_clock::now();
+            for(int user : streamUsers) allowed += limiter->allowRequest(handles[user]);
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << rateLimiterTypeName(type) << " clock=" << clockName
+                 << " ns/decision=" << (seconds * 1e9 / decisions) << " allowed=" << allowed << endl;
+        }
+    }
+}
+
+enum class KeyDistribution {
+    Uniform, // Every user equally likely
+    Zipfian, // A few hot users take most requests (s = 0.99)
+    Churning // A moving range of users: old ones go idle, new ones keep arriving
+};
+
+// Pre-generates one thread's request stream so key generation stays out of the timed loop
+vector<string> generateKeyStream(KeyDistribution distribution, int keyCount, int length, int thread) {
+    mt19937_64 rng(1000 + thread);
+    vector<string> stream(length);
+    if(distribution == KeyDistribution::Zipfian){
+        static map<int, vector<double>> cdfs; // Shared across threads: built before the workers start
+        vector<double>& cdf = cdfs[keyCount];
+        if(cdf.empty()){
+            double sum = 0;
+            for(int k = 1; k <= keyCount; k++) cdf.push_back(sum += 1.0 / pow(k, 0.99));
+            for(double& c : cdf) c /= sum;
+        }
+        uniform_real_distribution<double> uniform(0, 1);
+        for(string& key : stream) key = "user" + to_string(lower_bound(cdf.begin(), cdf.end(), uniform(rng)) - cdf.begin());
+    }else if(distribution == KeyDistribution::Churning){
+        // The active range slides forward by one user every 4 requests
+        for(int i = 0; i < length; i++) stream[i] = "t" + to_string(thread) + "-user" + to_string(i / 4 + rng() % keyCount);
+    }else{
+        for(string& key : stream) key = "user" + to_string(rng() % keyCount);
+    }
+    return stream;
+}
+
+// Benchmark suite used to accept or reject limiter changes: every limiter type, 1..maxThreads
+// threads, uniform / Zipfian / churning users at several key counts. Reports throughput,
+// p50/p99/p999 decision latency (every 16th decision is timed) and resident bytes per tracked user.
+void runBenchmarkSuite(int maxThreads, int decisionsPerThread) {
+    const char* distributionNames[] = {"uniform", "zipfian", "churning"};
+    const int latencySampleEvery = 16;
+    cout << "limiter,distribution,keys,threads,decisions/sec,p50_ns,p99_ns,p999_ns,live_keys,bytes/key" << endl;
+    for(int type = 0; type < kRateLimiterTypeCount; type++){
+        for(KeyDistribution distribution : {KeyDistribution::Uniform, KeyDistribution::Zipfian, KeyDistribution::Churning}){
+            for(int keyCount : {1000, 100000, 1000000}){
+                for(int threads = 1; threads <= maxThreads; threads *= 2){
+                    vector<vector<string>> streams;
+                    for(int t = 0; t < threads; t++) streams.push_back(generateKeyStream(distribution, keyCount, decisionsPerThread, t));
+                    vector<vector<long long>> latencies(threads);
+                    for(auto& samples : latencies) samples.reserve(decisionsPerThread / latencySampleEvery + 1);
+
+                    unique_ptr<RateLimiter> limiter;
+                    double seconds = 0;
+                    size_t growth = measureResidentGrowth([&]() {
+                        limiter = createBenchmarkLimiter((RateLimiterType)type, RateLimiterConfiguration(100, 60));
+                        seconds = timeThreads(threads, [&](int t) {
+                            const vector<string>& stream = streams[t];
+                            for(int i = 0; i < decisionsPerThread; i++){
+                                if(i % latencySampleEvery != 0){
+                                    limiter->allowRequest(stream[i]);
+                                    continue;
+                                }
+                                auto before = chrono::steady_clock::now();
+                                limiter->allowRequest(stream[i]);
+                                latencies[t].push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - before).count());
+                            }
+                        });
+                    });
+
+                    vector<long long> all;
+                    for(auto& samples : latencies) all.insert(all.end(), samples.begin(), samples.end());
+                    auto percentile = [&](double p) {
+                        size_t index = min(all.size() - 1, (size_t)(p * all.size()));
+                        nth_element(all.begin(), all.begin() + index, all.end());
+                        return all[index];
+                    };
+                    KeyStats stats = limiter->keyStats();
+                    cout << rateLimiterTypeName((RateLimiterType)type) << "," << distributionNames[(int)distribution] << ","
+                         << keyCount << "," << threads << "," << (long long)(threads * (double)decisionsPerThread / seconds) << ","
+                         << percentile(0.50) << "," << percentile(0.99) << "," << percentile(0.999) << ","
+                         << stats.liveKeys << "," << (stats.liveKeys ? growth / stats.liveKeys : 0) << endl;
+                }
+            }
+        }
+    }
+    SharedMemoryTokenBucketRateLimiter<>::removeSegment(benchmarkSegmentName());
+}
+
+// One very hot user on TokenBucketRateLimiter, with and without token leasing, once with a bucket
+// the threads cannot drain (decision cost) and once with one they drain every second (over-admission).
+// Admissions must stay within what the bucket allowed plus the leasing bound.
+void runTokenLeasingBenchmark(int threads) {
+    const int maxLeasedTokens = 16384;
+    const auto duration = chrono::seconds(3);
+    auto clock = make_shared<CoarseClock>(chrono::microseconds(100));
+    for(int maxRequests : {100000000, 1000000}){ // Tokens per second
+        for(bool leased : {false, true}){
+            TokenBucketRateLimiter limiter(RateLimiterConfiguration(maxRequests, 1), clock);
+            if(leased) limiter.enableLeasing(TokenLeaseConfiguration{maxLeasedTokens, chrono::microseconds(1000)});
+            atomic<long long> decisions{0}, allowed{0};
+            long long startNanos = clock->nowNanos();
+            auto end = chrono::steady_clock::now() + duration;
+            timeThreads(threads, [&](int) {
+                long long localDecisions = 0, localAllowed = 0;
+                while(chrono::steady_clock::now() < end){
+                    for(int i = 0; i < 1024; i++) localAllowed += limiter.allowRequest("hot-tenant");
+                    localDecisions += 1024;
+                }
+                decisions += localDecisions;
+                allowed += localAllowed;
+            });
+            // Refill happens per whole second, so count every second boundary the run crossed
+            long long secondsCrossed = clock->nowNanos() / 1000000000 - startNanos / 1000000000;
+            long long bucketLimit = (long long)maxRequests * (1 + secondsCrossed);
+            long long bound = bucketLimit + (leased ? maxLeasedTokens : 0);
+            cout << (leased ? "leased" : "direct") << " threads=" << threads << " tokens/sec=" << maxRequests
+                 << " decisions/sec=" << (long long)(decisions / chrono::duration<double>(duration).count())
+                 << " allowed=" << allowed << " bucketLimit=" << bucketLimit
+                 << " overAdmitted=" << max(0ll, allowed - bucketLimit)
+                 << (allowed <= bound ? " WITHIN BOUND" : " OVER BOUND") << endl;
+        }
+    }
+}
+
+// Prefork workers sharing one SharedMemoryTokenBucketRateLimiter segment:
+//  1. every worker hammers one user; together they must admit exactly maxRequests (no refill in the run)
+//  2. per-decision cost against the in-process lock-free bucket, 10k users
+//  3. workers creating new users are SIGKILLed mid-run; the survivors must still decide for every user
+bool runSharedMemoryBenchmark(int processes) {
+    const int maxRequests = 200000;
+    const int attemptsPerProcess = 2 * maxRequests / processes;
+    const string segmentName = benchmarkSegmentName();
+    RateLimiterConfiguration config(maxRequests, 1000000);
+    // Results come back through an anonymous shared mapping
+    auto* results = (atomic<long long>*)mmap(nullptr, sizeof(atomic<long long>) * (processes + 1), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    for(int p = 0; p <= processes; p++) results[p].store(0);
+    auto runWorkers = [&](auto work) {
+        vector<pid_t> workers;
+        for(int p = 0; p < processes; p++){
+            pid_t pid = fork();
+            if(pid == 0){
+                work(p);
+                _exit(0);
+            }
+            workers.push_back(pid);
+        }
+        return workers;
+    };
+
+    SharedMemoryTokenBucketRateLimiter<>::removeSegment(segmentName);
+    auto start = chrono::steady_clock::now();
+    for(pid_t pid : runWorkers([&](int p) {
+        SharedMemoryTokenBucketRateLimiter limiter(segmentName, 1 << 17, config);
+        long long allowed = 0;
+        for(int i = 0; i < attemptsPerProcess; i++) allowed += limiter.allowRequest("hot-user");
+        results[p] = allowed;
+    })) waitpid(pid, nullptr, 0);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    long long allowed = 0;
+    for(int p = 0; p < processes; p++) allowed += results[p];
+    bool passed = true;
+    cout << "hot-user processes=" << processes << " allowed=" << allowed << "/" << maxRequests
+         << " decisions/sec=" << (long long)(processes * (double)attemptsPerProcess / seconds) << verdict(passed, allowed == maxRequests) << endl;
+
+    const int users = 10000;
+    const int decisions = 2000000;
+    vector<KeyHandle> handles;
+    for(int u = 0; u < users; u++) handles.emplace_back("user" + to_string(u));
+    mt19937 rng(9);
+    vector<int> streamUsers(decisions);
+    for(int& user : streamUsers) user = rng() % users;
+    vector<pair<string, unique_ptr<RateLimiter>>> limiters;
+    limiters.emplace_back("LockFreeTokenBucket", make_unique<LockFreeTokenBucketRateLimiter<>>(config));
+    limiters.emplace_back("SharedMemoryTokenBucket", make_unique<SharedMemoryTokenBucketRateLimiter<>>(segmentName, 1 << 17, config));
+    for(auto& [name, limiter] : limiters){
+        for(bool byHandle : {false, true}){
+            auto begin = chrono::steady_clock::now();
+            for(int user : streamUsers){
+                if(byHandle) limiter->allowRequest(handles[user]);
+                else limiter->allowRequest(handles[user].userId);
+            }
+            double elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+            cout << name << (byHandle ? " handle" : " single") << " ns/decision=" << (elapsed * 1e9 / decisions) << endl;
+        }
+    }
+    limiters.clear();
+
+    // Workers keep creating users until killed, so some die in the middle of claiming a slot
+    for(pid_t pid : runWorkers([&](int p) {
+        SharedMemoryTokenBucketRateLimiter limiter(segmentName, 1 << 17, config);
+        for(long long i = 0; ; i++){
+            limiter.allowRequest("crash-" + to_string(p) + "-" + to_string(i % 20000));
+            results[p] = i + 1;
+        }
+    })){
+        this_thread::sleep_for(chrono::milliseconds(50));
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+    SharedMemoryTokenBucketRateLimiter survivor(segmentName, 1 << 17, config);
+    start = chrono::steady_clock::now();
+    long long checked = 0;
+    for(int p = 0; p < processes; p++){
+        for(long long i = 0; i < min(results[p].load(), 20000ll); i++, checked++) survivor.allowRequest("crash-" + to_string(p) + "-" + to_string(i));
+    }
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "after SIGKILL: decided for " << checked << " users in " << seconds << "s, liveKeys=" << survivor.keyStats().liveKeys
+         << " overflow=" << survivor.overflowDecisions() << endl;
+    SharedMemoryTokenBucketRateLimiter<>::removeSegment(segmentName);
+    munmap(results, sizeof(atomic<long long>) * (processes + 1));
+    return passed;
+}
+
+// Warm restart: every user spends part of its quota, the limiter is snapshotted and a fresh one
+// loads the snapshot. Loading must stay flat in the user count (only the header is read), and the
+// restored users must be left with their remaining quota instead of a full one.
+void runSnapshotBenchmark(int users) {
+    const int maxRequests = 10;
+    const int spent = 6;
+    RateLimiterConfiguration config(maxRequests, 60);
+    string path = "/tmp/rate-limiter-bench-" + to_string(getpid()) + ".snapshot";
+    vector<string> userIds;
+    for(int u = 0; u < users; u++) userIds.push_back("user" + to_string(u));
+    for(int type = 0; type < kRateLimiterTypeCount; type++){
+        if((RateLimiterType)type == RateLimiterType::SharedMemoryTokenBucket) continue; // Its state already survives restarts
+        {
+            unique_ptr<RateLimiter> before(RateLimiterFactory::createRateLimiter((RateLimiterType)type, config));
+            for(const string& userId : userIds){
+                for(int i = 0; i < spent; i++) before->allowRequest(userId);
+            }
+            auto start = chrono::steady_clock::now();
+            before->saveSnapshot(path);
+            double saveSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            struct stat info;
+            stat(path.c_str(), &info);
+            cout << rateLimiterTypeName((RateLimiterType)type) << " users=" << users << " save_ms=" << saveSeconds * 1000
+                 << " bytes/user=" << info.st_size / users;
+        }
+        unique_ptr<RateLimiter> after(RateLimiterFactory::createRateLimiter((RateLimiterType)type, config));
+        auto start = chrono::steady_clock::now();
+        bool loaded = after->loadSnapshot(path);
+        double loadSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        start = chrono::steady_clock::now();
+        long long allowed = 0;
+        for(const string& userId : userIds){
+            for(int i = 0; i < maxRequests; i++) allowed += after->allowRequest(userId);
+        }
+        double touchSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << " loaded=" << loaded << " load_us=" << loadSeconds * 1e6
+             << " ns/decision_after_load=" << touchSeconds * 1e9 / ((double)users * maxRequests)
+             << " allowed/user=" << (double)allowed / users << " (cold start would be " << maxRequests << ", warm " << maxRequests - spent << ")" << endl;
+    }
+    remove(path.c_str());
+}
+
+// Coroutine that starts right away and frees itself when it finishes, for fanning out waiters
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+// acquire()/AcquireScheduler:
+//  1. on a manual clock, every limiter must deny just before the retry-after it reported and allow at it
+//  2. threads that must all get through a hot user: spinning on allowRequest vs parking on the scheduler
+//     (CPU burnt per admitted request), then many coroutines awaiting one user, woken in arrival order
+//  3. waiters whose deadline cannot be met give up instead of waiting
+bool runAcquireBenchmark(int threads) {
+    bool passed = true;
+    RateLimiterConfiguration config(5, 10);
+    for(int type = 0; type < kRateLimiterTypeCount; type++){
+        bool exact = true;
+        long long reported = 0;
+        for(long long early : {1000000ll, 0ll}){ // Probe 1ms before the retry-after, then at it, on fresh limiters
+            auto clock = make_shared<ManualClock>(1000000000000ll);
+            unique_ptr<RateLimiter> limiter = createBenchmarkLimiter((RateLimiterType)type, config, clock);
+            for(int i = 0; i < config.maxRequests; i++){
+                limiter->allowRequest("user");
+                clock->advance(chrono::milliseconds(300));
+            }
+            AcquireResult denied = limiter->acquire("user", 2);
+            reported = denied.retryAfter.count();
+            clock->advance(denied.retryAfter - chrono::nanoseconds(early));
+            exact = exact && !denied.acquired && limiter->acquire("user", 2).acquired == (early == 0);
+            exact = exact && limiter->acquire("user", config.maxRequests + 1).retryAfter == AcquireResult::kNever;
+        }
+        cout << rateLimiterTypeName((RateLimiterType)type) << " retry_after_ms=" << reported / 1e6 << (exact ? " exact" : "") << verdict(passed, exact) << endl;
+    }
+    SharedMemoryTokenBucketRateLimiter<>::removeSegment(benchmarkSegmentName());
+
+    // 200 requests/s after a burst of 200: each thread's requests past the burst take a few ms each
+    RateLimiterConfiguration hot(200, 1);
+    const int perThread = 2 * hot.maxRequests / threads;
+    for(bool parked : {false, true}){
+        GCRARateLimiter limiter(hot);
+        AcquireScheduler scheduler(limiter);
+        atomic<long long> attempts{0};
+        clock_t cpuStart = clock();
+        double seconds = timeThreads(threads, [&](int) {
+            for(int i = 0; i < perThread; i++){
+                if(parked){
+                    attempts++;
+                    scheduler.acquireAsync("hot-user").get();
+                }else{
+                    while(attempts++, !limiter.allowRequest("hot-user")) {}
+                }
+            }
+        });
+        double cpuSeconds = (double)(clock() - cpuStart) / CLOCKS_PER_SEC;
+        cout << (parked ? "parked " : "spinning ") << "threads=" << threads << " admitted=" << threads * perThread
+             << " seconds=" << seconds << " cpu_seconds=" << cpuSeconds << " attempts/admitted=" << (double)attempts / (threads * perThread) << endl;
+    }
+
+    {
+        GCRARateLimiter limiter(hot);
+        AcquireScheduler scheduler(limiter);
+        const int waiters = 2 * hot.maxRequests;
+        vector<int> order;
+        mutex orderMutex;
+        atomic<int> done{0};
+        auto await = [&](int id) -> DetachedTask {
+            bool acquired = co_await scheduler.acquire("hot-user");
+            lock_guard<mutex> lock(orderMutex);
+            if(acquired) order.push_back(id);
+            done++;
+        };
+        auto start = chrono::steady_clock::now();
+        for(int id = 0; id < waiters; id++) await(id);
+        while(done < waiters) this_thread::sleep_for(chrono::milliseconds(1));
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        bool fifo = (int)order.size() == waiters && is_sorted(order.begin(), order.end());
+        cout << "coroutines=" << waiters << " seconds=" << seconds << " (expected ~" << (double)(waiters - hot.maxRequests) / hot.maxRequests
+             << ") in_order=" << fifo << verdict(passed, fifo) << endl;
+    }
+
+    {
+        FixedWindowRateLimiter limiter(RateLimiterConfiguration(1, 60));
+        AcquireScheduler scheduler(limiter);
+        limiter.allowRequest("user");
+        auto start = chrono::steady_clock::now();
+        bool hopeless = !scheduler.acquireAsync("user", 1, chrono::seconds(1)).get(); // Window ends in a minute
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        GCRARateLimiter slow(RateLimiterConfiguration(1, 1));
+        AcquireScheduler slowScheduler(slow);
+        slow.allowRequest("user");
+        future<bool> first = slowScheduler.acquireAsync("user"); // Due in a second
+        future<bool> second = slowScheduler.acquireAsync("user", 1, chrono::milliseconds(100)); // Queued behind it
+        bool timedOut = second.wait_for(chrono::milliseconds(500)) == future_status::ready && !second.get();
+        bool ok = hopeless && seconds < 0.1 && timedOut && first.get();
+        cout << "deadlines: unreachable refused in " << seconds * 1000 << "ms, queued waiter timed out=" << timedOut << verdict(passed, ok) << endl;
+    }
+    return passed;
+}
+
+// Composite limits: a per-user and a global limit, with requests from users already over their own
+// limit mixed in. Chaining two limiters lets those requests spend global quota before being
+// denied; the composite must hand the whole global quota to requests that pass both levels.
+// Then decision throughput of four levels as one composite vs four limiters called in turn.
+bool runCompositeBenchmark(int threads) {
+    const int users = 50, requestsPerUser = 10, userLimit = 5, globalLimit = 200;
+    RateLimiterConfiguration perUser(userLimit, 3600), global(globalLimit, 3600); // No refill during the run
+    vector<string> userIds;
+    for(int u = 0; u < users; u++) userIds.push_back("user" + to_string(u));
+    vector<int> stream; // Every user's requests, shuffled so over-limit requests come early too
+    for(int u = 0; u < users; u++) stream.insert(stream.end(), requestsPerUser, u);
+    shuffle(stream.begin(), stream.end(), mt19937(7));
+
+    CompositeRateLimiter composite({{LimitScope::User, perUser, nullopt}, {LimitScope::Global, global, nullopt}});
+    GCRARateLimiter globalLimiter(global), userLimiter(perUser);
+    bool passed = true;
+    for(bool chained : {true, false}){
+        vector<atomic<int>> allowedPerUser(users);
+        atomic<size_t> next{0};
+        timeThreads(threads, [&](int) {
+            for(size_t i; (i = next++) < stream.size(); ){
+                const string& userId = userIds[stream[i]];
+                bool allowed = chained ? globalLimiter.allowRequest("global") && userLimiter.allowRequest(userId)
+                                       : composite.allowRequest(RequestContext{userId, UserTier::Free, ""});
+                if(allowed) allowedPerUser[stream[i]]++;
+            }
+        });
+        int allowed = 0, worstUser = 0;
+        for(auto& count : allowedPerUser){
+            allowed += count;
+            worstUser = max(worstUser, count.load());
+        }
+        cout << (chained ? "chained   " : "composite ") << "allowed=" << allowed << "/" << globalLimit
+             << " max_per_user=" << worstUser << "/" << userLimit;
+        if(chained) cout << " (" << globalLimit - allowed << " global tokens spent on denied requests)" << endl;
+        else cout << " denied_by_user=" << composite.deniedBy(0) << " denied_by_global=" << composite.deniedBy(1)
+                  << verdict(passed, worstUser <= userLimit && allowed == globalLimit) << endl;
+    }
+
+    // Throughput: user, tier, endpoint and global levels, limits high enough that nothing is denied
+    RateLimiterConfiguration roomy(1000000000, 60);
+    vector<LimitRule> rules = {
+        {LimitScope::User, roomy, nullopt}, {LimitScope::Tier, roomy, nullopt}, {LimitScope::Endpoint, roomy, nullopt}, {LimitScope::Global, roomy, nullopt}
+    };
+    const int decisionsPerThread = 200000;
+    vector<string> endpoints = {"/search", "/orders", "/login", "/upload"};
+    for(bool chained : {true, false}){
+        CompositeRateLimiter levels(rules);
+        GCRARateLimiter byUser(roomy), byTier(roomy), byEndpoint(roomy), byGlobal(roomy);
+        double seconds = timeThreads(threads, [&](int t) {
+            vector<string> ids;
+            for(int u = 0; u < 1000; u++) ids.push_back("t" + to_string(t) + "-user" + to_string(u));
+            for(int i = 0; i < decisionsPerThread; i++){
+                const string& userId = ids[i % ids.size()];
+                const string& endpoint = endpoints[i % endpoints.size()];
+                UserTier tier = (UserTier)(i % kUserTierCount);
+                if(chained){
+                    byUser.allowRequest(userId) && byTier.allowRequest(to_string((int)tier)) && byEndpoint.allowRequest(endpoint) && byGlobal.allowRequest("global");
+                }else{
+                    levels.allowRequest(RequestContext{userId, tier, endpoint});
+                }
+            }
+        });
+        cout << (chained ? "chained   " : "composite ") << "levels=4 threads=" << threads
+             << " decisions/sec=" << (long long)(threads * (double)decisionsPerThread / seconds) << endl;
+    }
+    return passed;
+}
+
+// Limits reload: for every algorithm a Free user spends 6 of 10, the limit is raised to 20 and then
+// lowered to 10 again; the user must keep what it used (14 left, then 4), not start over. A
+// per-user override must apply on top of the tier. Then decision throughput while another thread
+// keeps reloading.
+bool runLimitsReloadBenchmark(int threads) {
+    string path = (filesystem::temp_directory_path() / ("rate-limiter-limits-" + to_string(getpid()) + ".conf")).string();
+    auto writeLimits = [&](const string& text) {
+        ofstream(path + ".tmp") << text;
+        rename((path + ".tmp").c_str(), path.c_str()); // Never let a reload see half a file
+    };
+    bool passed = true;
+    for(int type = 0; type < kRateLimiterTypeCount; type++){
+        if((RateLimiterType)type == RateLimiterType::SharedMemoryTokenBucket) continue; // Its limits are fixed by its segment: below
+        string algorithm = rateLimiterTypeName((RateLimiterType)type);
+        RateLimiterService service(make_shared<ManualClock>(1000000000000ll));
+        writeLimits("tier Free " + algorithm + " 10 60\n");
+        service.reloadLimits(path);
+        int spent = 0;
+        for(int i = 0; i < 6; i++) spent += service.allowRequest(UserTier::Free, "user");
+        auto remaining = [&]() {
+            int allowed = 0;
+            while(allowed < 100 && service.allowRequest(UserTier::Free, "user")) allowed++;
+            return allowed;
+        };
+        writeLimits("tier Free " + algorithm + " 20 60\n");
+        service.reloadLimits(path);
+        int raised = remaining(); // Spends everything: 20 used
+        writeLimits("tier Free " + algorithm + " 10 60\n# back down\nuser vip " + algorithm + " 50 60\n");
+        service.reloadLimits(path);
+        int lowered = remaining(); // Over the lowered limit already
+        int vip = 0;
+        while(vip < 100 && service.allowRequest(UserTier::Free, "vip")) vip++;
+        bool ok = spent == 6 && raised == 14 && lowered == 0 && vip == 50;
+        cout << algorithm << " spent=6 then 10->20 left=" << raised << "/14, 20->10 left=" << lowered << "/0, override vip=" << vip << "/50"
+             << verdict(passed, ok) << endl;
+    }
+    {
+        bool rejected = false;
+        RateLimiterService service;
+        writeLimits("tier Free Bogus 10 60\n");
+        try{
+            service.reloadLimits(path);
+        }catch(const exception& error){
+            rejected = true;
+            cout << "invalid file rejected: " << error.what() << endl;
+        }
+        passed = passed && rejected;
+    }
+    {
+        // A SharedMemoryTokenBucket tier can be switched to, but then keeps its limits
+        string segmentName = SharedMemoryTokenBucketRateLimiter<>::defaultSegmentName(RateLimiterConfiguration(10, 60));
+        SharedMemoryTokenBucketRateLimiter<>::removeSegment(segmentName);
+        RateLimiterService service(make_shared<ManualClock>(1000000000000ll));
+        writeLimits("tier Free SharedMemoryTokenBucket 10 60\n");
+        service.reloadLimits(path);
+        int spent = 0;
+        for(int i = 0; i < 6; i++) spent += service.allowRequest(UserTier::Free, "user");
+        bool rejected = false;
+        writeLimits("tier Free SharedMemoryTokenBucket 20 60\n");
+        try{
+            service.reloadLimits(path);
+        }catch(const exception&){
+            rejected = true;
+        }
+        int left = 0;
+        while(left < 100 && service.allowRequest(UserTier::Free, "user")) left++;
+        cout << "SharedMemoryTokenBucket spent=6 then 10->20 rejected=" << rejected << " left=" << left << "/4"
+             << verdict(passed, spent == 6 && rejected && left == 4) << endl;
+        SharedMemoryTokenBucketRateLimiter<>::removeSegment(segmentName);
+    }
+
+    for(bool reloading : {false, true}){
+        RateLimiterService service;
+        atomic<bool> done{false};
+        atomic<long long> reloads{0};
+        thread reloader([&]() {
+            for(int i = 0; reloading && !done; i++){
+                writeLimits("tier Premium TokenBucket " + to_string(i % 2 ? 1000000 : 2000000) + " 60\nuser t0-user0 GCRA 1000 60\n");
+                service.reloadLimits(path);
+                reloads++;
+            }
+        });
+        const int decisionsPerThread = 300000;
+        double seconds = timeThreads(threads, [&](int t) {
+            vector<string> users;
+            for(int u = 0; u < 1000; u++) users.push_back("t" + to_string(t) + "-user" + to_string(u));
+            for(int i = 0; i < decisionsPerThread; i++) service.allowRequest(UserTier::Premium, users[i % users.size()]);
+        });
+        done = true;
+        reloader.join();
+        cout << (reloading ? "with reloads    " : "without reloads ") << "threads=" << threads << " reloads=" << reloads
+             << " decisions/sec=" << (long long)(threads * (double)decisionsPerThread / seconds) << endl;
+    }
+    remove(path.c_str());
+    return passed;
+}
+
+// Cost of reaching the decision: the same GCRA limits decided through the old map lookup plus
+// virtual call, a virtual call, the service's variant, the concrete class (reading its clock
+// directly or through the vtable), and PolicyRateLimiter (with and without shard locks). The
+// clock stands still, so every path must admit exactly the same requests; the difference in
+// ns/decision is what the dispatch costs.
+bool runDispatchBenchmark() {
+    const int users = 1000;
+    const int decisions = 2000000;
+    const int rounds = 5; // Best round counts, to keep scheduling noise out of a few-ns difference
+    const RateLimiterConfiguration config(100, 60);
+    auto clock = make_shared<ManualClock>(1000000000000ll);
+    vector<string> userIds;
+    for(int u = 0; u < users; u++) userIds.push_back("user" + to_string(u));
+    mt19937 rng(9);
+    vector<int> streamUsers(decisions);
+    for(int& user : streamUsers) user = rng() % users;
+
+    bool passed = true;
+    double baseline = 0;
+    // Decisions go through KeyHandles, so the limiter's own work is small and the dispatch shows
+    auto timeDecisions = [&](const string& name, auto decide) {
+        vector<KeyHandle> handles(userIds.begin(), userIds.end());
+        for(KeyHandle& handle : handles) decide(handle); // Every user in the table before timing
+        size_t allowed = users;
+        double best = 1e18;
+        for(int round = 0; round < rounds; round++){
+            auto start = chrono::steady_clock::now();
+            for(int user : streamUsers) allowed += decide(handles[user]);
+            best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count() * 1e9 / decisions);
+        }
+        if(baseline == 0) baseline = best;
+        bool ok = allowed == (size_t)users * config.maxRequests;
+        passed = passed && ok;
+        cout << left << setw(30) << name << right << " ns/decision=" << fixed << setprecision(1) << best
+             << " vs policy=" << showpos << (best - baseline) << noshowpos << defaultfloat << (ok ? "" : " FAIL") << endl;
+    };
+    {
+        PolicyRateLimiter<GCRAPolicy, ManualClock, NullMutex> limiter(config, clock);
+        timeDecisions("policy (ManualClock, no lock)", [&](KeyHandle& handle) { return limiter.allowRequest(handle); });
+    }
+    {
+        PolicyRateLimiter<GCRAPolicy, ManualClock> limiter(config, clock);
+        timeDecisions("policy (ManualClock, mutex)", [&](KeyHandle& handle) { return limiter.allowRequest(handle); });
+    }
+    {
+        GCRARateLimiter<ManualClock> limiter(config, clock);
+        timeDecisions("concrete, final clock", [&](KeyHandle& handle) { return limiter.allowRequest(handle); });
+    }
+    {
+        GCRARateLimiter<Clock> limiter(config, clock);
+        timeDecisions("concrete, virtual clock", [&](KeyHandle& handle) { return limiter.allowRequest(handle); });
+    }
+    {
+        shared_ptr<RateLimiter> owner(RateLimiterFactory::createRateLimiter(RateLimiterType::GCRA, config, clock));
+        LimiterRef limiter = owner->ref();
+        timeDecisions("variant visit", [&](KeyHandle& handle) {
+            return visitLimiter([&](auto* concrete) { return concrete->allowRequest(handle); }, limiter);
+        });
+    }
+    {
+        unique_ptr<RateLimiter> owner(RateLimiterFactory::createRateLimiter(RateLimiterType::GCRA, config, clock));
+        RateLimiter* limiter = owner.get();
+        timeDecisions("virtual call", [&](KeyHandle& handle) { return limiter->allowRequest(handle); });
+    }
+    {
+        // How the service used to find its limiter on every decision
+        unique_ptr<RateLimiter> owner(RateLimiterFactory::createRateLimiter(RateLimiterType::GCRA, config, clock));
+        map<UserTier, RateLimiter*> limiters = {{UserTier::Premium, owner.get()}};
+        timeDecisions("map operator[] + virtual call", [&](KeyHandle& handle) { return limiters[UserTier::Premium]->allowRequest(handle); });
+    }
+    {
+        RateLimiterService service(clock);
+        service.configureTier(UserTier::Premium, RateLimiterType::GCRA, config);
+        timeDecisions("service allowRequest", [&](KeyHandle& handle) { return service.allowRequest(UserTier::Premium, handle); });
+    }
+    return passed;
+}
+
+// Count-min sketch limiter:
+//  1. error: anonymous traffic (many light keys plus a few heavy hitters) on a manual clock, decided
+//     by the sketch and by the exact sliding window counter side by side. At the end every key's
+//     estimate is checked against what the sketch really admitted for it: never below (or the
+//     sketch could over-admit), and above by more than the epsilon bound for at most ~delta of keys.
+//  2. memory and throughput against the per-key limiters as the number of distinct keys grows
+bool runCountMinSketchBenchmark() {
+    bool passed = true;
+    const int lightKeys = 400000;
+    const int heavyKeys = 16;
+    const int requests = 2000000;
+    RateLimiterConfiguration config(20, 1);
+    for(size_t heavyHitterSlots : {(size_t)0, (size_t)256}){
+        auto clock = make_shared<ManualClock>(1000000000000ll);
+        CountMinSketchConfiguration sketchConfiguration;
+        sketchConfiguration.memoryBytes = 1 << 20;
+        sketchConfiguration.heavyHitterSlots = heavyHitterSlots;
+        CountMinSketchRateLimiter sketch(config, clock, sketchConfiguration);
+        SlidingWindowCounterRateLimiter exact(config, clock);
+        mt19937 rng(11);
+        unordered_map<string, array<long long, 3>> admitted; // Key -> {window, admitted in it, admitted in the one before}
+        long long windowDuration = 1000000000;
+        long long agreed = 0, lightFalseDenials = 0, heavyFalseDenials = 0, extraAdmissions = 0;
+        for(int i = 0; i < requests; i++){
+            clock->advance(chrono::microseconds(2)); // 500k requests/s over 4 windows
+            bool heavy = rng() % 10 < 3;
+            string key = heavy ? "attacker-" + to_string(rng() % heavyKeys) : "10.0." + to_string(rng() % lightKeys);
+            bool sketchAllowed = sketch.allowRequest(key);
+            bool exactAllowed = exact.allowRequest(key);
+            agreed += sketchAllowed == exactAllowed;
+            if(!sketchAllowed && exactAllowed) (heavy ? heavyFalseDenials : lightFalseDenials)++;
+            extraAdmissions += sketchAllowed && !exactAllowed;
+            if(sketchAllowed){
+                long long window = clock->nowNanos() / windowDuration;
+                auto& [keyWindow, current, previous] = admitted[key];
+                if(keyWindow != window){
+                    previous = keyWindow == window - 1 ? current : 0;
+                    current = 0;
+                    keyWindow = window;
+                }
+                current++;
+            }
+        }
+        SketchErrorBound bound = sketch.errorBound();
+        long long window = clock->nowNanos() / windowDuration;
+        long long checked = 0, undercounts = 0, overBound = 0, maxOvercount = 0;
+        double overcountSum = 0;
+        for(auto& [key, counts] : admitted){
+            auto [keyWindow, current, previous] = counts;
+            if(keyWindow != window){
+                previous = keyWindow == window - 1 ? current : 0;
+                current = 0;
+            }
+            auto [estimatedCurrent, estimatedPrevious] = sketch.estimatedCounts(key);
+            long long overcount = max(estimatedCurrent - current, estimatedPrevious - previous);
+            checked++;
+            undercounts += estimatedCurrent < current || estimatedPrevious < previous;
+            overBound += overcount > bound.maxOvercount;
+            maxOvercount = max(maxOvercount, overcount);
+            overcountSum += overcount;
+        }
+        double overBoundFraction = (double)overBound / checked;
+        bool ok = undercounts == 0 && overBoundFraction <= 2 * bound.delta; // Twice delta leaves room for sampling noise
+        cout << "promotion=" << (heavyHitterSlots > 0 ? "on " : "off") << " memory_kib=" << sketch.memoryBytes() / 1024
+             << " agreement=" << 100.0 * agreed / requests << "% light_false_denials=" << lightFalseDenials
+             << " heavy_false_denials=" << heavyFalseDenials << " extra_admissions=" << extraAdmissions
+             << " promoted=" << sketch.keyStats().liveKeys << endl;
+        cout << "    epsilon=" << bound.epsilon << " delta=" << bound.delta << " bound=" << bound.maxOvercount
+             << " keys_checked=" << checked << " mean_overcount=" << overcountSum / checked << " max_overcount=" << maxOvercount
+             << " over_bound=" << 100.0 * overBoundFraction << "% undercounts=" << undercounts << verdict(passed, ok) << endl;
+    }
+
+    // A scan: every key is new, each asked about twice
+    for(int keys : {100000, 1000000, 4000000}){
+        vector<string> users;
+        users.reserve(keys);
+        for(int u = 0; u < keys; u++) users.push_back("10." + to_string(u >> 16) + "." + to_string((u >> 8) & 255) + "." + to_string(u & 255));
+        vector<unique_ptr<RateLimiter>> alive;
+        for(RateLimiterType type : {RateLimiterType::CountMinSketch, RateLimiterType::SlidingWindowCounter, RateLimiterType::GCRA}){
+            long long decisions = 2ll * keys;
+            double seconds = 0;
+            size_t growth = measureResidentGrowth([&]() {
+                alive.emplace_back(RateLimiterFactory::createRateLimiter(type, RateLimiterConfiguration(100, 60)));
+                RateLimiter* limiter = alive.back().get();
+                auto start = chrono::steady_clock::now();
+                for(long long i = 0; i < decisions; i++) limiter->allowRequest(users[i % keys]);
+                seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            });
+            cout << rateLimiterTypeName(type) << " keys=" << keys << " ns/decision=" << (seconds * 1e9 / decisions)
+                 << " memory_mib=" << (growth >> 20) << endl;
+        }
+    }
+    return passed;
+}
+
+// Decision server over loopback:
+//  1. protocol: a Free user's batch of 15 gets exactly its 10, a bad tier gets kBadRequest,
+//     pipelined responses come back in order, and a malformed frame closes only its connection
+//  2. load: `connections` client threads keep 64 requests in flight each, with one decision per
+//     request and then batches of 32, over the Unix socket and over TCP
+bool runDecisionServerBenchmark(int eventLoops, int connections) {
+    string socketPath = (filesystem::temp_directory_path() / ("rate-limiter-" + to_string(getpid()) + ".sock")).string();
+    RateLimiterService service;
+    service.configureTier(UserTier::Premium, RateLimiterType::GCRA, RateLimiterConfiguration(1000000000, 60)); // Never denies: load measures the server
+    DecisionServerConfiguration configuration;
+    configuration.unixSocketPath = socketPath;
+    configuration.tcpPort = 0;
+    configuration.eventLoops = eventLoops;
+    DecisionServer server(service, configuration);
+    bool passed = true;
+    {
+        DecisionClient client = DecisionClient::unixSocket(socketPath);
+        vector<string> freeUser(15, "free-user");
+        span<const string> one = span<const string>(freeUser).first(1);
+        client.send(1, UserTier::Free, freeUser);
+        client.send(2, (UserTier)7, one);
+        for(uint32_t id = 3; id < 103; id++) client.send(id, UserTier::Premium, one);
+        client.flush();
+        DecisionResponse limited = client.receive();
+        DecisionResponse badTier = client.receive();
+        bool inOrder = true;
+        for(uint32_t id = 3; id < 103; id++){
+            DecisionResponse response = client.receive();
+            inOrder = inOrder && response.requestId == id && response.status == DecisionProtocol::kOk && response.decisions.test(0);
+        }
+        DecisionClient broken = DecisionClient::unixSocket(socketPath);
+        broken.sendBytes(string("\x02\x00\x00\x00\x01\x00", 6)); // Length 2: shorter than any request
+        broken.flush();
+        bool closed = false;
+        try{
+            broken.receive();
+        }catch(const exception&){
+            closed = true;
+        }
+        client.send(103, UserTier::Premium, one);
+        client.flush();
+        bool stillServed = client.receive().requestId == 103;
+        bool ok = limited.status == DecisionProtocol::kOk && limited.decisions.count() == 10 && badTier.status == DecisionProtocol::kBadRequest
+                  && inOrder && closed && stillServed;
+        cout << "protocol: batch of 15 allowed=" << limited.decisions.count() << "/10, bad tier status=" << (int)badTier.status
+             << ", 100 pipelined in_order=" << inOrder << ", malformed frame closed=" << closed << ", others unaffected=" << stillServed
+             << verdict(passed, ok) << endl;
+    }
+
+    const int depth = 64; // Requests in flight per connection
+    const long long decisionsPerConnection = 400000;
+    for(bool tcp : {false, true}){
+        for(int batch : {1, 32}){
+            atomic<bool> failed{false};
+            uint64_t before = server.decisionCount();
+            double seconds = timeThreads(connections, [&](int c) {
+                DecisionClient client = tcp ? DecisionClient::tcp("127.0.0.1", server.tcpPort()) : DecisionClient::unixSocket(socketPath);
+                vector<string> userIds;
+                for(int u = 0; u < 1000; u++) userIds.push_back("c" + to_string(c) + "-user" + to_string(u));
+                vector<string> request(batch);
+                uint32_t next = 0;
+                for(long long left = decisionsPerConnection / batch; left > 0; ){
+                    int wave = min<long long>(depth, left);
+                    for(int w = 0; w < wave; w++, next++){
+                        for(int b = 0; b < batch; b++) request[b] = userIds[(next * batch + b) % userIds.size()];
+                        client.send(next, UserTier::Premium, request);
+                    }
+                    client.flush();
+                    for(int w = 0; w < wave; w++){
+                        DecisionResponse response = client.receive();
+                        if(response.status != DecisionProtocol::kOk || response.decisions.count() != (size_t)batch) failed = true;
+                    }
+                    left -= wave;
+                }
+            });
+            double perSecond = (server.decisionCount() - before) / seconds;
+            passed = passed && !failed;
+            cout << (tcp ? "tcp " : "unix") << " batch=" << setw(2) << batch << " connections=" << connections << " event_loops=" << server.eventLoopCount()
+                 << " decisions/sec=" << (long long)perSecond << " per_loop=" << (long long)(perSecond / server.eventLoopCount())
+                 << (failed ? " FAIL" : "") << endl;
+        }
+    }
+    return passed;
+}
+
+// Instrumentation:
+//  1. histogram accuracy: every percentile of 1..1M ns is reported within one sub-bucket (1/32)
+//  2. state bytes against the resident memory a limiter actually grew by
+//  3. lock contention of the same load on 1 shard and on 64
+//  4. decision cost, to compare against a build with -DRATE_LIMITER_NO_STATS
+//  5. a SIGUSR1 stats dump
+bool runInstrumentationBenchmark(int threads) {
+    bool passed = true;
+    LatencyHistogram histogram;
+    const uint64_t samples = 1000000;
+    for(uint64_t nanos = 1; nanos <= samples; nanos++) histogram.record(nanos);
+    for(double percent : {50.0, 90.0, 99.0, 99.9}){
+        uint64_t exact = (uint64_t)ceil(percent / 100 * samples);
+        uint64_t reported = histogram.percentile(percent);
+        bool ok = reported >= exact && reported <= exact + exact / LatencyHistogram::kSubBuckets;
+        cout << "histogram p" << percent << " exact=" << exact << " reported=" << reported << verdict(passed, ok) << endl;
+    }
+
+    const int users = 1000000;
+    vector<string> userIds;
+    for(int u = 0; u < users; u++) userIds.push_back("user-" + to_string(u) + "@example.com");
+    vector<unique_ptr<RateLimiter>> alive;
+    for(RateLimiterType type : {RateLimiterType::TokenBucket, RateLimiterType::SlidingWindow, RateLimiterType::GCRA, RateLimiterType::CountMinSketch}){
+        size_t growth = measureResidentGrowth([&]() {
+            alive.emplace_back(RateLimiterFactory::createRateLimiter(type, RateLimiterConfiguration(100, 60)));
+            for(int u = 0; u < users; u++) alive.back()->allowRequest(userIds[u]);
+        });
+        LimiterStats stats = alive.back()->stats();
+        cout << rateLimiterTypeName(type) << " keys=" << stats.keys.liveKeys << " state_mib=" << (stats.stateBytes >> 20)
+             << " rss_growth_mib=" << (growth >> 20) << endl;
+    }
+    alive.clear();
+
+    const int decisionsPerThread = 1000000;
+    for(int shards : {1, 64}){
+        TokenBucketRateLimiter limiter(RateLimiterConfiguration(100, 60, shards));
+        double seconds = timeThreads(threads, [&](int t) {
+            for(int i = 0; i < decisionsPerThread; i++) limiter.allowRequest(userIds[(t * 7919 + i) % 10000]);
+        });
+        LockStats locks = limiter.stats().locks;
+        cout << "contention shards=" << shards << " threads=" << threads << " decisions/sec=" << (long long)(threads * (double)decisionsPerThread / seconds)
+             << " acquires=" << locks.acquires << " contended=" << (locks.acquires ? 100.0 * locks.contended / locks.acquires : 0)
+             << "% mean_wait_ns=" << (locks.contended ? locks.waitNanos / locks.contended : 0) << endl;
+    }
+
+    for(RateLimiterType type : {RateLimiterType::TokenBucket, RateLimiterType::LockFreeTokenBucket, RateLimiterType::GCRA}){
+        unique_ptr<RateLimiter> limiter(RateLimiterFactory::createRateLimiter(type, RateLimiterConfiguration(100, 60)));
+        const int decisions = 10000000;
+        auto start = chrono::steady_clock::now();
+        for(int i = 0; i < decisions; i++) limiter->allowRequest(userIds[i % 1000]);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << rateLimiterTypeName(type) << " ns/decision=" << seconds * 1e9 / decisions
+#ifdef RATE_LIMITER_NO_STATS
+             << " (instrumentation compiled out)" << endl;
+#else
+             << " (instrumented; compare with -DRATE_LIMITER_NO_STATS)" << endl;
+#endif
+    }
+
+    ostringstream dump;
+    {
+        RateLimiterService service;
+        service.dumpStatsOnSignal(SIGUSR1, dump);
+        for(int i = 0; i < 1000; i++) service.allowRequest(UserTier::Premium, userIds[i % 50]);
+        raise(SIGUSR1);
+        this_thread::sleep_for(chrono::milliseconds(200));
+    } // Joins the dump thread
+    bool dumped = dump.str().find("tier Premium TokenBucket keys=50") != string::npos;
+    passed = passed && dumped;
+    cout << "SIGUSR1 dump:\n" << dump.str() << (dumped ? "PASS" : "FAIL") << endl;
+    return passed;
+}
+
+// Brownout simulation on a ManualClock: 60 downstream workers serve a FIFO queue in 10 ms (6000/s)
+// until the downstream slows to 40 ms (1500/s) from 10 s to 25 s; ~2700 requests/s arrive from
+// the three tiers, plus a Free scraper far over its rate limit. A client counts an answer slower
+// than 100 ms as failed. Without a concurrency limit the queue grows until almost every answer
+// comes too late; with one, the excess is shed at once and what is admitted still succeeds.
+// Then the cost of tryAcquire + complete from several threads.
+bool runAdaptiveConcurrencyBenchmark(int threads) {
+    const int workers = 60, usersPerTier = 300;
+    const double arrivalsPerSecond = 3000, endSeconds = 40;
+    const long long healthyService = 10000000, brownoutService = 40000000, timeout = 100000000;
+    const long long brownoutStart = 10000000000LL, brownoutEnd = 25000000000LL;
+    const char* tierNames[kUserTierCount] = {"Free", "Premium", "Enterprise"};
+    const char* phaseNames[] = {"healthy", "brownout", "recovered"};
+    auto phaseOf = [&](long long nanos) { return nanos < brownoutStart ? 0 : nanos < brownoutEnd ? 1 : 2; };
+    bool passed = true;
+    double unlimitedBrownoutGoodput = 0;
+    for(int run = 0; run < 3; run++){
+        optional<ConcurrencyAlgorithm> algorithm;
+        if(run == 1) algorithm = ConcurrencyAlgorithm::Aimd;
+        if(run == 2) algorithm = ConcurrencyAlgorithm::Gradient;
+        auto clock = make_shared<ManualClock>();
+        RateLimiterService service(clock);
+        for(int tier = 0; tier < kUserTierCount; tier++) service.configureTier((UserTier)tier, RateLimiterType::GCRA, RateLimiterConfiguration(600, 60));
+        if(algorithm){
+            AdaptiveConcurrencyConfiguration config;
+            config.algorithm = *algorithm;
+            config.initialLimit = workers; // What the downstream is sized for
+            config.latencyTarget = chrono::milliseconds(80); // Aimd: most of the clients' timeout
+            service.configureConcurrency(config);
+        }
+        struct Request {
+            long long arrival;
+            UserTier tier;
+            bool scraper;
+            optional<AdaptiveConcurrencyLimiter::Permit> permit;
+        };
+        vector<Request> requests;
+        deque<size_t> queue; // Admitted, waiting for a worker
+        priority_queue<pair<long long, size_t>, vector<pair<long long, size_t>>, greater<>> completions;
+        int busy = 0;
+        array<array<uint64_t, kUserTierCount>, 3> offered{}, succeeded{};
+        array<uint64_t, 3> shed{}, rateDenied{}, timedOut{};
+        array<double, 3> limitSum{};
+        array<uint64_t, 3> limitSamples{};
+        mt19937 random(11);
+        exponential_distribution<double> gaps(arrivalsPerSecond);
+        uniform_real_distribution<double> jitter(0.5, 1.5), pick(0, 1);
+        auto start = [&](size_t id, long long now) {
+            busy++;
+            long long service = now < brownoutStart || now >= brownoutEnd ? healthyService : brownoutService;
+            completions.push({now + (long long)(service * jitter(random)), id});
+        };
+        long long nextArrival = 0, nextLimitSample = 0;
+        while(true){
+            bool arrival = nextArrival < endSeconds * 1e9 && (completions.empty() || nextArrival <= completions.top().first);
+            if(!arrival && completions.empty()) break;
+            long long now = arrival ? nextArrival : completions.top().first;
+            clock->set(now);
+            if(!arrival){
+                size_t id = completions.top().second;
+                completions.pop();
+                busy--;
+                Request& request = requests[id];
+                long long latency = now - request.arrival;
+                int phase = phaseOf(request.arrival);
+                if(latency <= timeout){
+                    if(!request.scraper) succeeded[phase][(int)request.tier]++;
+                    if(request.permit) request.permit->complete(chrono::nanoseconds(latency));
+                }else{
+                    timedOut[phase]++;
+                    if(request.permit) request.permit->dropped();
+                }
+                request.permit.reset();
+                if(!queue.empty()){
+                    start(queue.front(), now);
+                    queue.pop_front();
+                }
+                continue;
+            }
+            nextArrival += (long long)(gaps(random) * 1e9);
+            int phase = phaseOf(now);
+            if(algorithm && now >= nextLimitSample){
+                limitSum[phase] += service.concurrencyStats()->limit;
+                limitSamples[phase]++;
+                nextLimitSample = now + 100000000;
+            }
+            bool scraper = pick(random) < 0.1;
+            double mix = pick(random);
+            UserTier tier = scraper || mix < 0.5 ? UserTier::Free : mix < 0.8 ? UserTier::Premium : UserTier::Enterprise;
+            string userId = scraper ? "scraper" : string(tierNames[(int)tier]) + "-" + to_string(random() % usersPerTier);
+            if(!scraper) offered[phase][(int)tier]++;
+            Request request{now, tier, scraper, nullopt};
+            if(algorithm){
+                request.permit = service.admit(tier, userId);
+                if(!request.permit){
+                    (service.concurrencyStats()->rejected > shed[0] + shed[1] + shed[2] ? shed[phase] : rateDenied[phase])++;
+                    continue;
+                }
+            }else if(!service.allowRequest(tier, userId)){
+                rateDenied[phase]++;
+                continue;
+            }
+            requests.push_back(std::move(request));
+            if(busy < workers) start(requests.size() - 1, now);
+            else queue.push_back(requests.size() - 1);
+        }
+
+        const char* runName = !algorithm ? "unlimited" : *algorithm == ConcurrencyAlgorithm::Aimd ? "aimd     " : "gradient ";
+        array<double, 3> phaseSeconds = {brownoutStart / 1e9, (brownoutEnd - brownoutStart) / 1e9, endSeconds - brownoutEnd / 1e9};
+        array<double, 3> goodput{};
+        for(int phase = 0; phase < 3; phase++){
+            uint64_t offeredTotal = 0, succeededTotal = 0;
+            for(int tier = 0; tier < kUserTierCount; tier++){
+                offeredTotal += offered[phase][tier];
+                succeededTotal += succeeded[phase][tier];
+            }
+            goodput[phase] = succeededTotal / phaseSeconds[phase];
+            cout << runName << " " << phaseNames[phase] << " goodput/s=" << (long long)goodput[phase] << " of " << (long long)(offeredTotal / phaseSeconds[phase]);
+            for(int tier = 0; tier < kUserTierCount; tier++){
+                cout << " " << tierNames[tier] << "=" << (offered[phase][tier] ? 100 * succeeded[phase][tier] / offered[phase][tier] : 0) << "%";
+            }
+            cout << " shed=" << shed[phase] << " rate_denied=" << rateDenied[phase] << " timed_out=" << timedOut[phase];
+            if(algorithm) cout << " mean_limit=" << (long long)(limitSamples[phase] ? limitSum[phase] / limitSamples[phase] : 0);
+            cout << endl;
+        }
+        if(!algorithm){
+            unlimitedBrownoutGoodput = goodput[1];
+            continue;
+        }
+        // Healthy traffic is not throttled, the brownout keeps most of the downstream's capacity
+        // busy with requests that succeed, and Enterprise is shed last
+        double capacity = 1e9 * workers / brownoutService;
+        bool ok = goodput[0] >= 0.95 * arrivalsPerSecond * 0.9 && goodput[1] >= 0.8 * capacity && goodput[1] > unlimitedBrownoutGoodput
+                  && succeeded[1][2] * offered[1][0] >= succeeded[1][0] * offered[1][2];
+        cout << runName << " brownout goodput " << (long long)goodput[1] << "/s vs capacity " << (long long)capacity << "/s and "
+             << (long long)unlimitedBrownoutGoodput << "/s unlimited" << verdict(passed, ok) << endl;
+    }
+
+    const int permitsPerThread = 1000000;
+    for(int count = 1; count <= threads; count *= 2){
+        AdaptiveConcurrencyConfiguration config;
+        config.initialLimit = config.maxLimit = 1 << 20; // Never full: measures the accounting alone
+        AdaptiveConcurrencyLimiter limiter(config);
+        double seconds = timeThreads(count, [&](int) {
+            for(int i = 0; i < permitsPerThread; i++) limiter.tryAcquire()->complete(chrono::microseconds(500));
+        });
+        cout << "tryAcquire+complete threads=" << count << " ns/permit=" << seconds * 1e9 / permitsPerThread / count
+             << " in_flight_after=" << limiter.stats().inFlight << verdict(passed, limiter.stats().inFlight == 0) << endl;
+    }
+    return passed;
+}
+
+// Admission under overload, in real time: 8 slots held 1 ms each (8000/s) while the tiers offer
+// 6000, 3600 and 2400 requests/s. Shedding with admit() turns requests away from every tier, with
+// only the tier shares favouring the higher ones. admitQueued() instead queues the excess, and
+// weighted fair queueing keeps Enterprise (and Premium) served within a slot's time or so, while
+// Free waits and runs out its queue budget. First, the MPSC queue on its own: per-producer order,
+// nothing lost.
+bool runAdmissionSchedulerBenchmark(int threads) {
+    bool passed = true;
+    {
+        const int pushesPerThread = 200000;
+        MpscQueue<pair<int, int>> queue;
+        atomic<int> producersDone{0};
+        vector<thread> producers;
+        auto start = chrono::steady_clock::now();
+        for(int t = 0; t < threads; t++){
+            producers.emplace_back([&, t]() {
+                for(int i = 0; i < pushesPerThread; i++) queue.push({t, i});
+                producersDone++;
+            });
+        }
+        vector<int> nextOf(threads, 0);
+        long long popped = 0;
+        bool ordered = true;
+        while(true){
+            bool done = producersDone.load() == threads; // Read before popping, so nothing is missed
+            while(optional<pair<int, int>> item = queue.pop()){
+                ordered = ordered && item->second == nextOf[item->first]++;
+                popped++;
+            }
+            if(done) break;
+            this_thread::yield();
+        }
+        for(thread& producer : producers) producer.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        bool ok = ordered && popped == (long long)threads * pushesPerThread;
+        cout << "mpsc producers=" << threads << " items=" << popped << " items/sec=" << (long long)(popped / seconds)
+             << verdict(passed, ok) << endl;
+    }
+
+    const int slots = 8;
+    const chrono::milliseconds serviceTime(1), runTime(3000);
+    const array<int, kUserTierCount> arrivalsPerSecond = {6000, 3600, 2400};
+    const char* tierNames[kUserTierCount] = {"Free", "Premium", "Enterprise"};
+    for(bool queueing : {false, true}){
+        RateLimiterService service;
+        for(int tier = 0; tier < kUserTierCount; tier++) service.configureTier((UserTier)tier, RateLimiterType::GCRA, RateLimiterConfiguration(1000000000, 60));
+        AdaptiveConcurrencyConfiguration fixed;
+        fixed.initialLimit = fixed.minLimit = fixed.maxLimit = slots;
+        service.configureConcurrency(fixed);
+        if(queueing) service.configureAdmission(AdmissionSchedulerConfiguration());
+
+        // The downstream: completes each admitted request serviceTime after it got its slot
+        mutex downstreamMutex;
+        condition_variable downstreamWake;
+        deque<pair<chrono::steady_clock::time_point, AdaptiveConcurrencyLimiter::Permit>> serving;
+        bool closing = false;
+        thread downstream([&]() {
+            unique_lock<mutex> lock(downstreamMutex);
+            while(!closing || !serving.empty()){
+                if(serving.empty()){
+                    downstreamWake.wait(lock);
+                    continue;
+                }
+                auto due = serving.front().first;
+                if(chrono::steady_clock::now() < due){
+                    downstreamWake.wait_until(lock, due);
+                    continue;
+                }
+                AdaptiveConcurrencyLimiter::Permit permit = std::move(serving.front().second);
+                serving.pop_front();
+                lock.unlock();
+                permit.complete(); // May dispatch a queued request from here
+                lock.lock();
+            }
+        });
+        auto serve = [&](AdaptiveConcurrencyLimiter::Permit permit) {
+            {
+                lock_guard<mutex> lock(downstreamMutex);
+                serving.push_back({chrono::steady_clock::now() + serviceTime, std::move(permit)});
+            }
+            downstreamWake.notify_one();
+        };
+
+        array<atomic<uint64_t>, kUserTierCount> served{}, turnedAway{};
+        array<uint64_t, kUserTierCount> offered{};
+        vector<thread> clients;
+        auto start = chrono::steady_clock::now();
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            clients.emplace_back([&, tier]() {
+                auto interval = chrono::nanoseconds(1000000000 / arrivalsPerSecond[tier]);
+                auto next = start;
+                mt19937 random(tier);
+                uint64_t count = 0;
+                for(; next < start + runTime; next += interval, count++){
+                    if(chrono::steady_clock::now() < next) this_thread::sleep_until(next);
+                    string userId = string(tierNames[tier]) + "-" + to_string(random() % 1000);
+                    if(queueing){
+                        service.admitQueued((UserTier)tier, userId, [&, tier](optional<AdaptiveConcurrencyLimiter::Permit> permit) {
+                            if(!permit){
+                                turnedAway[tier]++;
+                                return;
+                            }
+                            served[tier]++;
+                            serve(std::move(*permit));
+                        });
+                    }else if(optional<AdaptiveConcurrencyLimiter::Permit> permit = service.admit((UserTier)tier, userId)){
+                        served[tier]++;
+                        serve(std::move(*permit));
+                    }else{
+                        turnedAway[tier]++;
+                    }
+                }
+                offered[tier] = count;
+            });
+        }
+        for(thread& client : clients) client.join();
+        optional<array<AdmissionTierStats, kUserTierCount>> admission;
+        if(queueing){
+            // Let the queues drain or expire, then read the waits
+            auto queuedNow = [&]() {
+                admission = service.stats().admission;
+                uint64_t queued = 0;
+                for(const AdmissionTierStats& tier : *admission) queued += tier.queued;
+                return queued;
+            };
+            while(queuedNow() > 0) this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        {
+            lock_guard<mutex> lock(downstreamMutex);
+            closing = true;
+        }
+        downstreamWake.notify_one();
+        downstream.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count(); // Including the drain
+
+        uint64_t servedTotal = 0;
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            servedTotal += served[tier];
+            cout << (queueing ? "fair queueing " : "shedding      ") << tierNames[tier] << " offered=" << offered[tier]
+                 << " served=" << 100 * served[tier] / max<uint64_t>(offered[tier], 1) << "% turned_away=" << turnedAway[tier];
+            if(admission){
+                LatencyHistogram waits = (*admission)[tier].waits;
+                waits.record(0, (*admission)[tier].immediate);
+                cout << " wait_p50_us=" << waits.percentile(50) / 1000 << " wait_p99_us=" << waits.percentile(99) / 1000;
+            }
+            cout << endl;
+        }
+        cout << (queueing ? "fair queueing " : "shedding      ") << "served/s=" << (long long)(servedTotal / seconds)
+             << " of capacity " << slots * 1000 / serviceTime.count() << "/s" << endl;
+        if(admission){
+            auto waitsOf = [&](int tier) {
+                LatencyHistogram waits = (*admission)[tier].waits;
+                waits.record(0, (*admission)[tier].immediate);
+                return waits;
+            };
+            // Enterprise is never turned away and waits far less than Free, which takes the queueing
+            bool ok = turnedAway[(int)UserTier::Enterprise] == 0 && turnedAway[(int)UserTier::Free] > 0
+                      && 10 * waitsOf((int)UserTier::Enterprise).percentile(99) < waitsOf((int)UserTier::Free).percentile(50);
+            cout << "fair queueing Enterprise p99 wait " << waitsOf((int)UserTier::Enterprise).percentile(99) / 1000 << "us vs Free p50 wait "
+                 << waitsOf((int)UserTier::Free).percentile(50) / 1000 << "us" << verdict(passed, ok) << endl;
+        }
+    }
+    return passed;
+}
+
+// Synthetic access log for `./benchmarks replay` without a trace: ten minutes of Zipf-distributed
+// background traffic for each tier, plus keys that burst across their fixed window's edge
+// (one request, then maxRequests just before the window ends and maxRequests just after)
+void writeSyntheticTrace(const string& path, int backgroundRequests, const array<RateLimiterConfiguration, kUserTierCount>& limits) {
+    struct Line {
+        long long nanos;
+        uint32_t key;
+        uint8_t tier;
+    };
+    const long long start = 1700000000ll * 1000000000, duration = 600ll * 1000000000;
+    const array<int, kUserTierCount> backgroundKeys = {50000, 5000, 500}, bursters = {200, 100, 20};
+    mt19937_64 rng(23);
+    vector<Line> lines;
+    for(int i = 0; i < backgroundRequests; i++){
+        int tier = rng() % 10 < 6 ? 0 : (rng() % 4 < 3 ? 1 : 2);
+        double u = (rng() >> 11) * 0x1.0p-53;
+        uint32_t key = (uint32_t)(pow(backgroundKeys[tier], u)) - 1; // Roughly Zipf: rank r with probability ~ 1/r
+        lines.push_back({start + (long long)(rng() % duration), key, (uint8_t)tier});
+    }
+    for(int tier = 0; tier < kUserTierCount; tier++){
+        long long window = limits[tier].timeWindowSeconds * 1000000000ll;
+        int maxRequests = limits[tier].maxRequests;
+        for(int b = 0; b < bursters[tier]; b++){
+            uint32_t key = backgroundKeys[tier] + b; // Never used by background traffic
+            long long first = start + (long long)(rng() % (duration - 2 * window));
+            lines.push_back({first, key, (uint8_t)tier});
+            for(int i = 0; i < maxRequests; i++){
+                lines.push_back({first + window - 900000000 + 800000000ll * i / maxRequests, key, (uint8_t)tier}); // Last second of the window
+                lines.push_back({first + window + 100000000 + 800000000ll * i / maxRequests, key, (uint8_t)tier}); // First second of the next
+            }
+        }
+    }
+    sort(lines.begin(), lines.end(), [](const Line& a, const Line& b) { return a.nanos < b.nanos; });
+    static const char* tierNames[kUserTierCount] = {"Free", "Premium", "Enterprise"};
+    ofstream out(path, ios::binary);
+    char buffer[96];
+    for(const Line& line : lines){
+        int length = snprintf(buffer, sizeof(buffer), "%lld.%09lld %s-%u %s\n", line.nanos / 1000000000, line.nanos % 1000000000,
+                              tierNames[line.tier], line.key, tierNames[line.tier]);
+        out.write(buffer, length);
+    }
+}
+
+// Trace replay: every algorithm decides every request of the trace under each tier's limits
+// (the service defaults, or the tier rules of a limits file), then per tier: how much each
+// admits, the worst burst it let one key have within a window, its peak state, and how often
+// each pair of algorithms agreed. SharedMemoryTokenBucket is left out: it decides like
+// LockFreeTokenBucket and its segment is host-wide.
+bool runTraceReplay(string tracePath, const string& limitsPath) {
+    static const char* tierNames[kUserTierCount] = {"Free", "Premium", "Enterprise"};
+    array<RateLimiterConfiguration, kUserTierCount> limits = {RateLimiterConfiguration(10, 60), RateLimiterConfiguration(100, 60), RateLimiterConfiguration(1000, 60)};
+    array<RateLimiterType, kUserTierCount> current = {RateLimiterType::FixedWindow, RateLimiterType::TokenBucket, RateLimiterType::SlidingWindow};
+    if(!limitsPath.empty()){
+        LimitsFile file = LimitsFile::parse(limitsPath);
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            if(!file.tiers[tier]) continue;
+            limits[tier] = file.tiers[tier]->config;
+            current[tier] = file.tiers[tier]->type;
+        }
+    }
+    bool synthetic = tracePath.empty();
+    if(synthetic){
+        tracePath = (filesystem::temp_directory_path() / ("rate-limiter-trace-" + to_string(getpid()) + ".log")).string();
+        writeSyntheticTrace(tracePath, 2000000, limits);
+    }
+    vector<RateLimiterType> types;
+    for(int type = 0; type < kRateLimiterTypeCount; type++){
+        if((RateLimiterType)type != RateLimiterType::SharedMemoryTokenBucket) types.push_back((RateLimiterType)type);
+    }
+    vector<TraceReplay::AlgorithmResult> results;
+    double seconds;
+    size_t traceBytes;
+    uint64_t malformedLines;
+    array<vector<vector<double>>, kUserTierCount> agreement;
+    {
+        AccessTrace trace(tracePath);
+        TraceReplay replay(trace, limits);
+        traceBytes = trace.size();
+        auto start = chrono::steady_clock::now();
+        results = replay.run(types);
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        malformedLines = replay.malformedLines();
+        for(int tier = 0; tier < kUserTierCount; tier++){
+            agreement[tier].assign(types.size(), vector<double>(types.size()));
+            for(size_t i = 0; i < types.size(); i++){
+                for(size_t j = 0; j < types.size(); j++) agreement[tier][i][j] = replay.agreement(tier, i, j);
+            }
+        }
+    }
+    if(synthetic) remove(tracePath.c_str());
+    uint64_t requests = 0;
+    for(const auto& tier : results[0].tiers) requests += tier.requests;
+    struct rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    cout << "replayed " << tracePath << " (" << (traceBytes >> 20) << " MiB, " << requests << " requests, " << malformedLines
+         << " malformed lines) through " << types.size() << " algorithms in " << seconds << " s, peak_rss_mib=" << usage.ru_maxrss / 1024 << endl;
+    for(const auto& result : results){
+        cout << "  " << rateLimiterTypeName(result.type) << " decisions/sec/core=" << (long long)(requests / max(result.cpuSeconds, 1e-9)) << endl;
+    }
+    for(int tier = 0; tier < kUserTierCount; tier++){
+        const RateLimiterConfiguration& config = limits[tier];
+        cout << "tier " << tierNames[tier] << ": " << config.maxRequests << " requests / " << config.timeWindowSeconds << " s, "
+             << results[0].tiers[tier].requests << " requests, current algorithm " << rateLimiterTypeName(current[tier]) << endl;
+        for(size_t i = 0; i < results.size(); i++){
+            const TraceReplay::TierResult& result = results[i].tiers[tier];
+            cout << "  [" << i << "] " << left << setw(22) << rateLimiterTypeName(results[i].type) << right
+                 << " allowed=" << fixed << setprecision(2) << 100.0 * result.allowed / max<uint64_t>(result.requests, 1) << "%"
+                 << " worst_window=" << result.worstWindow << "/" << config.maxRequests << " keys_over_limit=" << result.keysOverLimit
+                 << " peak_state_kib=" << result.peakStateBytes / 1024 << defaultfloat << setprecision(6) << endl;
+        }
+        cout << "  agreement %";
+        for(size_t j = 0; j < results.size(); j++) cout << setw(7) << ("[" + to_string(j) + "]");
+        cout << endl;
+        for(size_t i = 0; i < results.size(); i++){
+            cout << "  [" << i << "]        ";
+            for(size_t j = 0; j < results.size(); j++){
+                cout << fixed << setprecision(2) << setw(7) << 100 * agreement[tier][i][j];
+            }
+            cout << defaultfloat << setprecision(6) << endl;
+        }
+    }
+    // The exact sliding log never lets a key past its limit within a window
+    int sliding = find(types.begin(), types.end(), RateLimiterType::SlidingWindow) - types.begin();
+    bool passed = requests > 0;
+    for(int tier = 0; tier < kUserTierCount; tier++) passed = passed && results[sliding].tiers[tier].keysOverLimit == 0;
+    cout << "SlidingWindow never over limit: " << (passed ? "PASS" : "FAIL") << endl;
+    return passed;
+}
+
+// Contention stress test: many threads hammer a single user on both token buckets.
+// The window is long enough that no refill happens during the run, so each limiter
+// must admit exactly maxRequests requests no matter how the threads interleave.
+bool runContentionStressTest() {
+    const int maxRequests = 200000;
+    const int threads = max(8u, 2 * thread::hardware_concurrency());
+    const int attemptsPerThread = 2 * maxRequests / threads;
+    bool passed = true;
+    for(RateLimiterType type : {RateLimiterType::TokenBucket, RateLimiterType::LockFreeTokenBucket}){
+        unique_ptr<RateLimiter> limiter(RateLimiterFactory::createRateLimiter(type, RateLimiterConfiguration(maxRequests, 1000000)));
+        atomic<int> allowed{0};
+        double seconds = timeThreads(threads, [&](int) {
+            int local = 0;
+            for(int i = 0; i < attemptsPerThread; i++) local += limiter->allowRequest("hot-user");
+            allowed += local;
+        });
+        cout << (type == RateLimiterType::TokenBucket ? "TokenBucket" : "LockFreeTokenBucket")
+             << " threads=" << threads << " allowed=" << allowed << "/" << maxRequests
+             << " decisions/sec=" << (long long)(threads * (double)attemptsPerThread / seconds)
+             << verdict(passed, allowed == maxRequests) << endl;
+    }
+    return passed;
+}
+
+// One ./benchmarks mode; run returns false if one of its checks failed
+struct BenchmarkMode {
+    const char* name;
+    const char* arguments;
+    const char* description;
+    function<bool()> run;
+};
+
+int main(int argc, char* argv[]) {
+    auto number = [&](int index, int fallback) { return argc > index ? atoi(argv[index]) : fallback; };
+    auto text = [&](int index) { return string(argc > index ? argv[index] : ""); };
+    int cores = max(1u, thread::hardware_concurrency());
+    const vector<BenchmarkMode> modes = {
+        {"suite", "[threads] [decisionsPerThread]", "full benchmark suite (CSV)", [&]() { runBenchmarkSuite(number(2, cores), number(3, 500000)); return true; }},
+        {"bench", "", "sharded limiters as threads are added", [&]() { runShardingBenchmark(); return true; }},
+        {"keys", "", "decision cost and memory per key, 10k to 10M keys", [&]() { runKeyScalingBenchmark(); return true; }},
+        {"counter", "", "sliding window counter vs log: memory and agreement", [&]() { runSlidingWindowCounterBenchmark(); return true; }},
+        {"churn", "", "idle-key eviction under churning users", [&]() { runIdleEvictionBenchmark(); return true; }},
+        {"batch", "", "batch API vs one decision per call", [&]() { runBatchBenchmark(); return true; }},
+        {"clock", "", "precise vs coarse clock", [&]() { runClockBenchmark(); return true; }},
+        {"lease", "[threads]", "hot-key token leasing", [&]() { runTokenLeasingBenchmark(number(2, max(4, cores))); return true; }},
+        {"shm", "[processes]", "cross-process shared-memory limiter", [&]() { return runSharedMemoryBenchmark(number(2, 4)); }},
+        {"snapshot", "[users]", "snapshot + warm restart", [&]() { runSnapshotBenchmark(number(2, 1000000)); return true; }},
+        {"acquire", "[threads]", "acquire() retry-after + waiting scheduler", [&]() { return runAcquireBenchmark(number(2, 4)); }},
+        {"composite", "[threads]", "all-or-nothing multi-level limits", [&]() { return runCompositeBenchmark(number(2, 4)); }},
+        {"reload", "[threads]", "hot limits reload with state carry-over", [&]() { return runLimitsReloadBenchmark(number(2, 4)); }},
+        {"dispatch", "", "decision dispatch overhead (virtual, variant, policy)", [&]() { return runDispatchBenchmark(); }},
+        {"sketch", "", "count-min sketch error bounds, memory, throughput", [&]() { return runCountMinSketchBenchmark(); }},
+        {"server", "[eventLoops] [connections]", "decision server protocol check + loopback load", [&]() { return runDecisionServerBenchmark(number(2, 0), number(3, 4)); }},
+        {"stats", "[threads]", "instrumentation: histograms, state bytes, lock contention, SIGUSR1 dump", [&]() { return runInstrumentationBenchmark(number(2, 4)); }},
+        {"adaptive", "[threads]", "adaptive concurrency limit through a simulated brownout", [&]() { return runAdaptiveConcurrencyBenchmark(number(2, 4)); }},
+        {"fair", "[threads]", "weighted-fair admission queues vs shedding under overload", [&]() { return runAdmissionSchedulerBenchmark(number(2, 4)); }},
+        {"replay", "[traceFile] [limitsFile]", "replay an access log through every algorithm (synthetic if none)", [&]() { return runTraceReplay(text(2), text(3)); }},
+        {"stress", "", "contention stress test", [&]() { return runContentionStressTest(); }},
+    };
+    if(argc > 1){
+        for(const BenchmarkMode& mode : modes){
+            if(argv[1] == string_view(mode.name)) return mode.run() ? 0 : 1;
+        }
+    }
+    cerr << "Usage: " << argv[0] << " <mode> [arguments]" << endl;
+    for(const BenchmarkMode& mode : modes){
+        cerr << "  " << left << setw(40) << string(mode.name) + " " + mode.arguments << mode.description << endl;
+    }
+    return 2;
+}
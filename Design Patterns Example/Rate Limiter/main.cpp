@@ -1,177 +1,58 @@
-#include<bits/stdc++.h>
-#include<mutex>
-#include<chrono>
-#include<thread>
-using namespace std;
-
-enum class UserTier {
-    Free,
-    Premium,
-    Enterprise
-};
-
-enum class RateLimiterType {
-    TokenBucket,
-    FixedWindow,
-    SlidingWindow
-};
-
-class RateLimiterConfiguration {
-public:
-    int maxRequests;
-    int timeWindowSeconds;
-    RateLimiterConfiguration(int maxReq, int timeWindow) : maxRequests(maxReq), timeWindowSeconds(timeWindow) {}
-};
-
-class User {
-public:
-    string userId;
-    UserTier tier;
-    User(string id, UserTier tier) : userId(id), tier(tier) {}
-};
-
-// RateLimiter interface
-class RateLimiter {
-protected:
-    RateLimiterConfiguration config;
-public:
-    RateLimiter(RateLimiterConfiguration config) : config(config) {}
-    virtual bool allowRequest(string userId) = 0;
-};
-
-class TokenBucketRateLimiter : public RateLimiter {
-    map<string, int> userTokens; // Placeholder for user tokens
-    map<string, time_t> lastRefillTime; // Placeholder for last refill time
-    mutex mtx; // Mutex for thread safety
-public:
-    TokenBucketRateLimiter(RateLimiterConfiguration config) : RateLimiter(config) {}
-    bool allowRequest(string userId) override {
-        lock_guard<mutex> lock(mtx);
-        time_t currentTime = time(nullptr);
-        // Refill tokens based on time elapsed
-        if(lastRefillTime.find(userId) == lastRefillTime.end()){ // When user is seen for the first time
-            lastRefillTime[userId] = currentTime;
-            userTokens[userId] = config.maxRequests;
-        }else{
-            int elapsedTime = currentTime - lastRefillTime[userId];
-            int tokensToAdd = (elapsedTime * config.maxRequests) / config.timeWindowSeconds;
-            userTokens[userId] = min(config.maxRequests, userTokens[userId] + tokensToAdd);
-            lastRefillTime[userId] = currentTime;
-        }
-        if(userTokens[userId] > 0){
-            userTokens[userId]--;
-            return true;
-        }
-        return false;
+// Build: make   (or g++ -std=c++20 -O2 -pthread main.cpp; -DRATE_LIMITER_NO_STATS compiles the instrumentation out)
+#include "RateLimiter.h"
+
+// Decision daemon: serves the default tiers (or a watched limits file) until SIGINT or SIGTERM;
+// SIGUSR1 dumps stats to stderr
+int runDecisionDaemon(const string& socketPath, int tcpPort, int eventLoops, const string& limitsPath) {
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr); // Before any thread starts, so every thread inherits it
+    try{
+        RateLimiterService service;
+        if(!limitsPath.empty()) service.watchLimits(limitsPath, chrono::seconds(1));
+        service.dumpStatsOnSignal();
+        DecisionServerConfiguration configuration;
+        configuration.unixSocketPath = socketPath;
+        configuration.tcpPort = tcpPort;
+        configuration.eventLoops = eventLoops;
+        DecisionServer server(service, configuration);
+        cout << "serving on " << socketPath;
+        if(server.tcpPort() >= 0) cout << " and 127.0.0.1:" << server.tcpPort();
+        cout << " with " << server.eventLoopCount() << " event loops" << endl;
+        int received;
+        sigwait(&stopSignals, &received);
+        cout << "stopping after " << server.decisionCount() << " decisions" << endl;
+    }catch(const exception& error){
+        cerr << error.what() << endl;
+        return 1;
     }
-};
-
-class FixedWindowRateLimiter : public RateLimiter {
-    map<string, int> userRequestCount; // Placeholder for user request count
-    map<string, chrono::steady_clock::time_point> windowStartTime; // Placeholder for window start time
-    mutex mtx; // Mutex for thread safety
-public:
-    FixedWindowRateLimiter(RateLimiterConfiguration config) : RateLimiter(config) {}
-    bool allowRequest(string userId) override {
-        lock_guard<mutex> lock(mtx);
-        auto now = chrono::steady_clock::now();
-        auto windowDuration = chrono::seconds(config.timeWindowSeconds);
-        // Check if the user exists or if current window has expired
-        if(windowStartTime.find(userId) == windowStartTime.end() || now - windowStartTime[userId] > windowDuration){
-            // Start a new window
-            windowStartTime[userId] = now;
-            userRequestCount[userId] = 1;
-            return true;
-        }
-        // Within the same window, check if we can allow the request
-        if(userRequestCount[userId] < config.maxRequests){
-            userRequestCount[userId]++;
-            return true;
-        }
-        return false;
-    }
-};
-
-class SlidingWindowRateLimiter : public RateLimiter {
-    map<string, queue<chrono::steady_clock::time_point>> userTimestamps; // Placeholder for user request times
-    mutex mtx; // Mutex for thread safety
-public:
-    SlidingWindowRateLimiter(RateLimiterConfiguration config) : RateLimiter(config) {}
-    bool allowRequest(string userId) override {
-        lock_guard<mutex> lock(mtx);
-        auto now = chrono::steady_clock::now();
-        auto windowDuration = chrono::seconds(config.timeWindowSeconds);
-
-        // Get or create timestamp queue for this user
-        auto &timestamp = userTimestamps[userId];
-
-        // Remove timestamps outside the current window
-        while (!timestamp.empty() && now - timestamp.front() > windowDuration) {
-            timestamp.pop();
-        }
-
-        // Check if we can allow the request
-        if(timestamp.size() < config.maxRequests) {
-            timestamp.push(now);
-            return true;
-        }
-
-        return false;
-    }
-};
-
-// Factory to create rate limiters based on user tier
-class RateLimiterFactory {
-public:
-    static RateLimiter* createRateLimiter(UserTier tier, RateLimiterConfiguration config) {
-        switch (tier) {
-            case UserTier::Free:
-                return new FixedWindowRateLimiter(config);
-            case UserTier::Premium:
-                return new TokenBucketRateLimiter(config);
-            case UserTier::Enterprise:
-                return new SlidingWindowRateLimiter(config);
-            default:
-                return nullptr;
-        }
-    }
-};
-
-class RateLimiterService{
-private:
-    map<UserTier, RateLimiter*> rateLimiters;
-public:
-    RateLimiterService(){
-        rateLimiters[UserTier::Free] = RateLimiterFactory::createRateLimiter(UserTier::Free, RateLimiterConfiguration(10, 60));
-        rateLimiters[UserTier::Premium] = RateLimiterFactory::createRateLimiter(UserTier::Premium, RateLimiterConfiguration(100, 60));
-        rateLimiters[UserTier::Enterprise] = RateLimiterFactory::createRateLimiter(UserTier::Enterprise, RateLimiterConfiguration(1000, 60));
-    }
-    bool allowRequest(User user){
-        RateLimiter* limiter = rateLimiters[user.tier];
-        if(limiter == nullptr){
-            throw std::runtime_error("No rate limiter found for user tier");
-        }
-        bool result = limiter->allowRequest(user.userId);
-        if(result){
-            cout << "Request allowed for user: " << user.userId << endl;
-        }else{
-            cout << "Request denied for user: " << user.userId << endl;
-        }
-        return result;
+    return 0;
+}
+
+// Usage: ./main                                                  demo of RateLimiterService
+//        ./main serve <socketPath> [tcpPort] [eventLoops] [limitsFile]  run the decision daemon
+// Benchmarks and checks are built separately: ./benchmarks lists them.
+int main(int argc, char* argv[]) {
+    if(argc > 2 && string(argv[1]) == "serve"){
+        return runDecisionDaemon(argv[2], argc > 3 ? atoi(argv[3]) : -1, argc > 4 ? atoi(argv[4]) : 0, argc > 5 ? argv[5] : "");
     }
-};
 
-
-int main() {
     User* user1 = new User("user1", UserTier::Free);
     User* user2 = new User("user2", UserTier::Premium);
     User* user3 = new User("user3", UserTier::Enterprise);
 
     RateLimiterService rateLimiterService;
     for(int i = 0; i < 15; i++){
-        cout << "Request " << i+1 << " for user1: " << rateLimiterService.allowRequest(*user1) << endl;
-        cout << "Request " << i+1 << " for user2: " << rateLimiterService.allowRequest(*user2) << endl;
-        cout << "Request " << i+1 << " for user3: " << rateLimiterService.allowRequest(*user3) << endl;
+        cout << "Request " << i+1 << " for user1: " << (rateLimiterService.allowRequest(*user1) ? "allowed" : "denied") << endl;
+        cout << "Request " << i+1 << " for user2: " << (rateLimiterService.allowRequest(*user2) ? "allowed" : "denied") << endl;
+        cout << "Request " << i+1 << " for user3: " << (rateLimiterService.allowRequest(*user3) ? "allowed" : "denied") << endl;
+    }
+    DecisionTotals totals = rateLimiterService.decisionTotals();
+    const char* tierNames[] = {"Free", "Premium", "Enterprise"};
+    for(int tier = 0; tier < kUserTierCount; tier++){
+        cout << tierNames[tier] << ": " << totals.byTier[tier][1] << " allowed, " << totals.byTier[tier][0] << " denied" << endl;
     }
 
     delete user1;